@@ -0,0 +1,201 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "argh.h"
+#include "brute.h"
+#include "context.h"
+#include "cube.h"
+#include "gnns.h"
+#include "hnsw.h"
+#include "ivf.h"
+#include "lsh.h"
+#include "mnist.h"
+#include "mrng.h"
+#include "pq.h"
+#include "vptree.h"
+
+#define REPETITIONS_DEFAULT 3
+#define N_DEFAULT 10
+#define R_DEFAULT 10000
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Query Allocation Benchmark
+
+Usage:
+bench_alloc [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-n, --num-queries <n>        Use only the first n queries (default: all).
+-r, --repetitions <r>        Number of measured passes over the queries per index (default: 3).
+-N, --num-nearest <N>        Number of nearest neighbors searched (default: 10).
+-R, --radius <R>             Radius of the range searches (default: 10000).
+--skip-mrng                  Do not build the MRNG graph, its construction is quadratic.
+
+Description:
+Replaces the global operator new with a counting one, then answers the queries with every index
+through a QueryContext. The first pass grows the buffers of the context, the measured passes
+that follow must not allocate at all. Reports the allocations per query of both and the
+average query latency, and fails if any measured pass allocated.
+)""";
+#pragma endregion
+
+// The number of allocations made through the global operator new since the start of the program.
+static atomic<size_t> no_allocations(0);
+
+void *operator new(size_t size)
+{
+    no_allocations++;
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+        throw bad_alloc();
+
+    return memory;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    no_allocations++;
+    return malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+void operator delete(void *memory) noexcept { free(memory); }
+void operator delete[](void *memory) noexcept { free(memory); }
+void operator delete(void *memory, const nothrow_t &) noexcept { free(memory); }
+void operator delete[](void *memory, const nothrow_t &) noexcept { free(memory); }
+
+// Answer the queries once to warm the context up, then {repetitions} more times counting the allocations,
+// and return a row of the results table. {clean} is cleared when a measured pass allocated.
+template <typename Search>
+string Measure(const string &name, Search search, vector<MNIST_Image> &queries, int repetitions, bool &clean)
+{
+    QueryContext context;
+
+    size_t before = no_allocations;
+    for (MNIST_Image &query_image : queries)
+        search(query_image.GetImageData(), context);
+    size_t warmup_allocations = no_allocations - before;
+
+    before = no_allocations;
+    auto start = chrono::high_resolution_clock::now();
+    for (int r = 0; r < repetitions; r++)
+        for (MNIST_Image &query_image : queries)
+            search(query_image.GetImageData(), context);
+    double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+    size_t steady_allocations = no_allocations - before;
+
+    if (steady_allocations > 0)
+        clean = false;
+
+    double no_runs = (double)queries.size() * repetitions;
+    stringstream row;
+    row << left << setw(14) << name
+        << setw(20) << fixed << setprecision(2) << warmup_allocations / (double)queries.size()
+        << setw(20) << steady_allocations / no_runs
+        << setprecision(2) << seconds / no_runs * 1e6;
+
+    return row.str();
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file; // Input MNIST format file containing data vectors.
+    string query_file; // Query MNIST format file for nearest neighbor search.
+    int no_queries;    // Number of queries to use.
+    int repetitions;   // Number of measured passes over the queries per index.
+    int no_nearest;    // Number of nearest neighbors searched.
+    int radius;        // Radius of the range searches.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-n", "--num-queries"}, 0) >> no_queries;
+    cmdl({"-r", "--repetitions"}, REPETITIONS_DEFAULT) >> repetitions;
+    cmdl({"-N", "--num-nearest"}, N_DEFAULT) >> no_nearest;
+    cmdl({"-R", "--radius"}, R_DEFAULT) >> radius;
+    bool skip_mrng = cmdl["--skip-mrng"];
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    vector<MNIST_Image> queries = query.GetImages();
+    if (no_queries > 0 && no_queries < (int)queries.size())
+        queries.resize(no_queries);
+    repetitions = max(repetitions, 1);
+    int no_threads = max(thread::hardware_concurrency(), 1u);
+
+    BRUTE bf = BRUTE(input);
+    VPTree tree = VPTree(input);
+    LSH lsh = LSH(input, 4, 5);
+    Hypercube hypercube = Hypercube(input, 14, 10, 2);
+    IVF ivf = IVF(input, IVF_LISTS, IVF_PROBES, no_threads);
+    PQ pq = PQ(input, PQ_SUBSPACES, PQ_RERANK, no_threads);
+    LSH lsh_pq = LSH(input, 4, 5);
+    lsh_pq.SetPQ(&pq);
+    GNNS gnns = GNNS(input, 50, 30, 1);
+    gnns.Initialization();
+    HNSW hnsw = HNSW(input, 16, 200, 50, no_threads);
+    hnsw.Initialization();
+    MRNG mrng = MRNG(input, 20);
+    if (!skip_mrng)
+        mrng.Initialization();
+
+    bool clean = true;
+    vector<string> rows;
+    rows.push_back(Measure("BRUTE", [&](const IMAGE_DATA &q, QueryContext &c) { bf.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("VP-tree", [&](const IMAGE_DATA &q, QueryContext &c) { tree.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("LSH", [&](const IMAGE_DATA &q, QueryContext &c) { lsh.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("LSH+PQ", [&](const IMAGE_DATA &q, QueryContext &c) { lsh_pq.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("Hypercube", [&](const IMAGE_DATA &q, QueryContext &c) { hypercube.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("IVF", [&](const IMAGE_DATA &q, QueryContext &c) { ivf.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("GNNS", [&](const IMAGE_DATA &q, QueryContext &c) { gnns.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    if (!skip_mrng)
+        rows.push_back(Measure("MRNG", [&](const IMAGE_DATA &q, QueryContext &c) { mrng.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("HNSW", [&](const IMAGE_DATA &q, QueryContext &c) { hnsw.Search(q, no_nearest, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("VP-tree R", [&](const IMAGE_DATA &q, QueryContext &c) { tree.RadiusSearch(q, radius, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("LSH R", [&](const IMAGE_DATA &q, QueryContext &c) { lsh.RadiusSearch(q, radius, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("Hypercube R", [&](const IMAGE_DATA &q, QueryContext &c) { hypercube.RadiusSearch(q, radius, c); }, queries, repetitions, clean));
+    rows.push_back(Measure("IVF R", [&](const IMAGE_DATA &q, QueryContext &c) { ivf.RadiusSearch(q, radius, c); }, queries, repetitions, clean));
+
+    cout << endl
+         << left << setw(14) << "Index" << setw(20) << "Warm-up (allocs/q)" << setw(20) << "Steady (allocs/q)" << "Latency (us)" << endl;
+    for (const string &row : rows)
+        cout << row << endl;
+
+    if (!clean)
+    {
+        cout << "[!] The steady-state queries allocated memory." << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "[i] The steady-state queries did not allocate." << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argh.h"
+#include "brute.h"
+#include "mnist.h"
+#include "vptree.h"
+
+#define REPETITIONS_DEFAULT 1
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Exact Nearest Neighbor Benchmark
+
+Usage:
+bench_exact [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-n, --num-queries <n>        Use only the first n queries (default: all).
+-r, --repetitions <r>        Number of passes over the queries per configuration (default: 1).
+
+Description:
+Answers the queries exactly with BRUTE and with a VP-tree for k in {1, 10, 100}, checks that the
+VP-tree returns the same neighbor distances as BRUTE, and reports the average query latency of both
+and the fraction of the distances that the VP-tree evaluates. The pruning of the VP-tree grows
+with the size of the input, so use an input of 10K+ images for representative numbers.
+)""";
+#pragma endregion
+
+// Run every query once with the given exact method and return the total wall-clock time in seconds.
+template <typename Exact>
+double RunQueries(Exact &exact, vector<MNIST_Image> &queries, int no_neighbours, vector<set<MNIST_Image, MNIST_ImageComparator>> &answers)
+{
+    answers.resize(queries.size());
+
+    auto start = chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < queries.size(); q++)
+        answers[q] = exact.FindNearestNeighbors(no_neighbours, queries[q]);
+    auto stop = chrono::high_resolution_clock::now();
+
+    return chrono::duration<double>(stop - start).count();
+}
+
+// Count the queries whose VP-tree neighbor distances differ from the BRUTE ones.
+int CountMismatches(const vector<set<MNIST_Image, MNIST_ImageComparator>> &brute_answers, const vector<set<MNIST_Image, MNIST_ImageComparator>> &tree_answers)
+{
+    int mismatches = 0;
+    for (size_t q = 0; q < brute_answers.size(); q++)
+    {
+        bool same = brute_answers[q].size() == tree_answers[q].size();
+        for (auto it1 = brute_answers[q].begin(), it2 = tree_answers[q].begin(); same && it1 != brute_answers[q].end(); it1++, it2++)
+            same = it1->GetDist() == it2->GetDist();
+
+        if (!same)
+            mismatches++;
+    }
+
+    return mismatches;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file; // Input MNIST format file containing data vectors.
+    string query_file; // Query MNIST format file for nearest neighbor search.
+    int no_queries;    // Number of queries to use.
+    int repetitions;   // Number of passes over the queries per configuration.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-n", "--num-queries"}, 0) >> no_queries;
+    cmdl({"-r", "--repetitions"}, REPETITIONS_DEFAULT) >> repetitions;
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    vector<MNIST_Image> queries = query.GetImages();
+    if (no_queries > 0 && no_queries < (int)queries.size())
+        queries.resize(no_queries);
+    repetitions = max(repetitions, 1);
+
+    BRUTE bf = BRUTE(input);
+    auto start = chrono::high_resolution_clock::now();
+    VPTree tree = VPTree(input);
+    double build_sec = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+    vector<string> rows;
+    for (int k : {1, 10, 100})
+    {
+        vector<set<MNIST_Image, MNIST_ImageComparator>> brute_answers, tree_answers;
+        double time_brute = 0;
+        double time_tree = 0;
+
+        for (int r = 0; r < repetitions; r++)
+        {
+            time_brute += RunQueries(bf, queries, k, brute_answers);
+            time_tree += RunQueries(tree, queries, k, tree_answers);
+        }
+
+        // The distance evaluations are counted on a separate pass, the timed one goes through the same interface as BRUTE
+        size_t evaluations = 0;
+        for (MNIST_Image &query_image : queries)
+            tree.Search(query_image.GetImageData(), k, evaluations);
+
+        double no_runs = (double)queries.size() * repetitions;
+        double latency_brute = time_brute / no_runs * 1e6;
+        double latency_tree = time_tree / no_runs * 1e6;
+
+        stringstream row;
+        row << left << setw(8) << k
+            << setw(16) << fixed << setprecision(2) << latency_brute
+            << setw(16) << latency_tree
+            << setw(12) << setprecision(2) << latency_brute / latency_tree
+            << setw(16) << setprecision(1) << 100.0 * evaluations / ((double)queries.size() * tree.GetSize())
+            << CountMismatches(brute_answers, tree_answers);
+        rows.push_back(row.str());
+    }
+
+    cout << endl
+         << "[i] VP-tree built in " << fixed << setprecision(3) << build_sec << "s" << endl
+         << left << setw(8) << "k" << setw(16) << "BRUTE (us)" << setw(16) << "VP-tree (us)" << setw(12) << "Speedup" << setw(16) << "Distances (%)" << "Mismatches" << endl;
+    for (const string &row : rows)
+        cout << row << endl;
+
+    return EXIT_SUCCESS;
+}
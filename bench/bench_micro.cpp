@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "argh.h"
+#include "context.h"
+#include "cube.h"
+#include "gnns.h"
+#include "hash.h"
+#include "hnsw.h"
+#include "lsh.h"
+#include "mnist.h"
+#include "timing.h"
+
+#define REPETITIONS_DEFAULT 7
+#define MIN_TIME_DEFAULT 50 // Milliseconds that every measured run must last at least.
+#define TOP_K 10
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Microbenchmarks
+
+Usage:
+bench_micro [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-n, --sizes <n,...>          Comma separated numbers of dataset vectors, the input is repeated to reach them (default: 1000).
+-t, --threads <t,...>        Comma separated numbers of threads running every benchmark at once (default: 1).
+-r, --repetitions <r>        Number of measured runs per benchmark (default: 7).
+-m, --min-time <ms>          Minimum duration of every measured run in milliseconds (default: 50).
+-b, --bench <name,...>       Run only the benchmarks whose name contains one of the given ones (default: all).
+-o, --output <csv_file>      Also write the results to a CSV file.
+
+Benchmarks:
+distance       EuclideanDistance of a query and a dataset vector, per distance.
+hash           CalculateHashCode of a dataset vector, per h(p).
+final_hash     CalculateFinalHashCode of a dataset vector with k = 4, per g(p).
+lsh_search     LSH bucket scan, hashing and scoring of the candidates (k = 4, L = 5, N = 10), per query.
+cube_probe     Hypercube vertex enumeration alone (d' = 14, probes = 3, M = 1000), per query.
+gnns_search    GNNS graph expansion (50 LSH neighbors, E = 30, R = 1, N = 10), per query.
+hnsw_search    HNSW graph expansion (M = 16, ef = 50, N = 10), per query.
+topk_context   Top-10 maintenance of QueryContext::Offer over n random distances, per offer.
+topk_set       Top-10 maintenance of InsertNearestNeighbor over n random distances, per offer.
+mnist_load     Loading and decoding the whole input file, per load.
+
+Description:
+Every benchmark is first calibrated, doubling its number of operations until a run lasts the
+minimum time, then measured for the given repetitions. With t threads every thread runs the
+same operations at once on its own QueryContext, so ns/op is the latency a thread sees and
+Mops/s the throughput of all of them. The median of the runs is reported together with the
+fastest one and the spread (max - min) / median of the runs, which should stay in the few
+percent for two builds to be comparable. Build with `make bench` and pin the frequency of
+the CPU when possible.
+)""";
+#pragma endregion
+
+// A benchmark: its name, and the operation that thread {thread} runs {no_ops} times, returning a value that must not be optimized out.
+struct MicroBenchmark
+{
+    string name;
+    function<double(int thread, uint64_t no_ops)> run;
+};
+
+// The measurements of a benchmark for a dataset size and a number of threads.
+struct MicroResult
+{
+    string name;
+    size_t size;
+    int no_threads;
+    uint64_t no_ops;
+    double median_ns;
+    double min_ns;
+    double spread;
+    double mops;
+};
+
+// The sum of the values returned by the benchmarks, printed at the end so that no operation can be removed.
+static double sink = 0;
+
+// Split a comma separated list of positive numbers.
+vector<size_t> ParseList(const string &list)
+{
+    vector<size_t> values;
+    stringstream stream(list);
+    string value;
+    while (getline(stream, value, ','))
+    {
+        if (!value.empty() && stoll(value) > 0)
+            values.push_back(stoll(value));
+    }
+
+    return values;
+}
+
+// Run {no_ops} operations of the benchmark on every one of {no_threads} threads, released together, and return the wall-clock seconds.
+double RunOnThreads(const MicroBenchmark &bench, int no_threads, uint64_t no_ops)
+{
+    if (no_threads == 1)
+    {
+        Stopwatch stopwatch;
+        sink += bench.run(0, no_ops);
+        return stopwatch.ElapsedSeconds();
+    }
+
+    atomic<int> no_ready(0);
+    atomic<bool> go(false);
+    vector<double> results(no_threads, 0.0);
+    vector<thread> threads;
+    for (int t = 0; t < no_threads; t++)
+    {
+        threads.push_back(thread([&, t]()
+                                 {
+                                     no_ready++;
+                                     while (!go)
+                                         this_thread::yield();
+                                     results[t] = bench.run(t, no_ops); }));
+    }
+
+    while (no_ready < no_threads)
+        this_thread::yield();
+    Stopwatch stopwatch;
+    go = true;
+    for (thread &worker : threads)
+        worker.join();
+    double seconds = stopwatch.ElapsedSeconds();
+
+    for (double result : results)
+        sink += result;
+
+    return seconds;
+}
+
+// Calibrate the number of operations of the benchmark to the minimum time, then measure {repetitions} runs of them.
+MicroResult Measure(const MicroBenchmark &bench, size_t size, int no_threads, int repetitions, double min_seconds)
+{
+    uint64_t no_ops = 1;
+    while (RunOnThreads(bench, no_threads, no_ops) < min_seconds)
+        no_ops *= 2;
+
+    vector<double> ns_per_op;
+    for (int r = 0; r < repetitions; r++)
+        ns_per_op.push_back(RunOnThreads(bench, no_threads, no_ops) * 1e9 / no_ops);
+    sort(ns_per_op.begin(), ns_per_op.end());
+
+    MicroResult result;
+    result.name = bench.name;
+    result.size = size;
+    result.no_threads = no_threads;
+    result.no_ops = no_ops;
+    result.median_ns = ns_per_op[ns_per_op.size() / 2];
+    result.min_ns = ns_per_op.front();
+    result.spread = (ns_per_op.back() - ns_per_op.front()) / result.median_ns;
+    result.mops = no_threads * 1e3 / result.median_ns;
+
+    return result;
+}
+
+// Get a dataset of {size} vectors, repeating the images of the input as many times as needed.
+MNIST Resize(const MNIST &input, size_t size)
+{
+    const vector<MNIST_Image> &images = input.GetImages();
+    vector<MNIST_Image> resized;
+    resized.reserve(size);
+    for (size_t i = 0; i < size; i++)
+        resized.push_back(MNIST_Image((uint)i, images[i % images.size()].GetImageData()));
+
+    return MNIST(resized);
+}
+
+// Whether the benchmark was selected by the --bench filters.
+bool Selected(const string &name, const vector<string> &filters)
+{
+    if (filters.empty())
+        return true;
+
+    for (const string &filter : filters)
+        if (name.find(filter) != string::npos)
+            return true;
+
+    return false;
+}
+
+// Print a row of the results table.
+void PrintRow(const MicroResult &r)
+{
+    cout << left << setw(14) << r.name
+         << setw(10) << (r.size > 0 ? to_string(r.size) : "-")
+         << setw(9) << r.no_threads
+         << setw(14) << fixed << setprecision(1) << r.median_ns
+         << setw(14) << r.min_ns
+         << setw(10) << setprecision(1) << 100.0 * r.spread
+         << setprecision(3) << r.mops << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file;  // Input MNIST format file containing data vectors.
+    string query_file;  // Query MNIST format file.
+    string sizes_list;  // Comma separated dataset sizes.
+    string threads_list; // Comma separated numbers of threads.
+    int repetitions;    // Number of measured runs per benchmark.
+    int min_time;       // Minimum duration of a measured run in milliseconds.
+    string bench_list;  // Comma separated benchmark name filters.
+    string output_file; // CSV file of the results, if any.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-n", "--sizes"}, "1000") >> sizes_list;
+    cmdl({"-t", "--threads"}, "1") >> threads_list;
+    cmdl({"-r", "--repetitions"}, REPETITIONS_DEFAULT) >> repetitions;
+    cmdl({"-m", "--min-time"}, MIN_TIME_DEFAULT) >> min_time;
+    cmdl({"-b", "--bench"}) >> bench_list;
+    cmdl({"-o", "--output"}) >> output_file;
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<size_t> sizes = ParseList(sizes_list);
+    vector<size_t> thread_counts = ParseList(threads_list);
+    vector<string> filters;
+    stringstream bench_stream(bench_list);
+    for (string filter; getline(bench_stream, filter, ',');)
+        if (!filter.empty())
+            filters.push_back(filter);
+    repetitions = max(repetitions, 1);
+    double min_seconds = max(min_time, 1) / 1000.0;
+
+    if (sizes.empty() || thread_counts.empty())
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    const vector<MNIST_Image> &queries = query.GetImages();
+    size_t max_threads = *max_element(thread_counts.begin(), thread_counts.end());
+
+    vector<MicroResult> results;
+    auto run = [&](const MicroBenchmark &bench, size_t size)
+    {
+        if (!Selected(bench.name, filters))
+            return;
+
+        for (size_t no_threads : thread_counts)
+        {
+            results.push_back(Measure(bench, size, (int)no_threads, repetitions, min_seconds));
+        }
+    };
+
+    for (size_t size : sizes)
+    {
+        MNIST dataset = Resize(input, size);
+        const vector<MNIST_Image> &images = dataset.GetImages();
+        vector<IMAGE_DATA> projections = GetRandomProjections(1, 4, 42)[0];
+        vector<double> shifts = GetRandomShifts(1, 4, WINDOW, 42)[0];
+        vector<int> multipliers = GetRandomMultipliers(1, 4, 42)[0];
+
+        // Every thread walks the dataset from its own offset, so that they do not read the same vectors in lockstep.
+        auto offset = [&](int thread) { return (size_t)thread * size / max_threads; };
+
+        run({"distance", [&](int thread, uint64_t no_ops)
+             {
+                 double sum = 0;
+                 size_t i = offset(thread);
+                 const IMAGE_DATA &query_data = queries[thread % queries.size()].GetImageData();
+                 for (uint64_t op = 0; op < no_ops; op++, i = i + 1 == size ? 0 : i + 1)
+                     sum += EuclideanDistance(2, query_data, images[i].GetImageData());
+                 return sum;
+             }},
+            size);
+
+        run({"hash", [&](int thread, uint64_t no_ops)
+             {
+                 double sum = 0;
+                 size_t i = offset(thread);
+                 for (uint64_t op = 0; op < no_ops; op++, i = i + 1 == size ? 0 : i + 1)
+                     sum += CalculateHashCode(images[i].GetImageData(), projections[0], WINDOW, shifts[0]);
+                 return sum;
+             }},
+            size);
+
+        run({"final_hash", [&](int thread, uint64_t no_ops)
+             {
+                 double sum = 0;
+                 size_t i = offset(thread);
+                 for (uint64_t op = 0; op < no_ops; op++, i = i + 1 == size ? 0 : i + 1)
+                     sum += CalculateFinalHashCode(images[i].GetImageData(), projections, shifts, multipliers, 4, WINDOW);
+                 return sum;
+             }},
+            size);
+
+        // The indexes are only built when one of their benchmarks runs, and answer the queries in turn.
+        vector<QueryContext> contexts(max_threads);
+        auto query_loop = [&](function<void(const IMAGE_DATA &, QueryContext &)> search)
+        {
+            return [&, search](int thread, uint64_t no_ops)
+            {
+                QueryContext &context = contexts[thread];
+                size_t q = (size_t)thread * queries.size() / max_threads;
+                for (uint64_t op = 0; op < no_ops; op++, q = q + 1 == queries.size() ? 0 : q + 1)
+                    search(queries[q].GetImageData(), context);
+                return (double)context.GetNearest().size();
+            };
+        };
+
+        if (Selected("lsh_search", filters))
+        {
+            LSH lsh = LSH(dataset, 4, 5);
+            run({"lsh_search", query_loop([&](const IMAGE_DATA &q, QueryContext &c)
+                                          { lsh.Search(q, TOP_K, c); })},
+                size);
+        }
+
+        if (Selected("cube_probe", filters))
+        {
+            Hypercube hypercube = Hypercube(dataset, 14, 1000, 3);
+            run({"cube_probe", [&](int thread, uint64_t no_ops)
+                 {
+                     QueryContext &context = contexts[thread];
+                     double sum = 0;
+                     size_t q = (size_t)thread * queries.size() / max_threads;
+                     for (uint64_t op = 0; op < no_ops; op++, q = q + 1 == queries.size() ? 0 : q + 1)
+                     {
+                         context.Reset(0, size);
+                         hypercube.GetNearestNeighborsCandidates(queries[q].GetImageData(), context);
+                         sum += context.candidates.size();
+                     }
+                     return sum;
+                 }},
+                size);
+        }
+
+        if (Selected("gnns_search", filters))
+        {
+            GNNS gnns = GNNS(dataset, 50, 30, 1);
+            gnns.Initialization();
+            run({"gnns_search", query_loop([&](const IMAGE_DATA &q, QueryContext &c)
+                                           { gnns.Search(q, TOP_K, c); })},
+                size);
+        }
+
+        if (Selected("hnsw_search", filters))
+        {
+            HNSW hnsw = HNSW(dataset, 16, 200, 50, max(thread::hardware_concurrency(), 1u));
+            hnsw.Initialization();
+            run({"hnsw_search", query_loop([&](const IMAGE_DATA &q, QueryContext &c)
+                                           { hnsw.Search(q, TOP_K, c); })},
+                size);
+        }
+
+        // The same stream of distances for both top-k structures, drawn once per size.
+        vector<double> distances(size);
+        mt19937 generator(42);
+        uniform_real_distribution<double> distribution(0.0, 1.0);
+        for (double &dist : distances)
+            dist = distribution(generator);
+
+        run({"topk_context", [&](int thread, uint64_t no_ops)
+             {
+                 QueryContext &context = contexts[thread];
+                 double sum = 0;
+                 size_t i = offset(thread);
+                 context.Reset(TOP_K, 0);
+                 for (uint64_t op = 0; op < no_ops; op++, i = i + 1 == size ? 0 : i + 1)
+                 {
+                     if (i == 0)
+                     {
+                         sum += context.GetNearest().size();
+                         context.Reset(TOP_K, 0);
+                     }
+                     context.Offer(distances[i], (uint)i);
+                 }
+                 return sum + context.GetNearest().size();
+             }},
+            size);
+
+        run({"topk_set", [&](int thread, uint64_t no_ops)
+             {
+                 set<MNIST_Image, MNIST_ImageComparator> nearest;
+                 double sum = 0;
+                 size_t i = offset(thread);
+                 for (uint64_t op = 0; op < no_ops; op++, i = i + 1 == size ? 0 : i + 1)
+                 {
+                     if (i == 0)
+                     {
+                         sum += nearest.size();
+                         nearest.clear();
+                     }
+                     InsertNearestNeighbor(nearest, TOP_K, images[i], distances[i]);
+                 }
+                 return sum + nearest.size();
+             }},
+            size);
+    }
+
+    // Loading does not depend on the dataset size, its operation is a load of the whole input file.
+    run({"mnist_load", [&](int, uint64_t no_ops)
+         {
+             double sum = 0;
+             for (uint64_t op = 0; op < no_ops; op++)
+             {
+                 MNIST loaded_input = MNIST(input_file);
+                 sum += loaded_input.GetImagesCount();
+             }
+             return sum;
+         }},
+        0);
+
+    cout << endl
+         << left << setw(14) << "Benchmark" << setw(10) << "Size" << setw(9) << "Threads"
+         << setw(14) << "ns/op" << setw(14) << "min ns/op" << setw(10) << "spread %" << "Mops/s" << endl;
+    for (const MicroResult &r : results)
+        PrintRow(r);
+
+    if (!output_file.empty())
+    {
+        ofstream output(output_file, ios::out | ios::trunc);
+        if (!output.is_open())
+        {
+            cout << "Failed to write to output file." << endl;
+            return EXIT_FAILURE;
+        }
+
+        output << "benchmark,size,threads,ops,ns_per_op,min_ns_per_op,spread,mops" << endl;
+        for (const MicroResult &r : results)
+            output << r.name << "," << r.size << "," << r.no_threads << "," << r.no_ops << "," << r.median_ns << ","
+                   << r.min_ns << "," << r.spread << "," << r.mops << endl;
+        cout << "[i] Results written to " << output_file << endl;
+    }
+
+    cout << "[i] Checksum " << sink << endl;
+    return EXIT_SUCCESS;
+}
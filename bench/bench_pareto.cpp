@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argh.h"
+#include "cube.h"
+#include "gnns.h"
+#include "groundtruth.h"
+#include "hnsw.h"
+#include "ivf.h"
+#include "lsh.h"
+#include "mnist.h"
+#include "mrng.h"
+#include "timing.h"
+#include "vptree.h"
+
+#define GROUND_TRUTH_K 10
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Recall / QPS Benchmark for every Index
+
+Usage:
+bench_pareto [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-o, --output <csv_file>      CSV file to store the results (default: output/bench_pareto.csv).
+-j, --json <json_file>       JSON file to store the results (default: output/bench_pareto.json).
+-n, --num-queries <n>        Use only the first n queries (default: all).
+-x, --indexes <list>         Comma separated indexes to run (default: lsh,cube,gnns,mrng,hnsw,ivf,vptree).
+-g, --groundtruth <gt_file>  Ground truth file created by the groundtruth tool (default: computed in parallel).
+--seed <s>                   Seed of every index, so that the runs build the same indexes (default: 1).
+
+Description:
+Builds every index over a grid of parameters, answers the queries and compares
+the answers against the exact ground truth, which is loaded from a ground truth
+file or computed once for the whole run. For every configuration it reports recall@1, recall@10, the average and
+max approximation ratio, QPS, p50/p99 latency, build time and the memory of the
+index itself (its tables, ids, codes or edges, without the vectors that every
+index keeps), ready for plotting recall-vs-QPS Pareto curves.
+
+Grids:
+lsh   k in {4, 8},       L in {5, 10}
+cube  k in {10, 14},     M in {100, 1000},  probes in {2, 10}
+gnns  k in {20, 50},     E in {10, 30},     R in {1, 5}
+mrng  l in {20, 50}
+hnsw  M in {8, 16},      efSearch in {10, 50, 100}
+ivf   nlist in {64, 256}, nprobe in {1, 4, 16}
+vptree exact, the reference point of the curves
+)""";
+#pragma endregion
+
+// The measurements of an index configuration.
+struct BenchResult
+{
+    string index;
+    string parameters;
+    double recall_at_1;
+    double recall_at_10;
+    double avg_ratio;
+    double max_ratio;
+    double qps;
+    double p50_ms;
+    double p99_ms;
+    double build_sec;
+    double memory_mb;
+};
+
+double SecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Answer every query with the index and compare the answers against the ground truth.
+template <typename Index>
+BenchResult Evaluate(const string &name, const string &parameters, Index &index, vector<MNIST_Image> &queries,
+                     const vector<vector<MNIST_Image>> &ground_truth, double build_sec, double memory_bytes)
+{
+    LatencyHistogram latencies;
+    double recall_1 = 0, recall_10 = 0, ratio_sum = 0, max_ratio = 0;
+    int no_ratios = 0;
+
+    Stopwatch stopwatch, query_stopwatch;
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+        query_stopwatch.Restart();
+        set<MNIST_Image, MNIST_ImageComparator> nn = index.FindNearestNeighbors(GROUND_TRUTH_K, queries[q]);
+        latencies.Record(query_stopwatch.ElapsedNanoseconds());
+
+        const vector<MNIST_Image> &truth = ground_truth[q];
+        int rank = 0;
+        int hits_1 = 0, hits_10 = 0;
+        for (const MNIST_Image &neighbor : nn)
+        {
+            for (size_t t = 0; t < truth.size(); t++)
+            {
+                if (truth[t].GetIndex() == neighbor.GetIndex())
+                {
+                    hits_10++;
+                    if (rank == 0 && t == 0)
+                        hits_1++;
+                }
+            }
+
+            if (rank == 0 && !truth.empty() && truth[0].GetDist() > 0)
+            {
+                double ratio = neighbor.GetDist() / truth[0].GetDist();
+                ratio_sum += ratio;
+                max_ratio = max(max_ratio, ratio);
+                no_ratios++;
+            }
+            rank++;
+        }
+
+        recall_1 += hits_1;
+        recall_10 += (double)hits_10 / truth.size();
+    }
+    double total_sec = stopwatch.ElapsedSeconds();
+
+    BenchResult result;
+    result.index = name;
+    result.parameters = parameters;
+    result.recall_at_1 = recall_1 / queries.size();
+    result.recall_at_10 = recall_10 / queries.size();
+    result.avg_ratio = no_ratios > 0 ? ratio_sum / no_ratios : 0;
+    result.max_ratio = max_ratio;
+    result.qps = queries.size() / total_sec;
+    result.p50_ms = latencies.GetPercentile(50) * 1000;
+    result.p99_ms = latencies.GetPercentile(99) * 1000;
+    result.build_sec = build_sec;
+    result.memory_mb = memory_bytes / (1024 * 1024);
+
+    cout << left << setw(6) << result.index << setw(28) << result.parameters << fixed << setprecision(3)
+         << "recall@1 " << setw(8) << result.recall_at_1
+         << "recall@10 " << setw(8) << result.recall_at_10
+         << "QPS " << setprecision(1) << result.qps << endl;
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+
+    return result;
+}
+
+void WriteCSV(const string &file_path, const vector<BenchResult> &results)
+{
+    ofstream output(file_path, ios::out | ios::trunc);
+    output << "index,parameters,recall@1,recall@10,avg_ratio,max_ratio,qps,p50_ms,p99_ms,build_sec,memory_mb" << endl;
+    for (const BenchResult &r : results)
+    {
+        output << r.index << "," << r.parameters << "," << r.recall_at_1 << "," << r.recall_at_10 << ","
+               << r.avg_ratio << "," << r.max_ratio << "," << r.qps << "," << r.p50_ms << "," << r.p99_ms << ","
+               << r.build_sec << "," << r.memory_mb << endl;
+    }
+}
+
+void WriteJSON(const string &file_path, const vector<BenchResult> &results)
+{
+    ofstream output(file_path, ios::out | ios::trunc);
+    output << "[" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        output << "  {\"index\": \"" << r.index << "\", \"parameters\": \"" << r.parameters << "\", "
+               << "\"recall@1\": " << r.recall_at_1 << ", \"recall@10\": " << r.recall_at_10 << ", "
+               << "\"avg_ratio\": " << r.avg_ratio << ", \"max_ratio\": " << r.max_ratio << ", "
+               << "\"qps\": " << r.qps << ", \"p50_ms\": " << r.p50_ms << ", \"p99_ms\": " << r.p99_ms << ", "
+               << "\"build_sec\": " << r.build_sec << ", \"memory_mb\": " << r.memory_mb << "}"
+               << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    output << "]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file;  // Input MNIST format file containing data vectors.
+    string query_file;  // Query MNIST format file for nearest neighbor search.
+    string csv_file;    // CSV file to store the results.
+    string json_file;   // JSON file to store the results.
+    string indexes;     // Comma separated indexes to run.
+    string groundtruth_file; // Ground truth file created by the groundtruth tool.
+    int no_queries;     // Number of queries to use.
+    unsigned int seed;  // Seed of every index.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-o", "--output"}, "output/bench_pareto.csv") >> csv_file;
+    cmdl({"-j", "--json"}, "output/bench_pareto.json") >> json_file;
+    cmdl({"-n", "--num-queries"}, 0) >> no_queries;
+    cmdl({"-x", "--indexes"}, "lsh,cube,gnns,mrng,hnsw,ivf,vptree") >> indexes;
+    cmdl({"-g", "--groundtruth"}) >> groundtruth_file;
+    cmdl({"--seed"}, 1) >> seed;
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    indexes = "," + indexes + ",";
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    vector<MNIST_Image> queries = query.GetImages();
+    if (no_queries > 0 && no_queries < (int)queries.size())
+        queries.resize(no_queries);
+    if (queries.empty())
+    {
+        cout << "[!] The query file " << query_file << " has no queries." << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Load or compute the exact ground truth once for every configuration.
+    GroundTruth exact;
+    if (!groundtruth_file.empty())
+    {
+        exact.Load(groundtruth_file, input, query);
+        if (exact.GetK() < GROUND_TRUTH_K)
+        {
+            cout << "[!] The ground truth holds " << exact.GetK() << " neighbors per query, recall@10 needs " << GROUND_TRUTH_K << "." << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        cout << "[i] Computing the ground truth" << endl;
+        exact.Compute(input, query, GROUND_TRUTH_K, max(thread::hardware_concurrency(), 1u));
+    }
+
+    vector<MNIST_Image> input_images = input.GetImages();
+    vector<vector<MNIST_Image>> ground_truth;
+    for (MNIST_Image &query_image : queries)
+    {
+        set<MNIST_Image, MNIST_ImageComparator> nn = exact.FindNearestNeighbors(GROUND_TRUTH_K, query_image.GetIndex(), input_images);
+        ground_truth.push_back(vector<MNIST_Image>(nn.begin(), nn.end()));
+    }
+    input_images.clear();
+
+    vector<BenchResult> results;
+    chrono::steady_clock::time_point start;
+
+    if (indexes.find(",lsh,") != string::npos)
+    {
+        for (int k : {4, 8})
+            for (int L : {5, 10})
+            {
+                start = chrono::steady_clock::now();
+                LSH lsh = LSH(input, k, L, seed);
+                double build_sec = SecondsSince(start);
+
+                stringstream parameters;
+                parameters << "k=" << k << " L=" << L;
+                results.push_back(Evaluate("lsh", parameters.str(), lsh, queries, ground_truth, build_sec, lsh.GetMemoryBytes()));
+            }
+    }
+
+    if (indexes.find(",cube,") != string::npos)
+    {
+        for (int k : {10, 14})
+            for (int M : {100, 1000})
+                for (int probes : {2, 10})
+                {
+                    start = chrono::steady_clock::now();
+                    Hypercube hypercube = Hypercube(input, k, M, probes, seed);
+                    double build_sec = SecondsSince(start);
+
+                    stringstream parameters;
+                    parameters << "k=" << k << " M=" << M << " probes=" << probes;
+                    results.push_back(Evaluate("cube", parameters.str(), hypercube, queries, ground_truth, build_sec, hypercube.GetMemoryBytes()));
+                }
+    }
+
+    if (indexes.find(",gnns,") != string::npos)
+    {
+        for (int k : {20, 50})
+        {
+            start = chrono::steady_clock::now();
+            GNNS gnns = GNNS(input, k, 0, 0, seed);
+            gnns.Initialization();
+            double build_sec = SecondsSince(start);
+            double memory_bytes = gnns.GetMemoryBytes();
+
+            // The expansions and restarts only affect the search, so the graph is reused
+            for (int E : {10, 30})
+                for (int R : {1, 5})
+                {
+                    gnns.SetSearchParameters(E, R);
+
+                    stringstream parameters;
+                    parameters << "k=" << k << " E=" << E << " R=" << R;
+                    results.push_back(Evaluate("gnns", parameters.str(), gnns, queries, ground_truth, build_sec, memory_bytes));
+                }
+        }
+    }
+
+    if (indexes.find(",mrng,") != string::npos)
+    {
+        for (int l : {20, 50})
+        {
+            start = chrono::steady_clock::now();
+            MRNG mrng = MRNG(input, l);
+            mrng.Initialization();
+            double build_sec = SecondsSince(start);
+
+            stringstream parameters;
+            parameters << "l=" << l;
+            results.push_back(Evaluate("mrng", parameters.str(), mrng, queries, ground_truth, build_sec, mrng.GetMemoryBytes()));
+        }
+    }
+
+    if (indexes.find(",hnsw,") != string::npos)
+    {
+        for (int M : {8, 16})
+        {
+            start = chrono::steady_clock::now();
+            HNSW hnsw = HNSW(input, M, 200, 0, max(thread::hardware_concurrency(), 1u), seed);
+            hnsw.Initialization();
+            double build_sec = SecondsSince(start);
+            double memory_bytes = hnsw.GetMemoryBytes();
+
+            for (int ef : {10, 50, 100})
+            {
+                hnsw.SetEfSearch(ef);
+
+                stringstream parameters;
+                parameters << "M=" << M << " efSearch=" << ef;
+                results.push_back(Evaluate("hnsw", parameters.str(), hnsw, queries, ground_truth, build_sec, memory_bytes));
+            }
+        }
+    }
+
+    if (indexes.find(",ivf,") != string::npos)
+    {
+        for (int nlist : {64, 256})
+        {
+            start = chrono::steady_clock::now();
+            IVF ivf = IVF(input, nlist, 1, max(thread::hardware_concurrency(), 1u), seed);
+            double build_sec = SecondsSince(start);
+            double memory_bytes = ivf.GetMemoryBytes();
+
+            // The number of probed lists only affects the search, so the lists are reused
+            for (int nprobe : {1, 4, 16})
+            {
+                ivf.SetProbes(nprobe);
+
+                stringstream parameters;
+                parameters << "nlist=" << nlist << " nprobe=" << nprobe;
+                results.push_back(Evaluate("ivf", parameters.str(), ivf, queries, ground_truth, build_sec, memory_bytes));
+            }
+        }
+    }
+
+    if (indexes.find(",vptree,") != string::npos)
+    {
+        start = chrono::steady_clock::now();
+        VPTree tree = VPTree(input);
+        double build_sec = SecondsSince(start);
+
+        results.push_back(Evaluate("vptree", "exact", tree, queries, ground_truth, build_sec, tree.GetMemoryBytes()));
+    }
+
+    WriteCSV(csv_file, results);
+    WriteJSON(json_file, results);
+    cout << "[i] Wrote " << results.size() << " configurations to " << csv_file << " and " << json_file << endl;
+
+    return EXIT_SUCCESS;
+}
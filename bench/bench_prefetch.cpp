@@ -0,0 +1,133 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argh.h"
+#include "gnns.h"
+#include "mrng.h"
+#include "mnist.h"
+
+#define REPETITIONS_DEFAULT 5
+#define E_DEFAULT 50
+#define l_DEFAULT 30
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Graph Search Prefetching Benchmark
+
+Usage:
+bench_prefetch [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-r, --repetitions <r>        Number of passes over the queries per configuration (default: 5).
+-l, --num-candidates <l>     Number of candidates of the MRNG search (default: 30).
+--skip-mrng                  Do not build the MRNG graph, its construction is quadratic.
+
+Description:
+Builds a GNNS graph of degree 30, 40 and 50 and an MRNG graph, then measures the
+average query latency of the graph search with and without prefetching the
+neighbors' vectors. The two variants run interleaved on the same graph.
+Prefetching only pays off once the dataset no longer fits in the cache, so use
+an input of 10K+ images for representative numbers.
+)""";
+#pragma endregion
+
+// Run every query once and return the total wall-clock time in seconds.
+template <typename GraphSearch>
+double RunQueries(GraphSearch &graph_search, vector<MNIST_Image> &queries)
+{
+    auto start = chrono::high_resolution_clock::now();
+    for (MNIST_Image &query_image : queries)
+        graph_search.FindNearestNeighbors(1, query_image);
+    auto stop = chrono::high_resolution_clock::now();
+
+    return chrono::duration<double>(stop - start).count();
+}
+
+// Measure the average latency per query without and with prefetching and return a row of the results table.
+template <typename GraphSearch>
+string Measure(const string &name, int degree, GraphSearch &graph_search, vector<MNIST_Image> &queries, int repetitions)
+{
+    double time_plain = 0;
+    double time_prefetch = 0;
+
+    for (int r = 0; r < repetitions; r++)
+    {
+        graph_search.SetPrefetchDistance(0);
+        time_plain += RunQueries(graph_search, queries);
+
+        graph_search.SetPrefetchDistance(PREFETCH_DISTANCE);
+        time_prefetch += RunQueries(graph_search, queries);
+    }
+
+    double no_queries = (double)queries.size() * repetitions;
+    double latency_plain = time_plain / no_queries * 1e6;
+    double latency_prefetch = time_prefetch / no_queries * 1e6;
+
+    stringstream row;
+    row << left << setw(8) << name
+        << setw(8) << degree
+        << setw(16) << fixed << setprecision(2) << latency_plain
+        << setw(16) << latency_prefetch
+        << setprecision(1) << 100.0 * (latency_plain - latency_prefetch) / latency_plain << "%";
+
+    return row.str();
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file; // Input MNIST format file containing data vectors.
+    string query_file; // Query MNIST format file for nearest neighbor search.
+    int repetitions;   // Number of passes over the queries per configuration.
+    int no_candidates; // Number of candidates of the MRNG search.
+    bool skip_mrng;    // Do not build the MRNG graph.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-r", "--repetitions"}, REPETITIONS_DEFAULT) >> repetitions;
+    cmdl({"-l", "--num-candidates"}, l_DEFAULT) >> no_candidates;
+    skip_mrng = cmdl[{"--skip-mrng"}];
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    vector<MNIST_Image> queries = query.GetImages();
+    int degrees[] = {30, 40, 50};
+
+    // The graphs are built and measured one at a time, each of them holds its own copies of the dataset.
+    vector<string> rows;
+    for (int degree : degrees)
+    {
+        GNNS gnns = GNNS(input, degree, E_DEFAULT, 1);
+        gnns.Initialization();
+        rows.push_back(Measure("GNNS", degree, gnns, queries, repetitions));
+    }
+
+    if (!skip_mrng)
+    {
+        MRNG mrng = MRNG(input, no_candidates);
+        mrng.Initialization();
+        rows.push_back(Measure("MRNG", 0, mrng, queries, repetitions));
+    }
+
+    cout << endl
+         << left << setw(8) << "Graph" << setw(8) << "Degree" << setw(16) << "Plain (us)" << setw(16) << "Prefetch (us)" << "Reduction" << endl;
+    for (const string &row : rows)
+        cout << row << endl;
+
+    return EXIT_SUCCESS;
+}
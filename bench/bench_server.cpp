@@ -0,0 +1,295 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "argh.h"
+#include "brute.h"
+#include "context.h"
+#include "mnist.h"
+#include "server.h"
+#include "timing.h"
+
+#define N_DEFAULT 10
+#define WORKERS_DEFAULT 4
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Query Server Protocol Benchmark
+
+Usage:
+bench_server [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-q, --query <query_file>     Query MNIST format file (default: data/query.1K.dat).
+-N, --num-nearest <N>        Number of nearest neighbors searched (default: 10).
+-w, --workers <w>            Number of workers of the server (default: 4).
+-b, --batch <b>              Number of requests that a worker takes at once (default: 32).
+
+Description:
+Serves a Brute Force index through the binary protocol of the query server over a pair of pipes,
+sends every query as a kNN request, half as float32 and half as uint8 coordinates, and checks every
+response against Brute Force. It also checks the requests that must not be answered normally: a k
+past the size of the dataset is clamped to it, wrong dimensions are a bad request, a range request
+to an index without range search is unsupported, a search that throws fails only its own request,
+and a shutdown request is answered last. Reports the requests per second and fails on any violation.
+)""";
+#pragma endregion
+
+// A response of the server, by the id of its request.
+struct Response
+{
+    uint8_t status;
+    vector<pair<uint32_t, float>> neighbors;
+};
+
+// Append a request to the bytes sent to the server, {query} is ignored by shutdown requests.
+void AppendRequest(vector<char> &bytes, uint8_t type, uint8_t element, uint16_t dimensions, uint32_t id,
+                   uint32_t parameter, const IMAGE_DATA &query)
+{
+    char header[REQUEST_HEADER_SIZE];
+    header[0] = (char)type;
+    header[1] = (char)element;
+    memcpy(header + 2, &dimensions, sizeof(dimensions));
+    memcpy(header + 4, &id, sizeof(id));
+    memcpy(header + 8, &parameter, sizeof(parameter));
+    bytes.insert(bytes.end(), header, header + REQUEST_HEADER_SIZE);
+
+    if (type == SHUTDOWN_REQUEST)
+        return;
+
+    for (size_t d = 0; d < dimensions; d++)
+    {
+        double value = d < DIMENSIONS ? query[d] : 0.0;
+        if (element == UINT8_ELEMENT)
+        {
+            bytes.push_back((char)(uint8_t)value);
+        }
+        else
+        {
+            float coordinate = (float)value;
+            char coordinate_bytes[sizeof(float)];
+            memcpy(coordinate_bytes, &coordinate, sizeof(float));
+            bytes.insert(bytes.end(), coordinate_bytes, coordinate_bytes + sizeof(float));
+        }
+    }
+}
+
+// Send the requests to the server through a pipe and collect its responses from another, by request id.
+// Returns false when the response stream is corrupt or an id was answered twice.
+bool Exchange(QueryServer &server, const vector<char> &requests, map<uint32_t, Response> &responses)
+{
+    int in_pipe[2], out_pipe[2];
+    if (pipe(in_pipe) != 0 || pipe(out_pipe) != 0)
+        throw runtime_error("Failed to create the pipes: " + string(strerror(errno)) + ".\n");
+
+    thread writer([&]() {
+        for (size_t written = 0; written < requests.size();)
+        {
+            ssize_t n = write(in_pipe[1], requests.data() + written, requests.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        close(in_pipe[1]);
+    });
+
+    // The server closes neither end, the reader sees the end of the responses once it returned
+    thread serving([&]() {
+        server.Serve(-1, in_pipe[0], out_pipe[1]);
+        close(in_pipe[0]);
+        close(out_pipe[1]);
+    });
+
+    vector<char> bytes;
+    vector<char> chunk(SERVER_READ_CHUNK);
+    ssize_t n;
+    while ((n = read(out_pipe[0], chunk.data(), chunk.size())) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        bytes.insert(bytes.end(), chunk.begin(), chunk.begin() + n);
+    }
+    close(out_pipe[0]);
+    writer.join();
+    serving.join();
+
+    size_t offset = 0;
+    while (bytes.size() - offset >= RESPONSE_HEADER_SIZE)
+    {
+        uint32_t id, count;
+        memcpy(&id, bytes.data() + offset, sizeof(id));
+        memcpy(&count, bytes.data() + offset + 8, sizeof(count));
+        if (responses.count(id) > 0 || bytes.size() - offset - RESPONSE_HEADER_SIZE < (size_t)count * RESPONSE_NEIGHBOR_SIZE)
+            return false;
+
+        Response &response = responses[id];
+        response.status = (uint8_t)bytes[offset + 4];
+        offset += RESPONSE_HEADER_SIZE;
+        for (uint32_t i = 0; i < count; i++, offset += RESPONSE_NEIGHBOR_SIZE)
+        {
+            pair<uint32_t, float> neighbor;
+            memcpy(&neighbor.first, bytes.data() + offset, sizeof(uint32_t));
+            memcpy(&neighbor.second, bytes.data() + offset + 4, sizeof(float));
+            response.neighbors.push_back(neighbor);
+        }
+    }
+
+    return offset == bytes.size();
+}
+
+// Check that a response has the expected status and number of neighbors, and report it otherwise.
+int CheckResponse(const map<uint32_t, Response> &responses, uint32_t id, const string &name, uint8_t status, size_t count)
+{
+    map<uint32_t, Response>::const_iterator response = responses.find(id);
+    if (response == responses.end())
+    {
+        cout << "[!] The " << name << " request was not answered." << endl;
+        return 1;
+    }
+    if (response->second.status != status || response->second.neighbors.size() != count)
+    {
+        cout << "[!] The " << name << " request was answered with status " << (int)response->second.status << " and "
+             << response->second.neighbors.size() << " neighbors, instead of " << (int)status << " and " << count << "." << endl;
+        return 1;
+    }
+
+    cout << "[i] The " << name << " request was answered with status " << (int)status << " and " << count << " neighbors." << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file; // Input MNIST format file containing data vectors.
+    string query_file; // Query MNIST format file.
+    int no_nearest;    // Number of nearest neighbors searched.
+    int no_workers;    // Number of workers of the server.
+    int batch_size;    // Number of requests that a worker takes at once.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-q", "--query"}, "data/query.1K.dat") >> query_file;
+    cmdl({"-N", "--num-nearest"}, N_DEFAULT) >> no_nearest;
+    cmdl({"-w", "--workers"}, WORKERS_DEFAULT) >> no_workers;
+    cmdl({"-b", "--batch"}, SERVER_BATCH) >> batch_size;
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    // The server keeps writing to the pipes of the test, a write after the reader is gone must not kill it
+    signal(SIGPIPE, SIG_IGN);
+
+    MNIST input = MNIST(input_file);
+    vector<MNIST_Image> queries = MNIST(query_file).GetImages();
+    uint32_t no_images = input.GetImagesCount();
+    BRUTE bf = BRUTE(input);
+    QueryServer::SearchFunction knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { bf.Search(q, k, c); };
+
+    // Every query as a kNN request, then the requests that must be rejected or clamped, and the shutdown last
+    uint32_t huge_k_id = queries.size(), bad_dimensions_id = huge_k_id + 1, range_id = huge_k_id + 2, shutdown_id = huge_k_id + 3;
+    vector<char> requests;
+    for (uint32_t q = 0; q < queries.size(); q++)
+        AppendRequest(requests, KNN_REQUEST, q % 2 == 0 ? FLOAT32_ELEMENT : UINT8_ELEMENT, DIMENSIONS, q, no_nearest,
+                      queries[q].GetImageData());
+    IMAGE_DATA query = queries.empty() ? IMAGE_DATA() : queries[0].GetImageData();
+    AppendRequest(requests, KNN_REQUEST, UINT8_ELEMENT, DIMENSIONS, huge_k_id, 0x7FFFFFFF, query);
+    AppendRequest(requests, KNN_REQUEST, UINT8_ELEMENT, DIMENSIONS - 1, bad_dimensions_id, no_nearest, query);
+    AppendRequest(requests, RANGE_REQUEST, UINT8_ELEMENT, DIMENSIONS, range_id, 10000, query);
+    AppendRequest(requests, SHUTDOWN_REQUEST, UINT8_ELEMENT, 0, shutdown_id, 0, query);
+
+    QueryServer server(knn, QueryServer::SearchFunction(), no_images, no_workers, batch_size);
+    map<uint32_t, Response> responses;
+    Stopwatch stopwatch;
+    bool intact = Exchange(server, requests, responses);
+    double seconds = stopwatch.ElapsedSeconds();
+
+    int no_violations = intact ? 0 : 1;
+    if (!intact)
+        cout << "[!] The response stream is corrupt." << endl;
+
+    // Every kNN response must be the one of Brute Force, up to the float precision of the distances
+    QueryContext &context = ThreadQueryContext();
+    int no_wrong = 0;
+    for (uint32_t q = 0; q < queries.size(); q++)
+    {
+        map<uint32_t, Response>::const_iterator response = responses.find(q);
+        if (response == responses.end() || response->second.status != STATUS_OK)
+        {
+            no_wrong++;
+            continue;
+        }
+
+        IMAGE_DATA sent = queries[q].GetImageData();
+        if (q % 2 == 0)
+            for (double &coordinate : sent)
+                coordinate = (float)coordinate;
+        bf.Search(sent, no_nearest, context);
+
+        const vector<Neighbor> &nearest = context.GetNearest();
+        bool same = nearest.size() == response->second.neighbors.size();
+        for (size_t i = 0; same && i < nearest.size(); i++)
+            same = fabs(nearest[i].first - response->second.neighbors[i].second) <= 1e-5 * max(nearest[i].first, 1.0);
+        if (!same)
+            no_wrong++;
+    }
+    cout << "[i] " << queries.size() - no_wrong << " of " << queries.size() << " kNN requests were answered as Brute Force does." << endl;
+    no_violations += no_wrong;
+
+    no_violations += CheckResponse(responses, huge_k_id, "huge k", STATUS_OK, no_images);
+    no_violations += CheckResponse(responses, bad_dimensions_id, "wrong dimensions", STATUS_BAD_REQUEST, 0);
+    no_violations += CheckResponse(responses, range_id, "unsupported range", STATUS_UNSUPPORTED, 0);
+    no_violations += CheckResponse(responses, shutdown_id, "shutdown", STATUS_OK, 0);
+
+    LatencyHistogram latencies = server.GetLatencies();
+    cout << "[i] " << responses.size() / seconds << " requests/s with " << max(no_workers, 1) << " workers, latency p50 "
+         << latencies.GetPercentile(50) * 1e6 << " us, p99 " << latencies.GetPercentile(99) * 1e6 << " us" << endl;
+
+    // A search that throws, e.g. out of memory, fails its own request only, and the server goes on
+    QueryServer::SearchFunction failing = [&](const IMAGE_DATA &q, int k, QueryContext &c)
+    {
+        if (k > 1)
+            throw bad_alloc();
+        bf.Search(q, k, c);
+    };
+    QueryServer failing_server(failing, QueryServer::SearchFunction(), no_images, 1, batch_size);
+    requests.clear();
+    AppendRequest(requests, KNN_REQUEST, UINT8_ELEMENT, DIMENSIONS, 0, 1, query);
+    AppendRequest(requests, KNN_REQUEST, UINT8_ELEMENT, DIMENSIONS, 1, no_nearest, query);
+    AppendRequest(requests, KNN_REQUEST, UINT8_ELEMENT, DIMENSIONS, 2, 1, query);
+    responses.clear();
+    if (!Exchange(failing_server, requests, responses))
+    {
+        cout << "[!] The response stream of the failing search is corrupt." << endl;
+        no_violations++;
+    }
+    no_violations += CheckResponse(responses, 0, "search before the failed one", STATUS_OK, 1);
+    no_violations += CheckResponse(responses, 1, "failed search", STATUS_ERROR, 0);
+    no_violations += CheckResponse(responses, 2, "search after the failed one", STATUS_OK, 1);
+
+    if (no_violations > 0)
+    {
+        cout << "[!] Found " << no_violations << " violations." << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "[i] Every response was checked." << endl;
+    return EXIT_SUCCESS;
+}
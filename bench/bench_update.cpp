@@ -0,0 +1,244 @@
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "argh.h"
+#include "context.h"
+#include "cube.h"
+#include "gnns.h"
+#include "hash.h"
+#include "lsh.h"
+#include "mnist.h"
+#include "mrng.h"
+#include "pq.h"
+#include "timing.h"
+
+#define INITIAL_DEFAULT 250
+#define ROUNDS_DEFAULT 3
+#define N_DEFAULT 10
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+LSH Update Benchmark
+
+Usage:
+bench_update [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors (default: data/input.1K.dat).
+-b, --build <b>              Number of images the index is built on, the rest are inserted (default: 250).
+-r, --rounds <r>             Number of rounds that erase half of the live images and insert them back (default: 3).
+-N, --num-nearest <N>        Number of nearest neighbors searched (default: 10).
+--seed <s>                   Seed of the erased images (default: 1).
+
+Description:
+Builds an LSH index on the first images of the input, inserts the rest one by one, then erases
+and inserts back half of the live images for a number of rounds. After every phase each live
+image searches for its nearest neighbors and the results are checked: no erased image may be
+returned, every distance must be the exact one to the image stored under that index, and the
+image itself must come first at distance 0. It also checks that the tables grow with the
+inserts, that the slots of the erased images are reused, and that an index scoring its candidates
+with PQ rejects inserts, since the codec has no codes for them. Nor may LSH, Hypercube, GNNS or MRNG
+take a codec of another dataset. Fails on any violation.
+)""";
+#pragma endregion
+
+// Search every live image and check its results against the images that the index should hold.
+// Returns the number of violations found.
+int Check(const string &phase, LSH &lsh, const vector<IMAGE_DATA> &stored, const vector<bool> &live, int no_nearest)
+{
+    QueryContext context;
+    int no_violations = 0;
+    int no_queries = 0;
+    Stopwatch stopwatch;
+
+    for (uint index = 0; index < stored.size(); index++)
+    {
+        if (!live[index])
+            continue;
+
+        lsh.Search(stored[index], no_nearest, context);
+        no_queries++;
+
+        const vector<Neighbor> &nearest = context.GetNearest();
+        if (nearest.empty() || nearest[0].first != 0.0)
+        {
+            no_violations++;
+            continue;
+        }
+
+        for (const Neighbor &neighbor : nearest)
+        {
+            if (neighbor.second >= live.size() || !live[neighbor.second])
+            {
+                no_violations++;
+                continue;
+            }
+
+            double dist = EuclideanDistance(2, stored[index], stored[neighbor.second]);
+            if (fabs(dist - neighbor.first) > 1e-6 * max(dist, 1.0))
+                no_violations++;
+        }
+    }
+
+    cout << "[i] " << phase << ": " << lsh.GetSize() << " live images, " << lsh.GetSlotsCount() << " slots, "
+         << lsh.GetTableSize() << " buckets per table, " << lsh.GetTombstonesCount() << " tombstones, "
+         << no_violations << " violations (" << stopwatch.ElapsedSeconds() / max(no_queries, 1) * 1e6 << " us/query)" << endl;
+
+    return no_violations;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file; // Input MNIST format file containing data vectors.
+    int no_built;      // Number of images the index is built on.
+    int no_rounds;     // Number of erase and insert rounds.
+    int no_nearest;    // Number of nearest neighbors searched.
+    int seed;          // Seed of the erased images.
+
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}, "data/input.1K.dat") >> input_file;
+    cmdl({"-b", "--build"}, INITIAL_DEFAULT) >> no_built;
+    cmdl({"-r", "--rounds"}, ROUNDS_DEFAULT) >> no_rounds;
+    cmdl({"-N", "--num-nearest"}, N_DEFAULT) >> no_nearest;
+    cmdl({"--seed"}, 1) >> seed;
+
+    if (cmdl[{"-h", "--help"}])
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<MNIST_Image> images = MNIST(input_file).GetImages();
+    no_built = min(max(no_built, 1), (int)images.size());
+
+    // The images that the index should hold, by the index that it assigned to them.
+    vector<IMAGE_DATA> stored;
+    vector<bool> live;
+    for (int j = 0; j < no_built; j++)
+    {
+        stored.push_back(images[j].GetImageData());
+        live.push_back(true);
+    }
+
+    LSH lsh = LSH(MNIST(vector<MNIST_Image>(images.begin(), images.begin() + no_built)), 4, 5);
+    uint initial_table_size = lsh.GetTableSize();
+    int no_violations = Check("Built", lsh, stored, live, no_nearest);
+
+    // Insert the rest of the images, the tables have to grow with them.
+    for (size_t j = no_built; j < images.size(); j++)
+    {
+        uint index = lsh.Insert(images[j].GetImageData());
+        if (index != stored.size())
+            no_violations++;
+        stored.push_back(images[j].GetImageData());
+        live.push_back(true);
+    }
+    no_violations += Check("Inserted", lsh, stored, live, no_nearest);
+    if (images.size() >= 4 * (size_t)no_built && lsh.GetTableSize() <= initial_table_size)
+    {
+        cout << "[!] The tables did not grow with the inserted images." << endl;
+        no_violations++;
+    }
+
+    // Erase half of the live images and insert them back, the freed slots have to be reused.
+    default_random_engine generator(seed);
+    int peak_slots = lsh.GetSlotsCount();
+    for (int round = 1; round <= no_rounds; round++)
+    {
+        vector<IMAGE_DATA> erased_images;
+        for (uint index = 0; index < stored.size(); index++)
+        {
+            if (!live[index] || generator() % 2 == 0)
+                continue;
+
+            if (!lsh.Erase(index) || lsh.Contains(index) || lsh.Erase(index))
+                no_violations++;
+            live[index] = false;
+            erased_images.push_back(stored[index]);
+        }
+        no_violations += Check("Round " + to_string(round) + " erased", lsh, stored, live, no_nearest);
+
+        lsh.Compact();
+        for (const IMAGE_DATA &data : erased_images)
+        {
+            uint index = lsh.Insert(data);
+            if (index < live.size() && live[index])
+                no_violations++;
+            if (index >= stored.size())
+            {
+                stored.resize(index + 1);
+                live.resize(index + 1, false);
+            }
+            stored[index] = data;
+            live[index] = true;
+        }
+        no_violations += Check("Round " + to_string(round) + " inserted", lsh, stored, live, no_nearest);
+
+        if (lsh.GetSlotsCount() > peak_slots)
+        {
+            cout << "[!] The erased slots were not reused." << endl;
+            no_violations++;
+        }
+    }
+
+    // The codec only encoded the images it was trained with, so an index scored with it must not take new ones.
+    MNIST built = MNIST(vector<MNIST_Image>(images.begin(), images.begin() + no_built));
+    PQ pq = PQ(built, PQ_SUBSPACES);
+    LSH lsh_pq = LSH(built, 4, 5);
+    lsh_pq.SetPQ(&pq);
+    try
+    {
+        lsh_pq.Insert(images[0].GetImageData());
+        cout << "[!] The LSH index scored with PQ accepted an insert." << endl;
+        no_violations++;
+    }
+    catch (const runtime_error &error)
+    {
+        cout << "[i] The LSH index scored with PQ rejected the insert: " << error.what();
+    }
+
+    // Nor may any index take the codec of another dataset, its codes would be read past their end
+    auto expect_rejected = [&](const string &name, function<void()> set_pq)
+    {
+        try
+        {
+            set_pq();
+            cout << "[!] The " << name << " took the PQ codec of another dataset." << endl;
+            no_violations++;
+        }
+        catch (const runtime_error &error)
+        {
+            cout << "[i] The " << name << " rejected the PQ codec of another dataset: " << error.what();
+        }
+    };
+    MNIST all = MNIST(images);
+    if (images.size() != built.GetImagesCount())
+    {
+        LSH lsh_all = LSH(all, 4, 5);
+        Hypercube hypercube = Hypercube(all, 4, 10, 2);
+        GNNS gnns = GNNS(all, 10, 10, 1);
+        MRNG mrng = MRNG(all, 10);
+        expect_rejected("LSH index", [&]() { lsh_all.SetPQ(&pq); });
+        expect_rejected("Hypercube", [&]() { hypercube.SetPQ(&pq); });
+        expect_rejected("GNNS graph", [&]() { gnns.SetPQ(&pq); });
+        expect_rejected("MRNG graph", [&]() { mrng.SetPQ(&pq); });
+    }
+
+    if (no_violations > 0)
+    {
+        cout << "[!] Found " << no_violations << " violations." << endl;
+        return EXIT_FAILURE;
+    }
+
+    cout << "[i] Every update was checked." << endl;
+    return EXIT_SUCCESS;
+}
@@ -3,6 +3,7 @@
 
 #include <set>
 
+#include "context.h"
 #include "hash.h"
 #include "mnist.h"
 
@@ -19,31 +20,26 @@ public:
         images = _input.GetImages();
     }
 
-    // Find the {no_neighbors} Nearest Neighbors using Brute Force.
-    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
+    // Find the {no_neighbours} Nearest Neighbors of the query using Brute Force, into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query, int no_neighbours, QueryContext &context)
     {
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors; // Used for sorting the final vector of ANN
-        double min_dist = pow(2, 32) - 5;
+        context.Reset(no_neighbours, images.size());
 
+        // The distances span every dimension, so that BRUTE stays exact even when the other indexes search reduced vectors
+        // Every image is offered to the context, which only keeps it while it is one of the {no_neighbours} nearest so far
+        STATS_ADD(context.stats, CANDIDATES, images.size());
+        STATS_TIMER(context.stats, DISTANCE_NS);
         for (int i = 0; i < (int)images.size(); i++)
-        {
-            double dist = EuclideanDistance(2, query_image.GetImageData(), images[i].GetImageData());
-            images[i].SetDist(dist);
-
-            if (dist < min_dist)
-            {
-                if ((int)nearest_neighbors.size() == no_neighbours)
-                    nearest_neighbors.erase(--nearest_neighbors.end());
-
-                nearest_neighbors.insert(images[i]);
+            context.Offer(EuclideanDistance(2, query, images[i].GetImageData(), DIMENSIONS), i);
+    }
 
-                set<MNIST_Image, MNIST_ImageComparator>::reverse_iterator itr = nearest_neighbors.rbegin();
-                MNIST_Image last_image = *itr;
-                min_dist = last_image.GetDist();
-            }
-        }
+    // Find the {no_neighbors} Nearest Neighbors using Brute Force.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_neighbours, context);
 
-        return nearest_neighbors;
+        return context.GetNearestSet(images);
     }
 };
 
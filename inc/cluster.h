@@ -1,20 +1,44 @@
 #ifndef CLUSTER_H
 #define CLUSTER_H
 
+#include <algorithm>
 #include <array>
-#include <chrono>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <random>
 
 #include "mnist.h"
 #include "cube.h"
 #include "lsh.h"
+#include "stream.h"
+#include "timing.h"
 
 #define START_RANGE 10000
+#define STREAM_INIT_SAMPLE 10000 // Number of points sampled from a streamed dataset to initialize the centers.
+#define RANGE_STEPS 16          // Maximum number of radius doublings of the range search assignment per iteration.
+#define RANGE_MIN_CLAIMED 0.01  // Fraction of the points a radius doubling must claim for the range search to keep growing.
+#define CLUSTER_POINT_BLOCK 64  // Number of points whose distances to the centers are computed as one matrix product.
+#define CLUSTER_CENTER_BLOCK 16 // Number of centers per tile of the matrix product, small enough to stay in the cache.
+#define MINIBATCH_SIZE 1024     // Default number of points sampled per mini-batch iteration.
+#define MINIBATCH_HOLDOUT 1000  // Default number of points kept aside to track the inertia of mini-batch k-means.
+#define MINIBATCH_ITERATIONS 500 // Maximum number of mini-batch iterations.
+#define MINIBATCH_EVALUATION 10  // Number of mini-batch iterations between two evaluations of the holdout inertia.
+#define MINIBATCH_TOLERANCE 1e-3 // Relative holdout inertia improvement below which an evaluation counts as stalled.
+#define MINIBATCH_PATIENCE 3     // Number of stalled evaluations after which mini-batch k-means stops.
+#define KMEANS_PARALLEL_ROUNDS 5 // Number of oversampling rounds of the k-means|| initialization.
+#define KMEANS_PARALLEL_FACTOR 2 // Expected number of candidates sampled per round, as a multiple of the number of clusters.
+#define KMEANS_PARALLEL_BLOCK 1024 // Number of points per work item of the initialization, each sampled with its own generator.
+#define SILHOUETTE_SAMPLE 100    // Default number of points per cluster whose silhouette is computed, 0 to compute it for every point.
+#define SILHOUETTE_BATCH 16      // Number of evaluated points scanned together against each block of the dataset.
+#define SILHOUETTE_BLOCK 128     // Number of dataset points per block, small enough to stay in the cache.
+#define SILHOUETTE_Z 1.96        // Normal quantile of the 95% confidence bounds of the sampled silhouette.
 
 using namespace std;
 
@@ -23,6 +47,9 @@ enum Method
     LLOYD_METHOD,
     LSH_METHOD,
     HYPERCUBE_METHOD,
+    ELKAN_METHOD,
+    HAMERLY_METHOD,
+    MINIBATCH_METHOD,
     UNKNOWN
 };
 
@@ -39,24 +66,43 @@ private:
     int no_probes;
     MNIST dataset;
     vector<MNIST_Image> image_dataset;
+    size_t no_dimensions;          // The number of leading coordinates of the points that hold data.
     vector<IMAGE_DATA> cluster_centers;
-    vector<IMAGE_DATA> unnormalized_cluster_centers;
-    unordered_map<int, vector<MNIST_Image>> clusters;
+    vector<vector<int>> clusters;  // The positions in image_dataset of the members of every cluster.
+    vector<int> cluster_positions; // The position of every point inside its cluster's member list, for swap-and-pop removal.
     vector<int> assignments;
     double executime_time_sec;
     Method method;
-    int range;
-    int assigned;
+    int range;                         // Range search: the last radius used by the assignment.
+    int assigned;                      // Range search: the number of points assigned by the balls, the rest fall back to Lloyd's assignment.
+    unique_ptr<LSH> lsh_index;         // Range search: the LSH index, built once and kept across iterations.
+    unique_ptr<Hypercube> hypercube_index; // Range search: the Hypercube index, built once and kept across iterations.
+    long long no_distance_evaluations; // Number of point-center distances computed in the current iteration.
+    vector<double> upper_bounds;       // Elkan/Hamerly: upper bound of the distance of every point to its center.
+    vector<double> lower_bounds;       // Elkan: lower bound of the distance of every point to every center, Hamerly: to the second closest center.
+    vector<double> center_distances;   // Elkan/Hamerly: distances between every pair of centers, row major.
+    int no_threads;                    // Number of threads used by Lloyd's assignment.
+    vector<double> point_norms;        // Squared norms of the points, for the matrix product form of the distances.
+    int batch_size;                    // Mini-batch: number of points sampled per iteration.
+    int holdout_size;                  // Mini-batch: number of points kept aside to track the inertia.
+    unsigned int seed;                 // Seed of the initialization and of the mini-batches.
+    mt19937 generator;                 // Random generator used to sample the mini-batches.
+    int silhouette_sample;             // Number of points per cluster whose silhouette is computed, 0 for every point.
+
+    // Function to calculate the squared Euclidean distance between two data points, safe to call from any thread
+    double squaredDistance(const IMAGE_DATA &a, const IMAGE_DATA &b) const
+    {
+        if (no_dimensions == DIMENSIONS)
+            return SquaredDistance<DIMENSIONS>(a.data(), b.data());
+
+        return SquaredDistance(a.data(), b.data(), no_dimensions);
+    }
 
     // Function to calculate the Euclidean distance between two data points
     double euclideanDistance(const IMAGE_DATA &a, const IMAGE_DATA &b)
     {
-        double sum = 0.0;
-        for (int i = 0; i < 784; i++)
-        {
-            sum += std::pow(a[i] - b[i], 2);
-        }
-        return sqrt(sum);
+        no_distance_evaluations++;
+        return sqrt(squaredDistance(a, b));
     }
 
     Method parseMethod(const std::string input)
@@ -73,6 +119,18 @@ private:
         {
             return HYPERCUBE_METHOD;
         }
+        else if (input == "elkan")
+        {
+            return ELKAN_METHOD;
+        }
+        else if (input == "hamerly")
+        {
+            return HAMERLY_METHOD;
+        }
+        else if (input == "minibatch")
+        {
+            return MINIBATCH_METHOD;
+        }
         else
         {
             cout << "Failed to parse the provided method." << endl;
@@ -89,7 +147,11 @@ public:
             int _no_dim_hypercubes,
             int _no_probes,
             MNIST _dataset,
-            string _method)
+            string _method,
+            int _no_threads = 1,
+            int _batch_size = MINIBATCH_SIZE,
+            int _holdout_size = MINIBATCH_HOLDOUT,
+            unsigned int _seed = random_device()())
     {
         no_clusters = _no_clusters;
         no_hash_tables = _no_hash_tables;
@@ -99,16 +161,20 @@ public:
         no_probes = _no_probes;
         dataset = _dataset;
         image_dataset = _dataset.GetImages();
-        assignments = vector<int>(image_dataset.size());
+        no_dimensions = _dataset.GetDimensionsCount();
+        assignments = vector<int>(image_dataset.size(), -1); // -1 marks an unassigned point
+        cluster_positions = vector<int>(image_dataset.size(), -1);
+        clusters = vector<vector<int>>(no_clusters);
         method = parseMethod(_method);
         range = START_RANGE;
         assigned = 0;
-
-        unnormalized_cluster_centers = vector<IMAGE_DATA>(no_clusters);
-        for (int i = 0; i < no_clusters; i++)
-        {
-            unnormalized_cluster_centers[i].fill(0);
-        }
+        no_distance_evaluations = 0;
+        no_threads = std::max(_no_threads, 1);
+        batch_size = std::max(_batch_size, 1);
+        holdout_size = std::max(_holdout_size, 0);
+        seed = _seed;
+        silhouette_sample = SILHOUETTE_SAMPLE;
+        generator = mt19937(seed);
 
         Initialization();
     }
@@ -116,9 +182,9 @@ public:
     /* Initialization */
     void Initialization()
     {
-        auto start = chrono::high_resolution_clock::now();
+        Stopwatch stopwatch;
 
-        initializeClusterCentersKMeansPP();
+        initializeClusterCentersKMeansParallel();
 
         uint changes = 1;
         int it = 0;
@@ -131,13 +197,10 @@ public:
 
             cout << "Changes: " << changes << ", Range: " << range << ", Assigned: " << assigned << endl;
             changes = 0;
+            no_distance_evaluations = 0;
             switch (method)
             {
             case LLOYD_METHOD:
-                for (int i = 0; i < no_clusters; i++)
-                {
-                    unnormalized_cluster_centers[i].fill(0.0);
-                }
                 changes = assignToNearestClusterLloyd();
                 break;
             case LSH_METHOD:
@@ -148,15 +211,28 @@ public:
                 changes = assignToNearestClusterRange(HYPERCUBE_METHOD);
                 updateClusterCentersMacQueen();
                 break;
+            case ELKAN_METHOD:
+                changes = it == 0 ? assignToNearestClusterExact(true) : assignToNearestClusterElkan();
+                updateBoundsElkan(updateClusterCentersLloyd());
+                break;
+            case HAMERLY_METHOD:
+                changes = it == 0 ? assignToNearestClusterExact(false) : assignToNearestClusterHamerly();
+                updateBoundsHamerly(updateClusterCentersLloyd());
+                break;
+            case MINIBATCH_METHOD:
+                miniBatchKMeans();
+                changes = assignToNearestClusterLloyd(false);
+                break;
             default:
                 cout << "Not Lloyd's" << endl;
                 return;
             }
 
-            if ((method == LSH_METHOD || method == HYPERCUBE_METHOD) &&
-                (image_dataset.size() - assigned) / image_dataset.size() >= 0.01)
-            {
+            cout << "Distance evaluations: " << no_distance_evaluations << endl;
 
+            // Mini-batch k-means converges on its own, the full assignment is only computed once at the end
+            if (method == MINIBATCH_METHOD)
+            {
                 break;
             }
 
@@ -165,8 +241,7 @@ public:
 
         cout << ((double)changes / (double)image_dataset.size()) << endl;
 
-        auto stop = chrono::high_resolution_clock::now();
-        executime_time_sec = chrono::duration_cast<chrono::microseconds>(stop - start).count() / 1000000;
+        executime_time_sec = stopwatch.ElapsedSeconds();
 
         for (int k = 0; k < no_clusters; k++)
         {
@@ -174,265 +249,783 @@ public:
         }
     }
 
-    // Function to initialize cluster centers using k-Means++
-    void initializeClusterCentersKMeansPP()
+    // Run {work(t, block)} for every block of {block_size} out of {no_items} items, splitting the blocks across the threads
+    template <typename Work>
+    void forEachBlock(size_t no_items, size_t block_size, Work work)
     {
-        vector<IMAGE_DATA> centers;
-        centers.push_back(image_dataset[std::rand() % image_dataset.size()].GetImageData());
+        size_t no_blocks = (no_items + block_size - 1) / block_size;
+        atomic<size_t> next_block(0);
 
-        while (centers.size() < no_clusters)
+        auto worker = [&](int t)
         {
-            // Calculate the minimum distance from each data point to the nearest center
-            std::vector<double> distances(image_dataset.size(), std::numeric_limits<double>::max());
-            for (size_t i = 0; i < image_dataset.size(); i++)
+            for (size_t block = next_block++; block < no_blocks; block = next_block++)
+                work(t, block);
+        };
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker, t));
+        worker(0);
+        for (thread &t : threads)
+            t.join();
+    }
+
+    // Update the squared distance of every point to its nearest candidate with the candidates [first, candidates.size())
+    void updateNearestCandidates(const vector<int> &candidates, size_t first, vector<double> &min_distances, vector<int> &nearest_candidates)
+    {
+        forEachBlock(image_dataset.size(), KMEANS_PARALLEL_BLOCK, [&](int t, size_t block)
+                     {
+            size_t block_end = std::min(image_dataset.size(), (block + 1) * KMEANS_PARALLEL_BLOCK);
+            for (size_t i = block * KMEANS_PARALLEL_BLOCK; i < block_end; i++)
             {
-                for (const IMAGE_DATA &center : centers)
+                for (size_t c = first; c < candidates.size(); c++)
                 {
-                    double dist = euclideanDistance(image_dataset[i].GetImageData(), center);
-                    distances[i] = std::min(distances[i], dist);
+                    double distance = squaredDistance(image_dataset[i].GetImageData(), image_dataset[candidates[c]].GetImageData());
+                    if (distance < min_distances[i])
+                    {
+                        min_distances[i] = distance;
+                        nearest_candidates[i] = c;
+                    }
                 }
-            }
+            } });
+
+        no_distance_evaluations += (long long)image_dataset.size() * (candidates.size() - first);
+    }
+
+    // Function to initialize cluster centers using k-Means|| (Bahmani et al.).
+    // A few rounds each sample about KMEANS_PARALLEL_FACTOR * k candidates at once, with probability proportional to the squared
+    // distance to the nearest candidate, which is kept up to date for the new candidates only. The candidates are then weighted by
+    // the number of points closest to them and reduced to k centers with weighted k-Means++.
+    // Every block of points samples with its own generator derived from the seed, so the result does not depend on the number of threads.
+    void initializeClusterCentersKMeansParallel()
+    {
+        size_t no_points = image_dataset.size();
+        vector<double> min_distances(no_points, std::numeric_limits<double>::max());
+        vector<int> nearest_candidates(no_points, 0);
+
+        mt19937 init_generator(seed);
+        vector<int> candidates(1, uniform_int_distribution<size_t>(0, no_points - 1)(init_generator));
+        updateNearestCandidates(candidates, 0, min_distances, nearest_candidates);
+
+        double oversampling = (double)KMEANS_PARALLEL_FACTOR * no_clusters;
+        for (int round = 0; round < KMEANS_PARALLEL_ROUNDS; round++)
+        {
+            double cost = 0.0;
+            for (double distance : min_distances)
+                cost += distance;
+            if (cost <= 0.0)
+                break;
+
+            // Sample every point independently, in parallel
+            vector<vector<int>> sampled(no_threads);
+            forEachBlock(no_points, KMEANS_PARALLEL_BLOCK, [&](int t, size_t block)
+                         {
+                mt19937 block_generator(seed ^ (0x9E3779B9u * (unsigned int)(round + 1)) ^ (unsigned int)block);
+                uniform_real_distribution<double> uniform(0.0, 1.0);
+                size_t block_end = std::min(no_points, (block + 1) * KMEANS_PARALLEL_BLOCK);
+                for (size_t i = block * KMEANS_PARALLEL_BLOCK; i < block_end; i++)
+                {
+                    if (uniform(block_generator) < oversampling * min_distances[i] / cost)
+                        sampled[t].push_back(i);
+                } });
+
+            // Sort the samples so that the candidates do not depend on which thread took which block
+            size_t first = candidates.size();
+            for (const vector<int> &thread_samples : sampled)
+                candidates.insert(candidates.end(), thread_samples.begin(), thread_samples.end());
+            sort(candidates.begin() + first, candidates.end());
+
+            cout << "k-Means|| round " << round + 1 << ": " << candidates.size() << " candidates" << endl;
+            updateNearestCandidates(candidates, first, min_distances, nearest_candidates);
+        }
+
+        // Weight every candidate by the number of points closest to it
+        vector<double> weights(candidates.size(), 0.0);
+        for (size_t i = 0; i < no_points; i++)
+            weights[nearest_candidates[i]]++;
+
+        // Reduce the candidates to k centers with weighted k-Means++, sampling by weight * D^2
+        vector<double> candidate_distances(candidates.size(), std::numeric_limits<double>::max());
+        vector<bool> chosen(candidates.size(), false);
+        cluster_centers.clear();
 
-            // Calculate the total distance from each data point to its nearest center
-            double totalDistance = 0.0;
-            for (double dist : distances)
+        discrete_distribution<size_t> by_weight(weights.begin(), weights.end());
+        size_t next = by_weight(init_generator);
+
+        while (cluster_centers.size() < (size_t)no_clusters)
+        {
+            chosen[next] = true;
+            cluster_centers.push_back(image_dataset[candidates[next]].GetImageData());
+
+            vector<double> probabilities(candidates.size(), 0.0);
+            double total = 0.0;
+            for (size_t c = 0; c < candidates.size(); c++)
             {
-                totalDistance += dist;
+                if (chosen[c])
+                    continue;
+
+                candidate_distances[c] = std::min(candidate_distances[c], squaredDistance(image_dataset[candidates[c]].GetImageData(), cluster_centers.back()));
+                probabilities[c] = weights[c] * candidate_distances[c];
+                total += probabilities[c];
             }
+            no_distance_evaluations += candidates.size();
 
-            // Choose the next center based on the probability proportional to its distance
-            double randValue = (std::rand() / (double)RAND_MAX) * totalDistance;
-            for (size_t i = 0; i < image_dataset.size(); i++)
+            // Too few distinct candidates, fall back to uniformly sampled points
+            if (total <= 0.0)
             {
-                randValue -= distances[i];
-                if (randValue <= 0.0)
-                {
-                    centers.push_back(image_dataset[i].GetImageData()); // Add the data point as a new center
-                    break;
-                }
+                while (cluster_centers.size() < (size_t)no_clusters)
+                    cluster_centers.push_back(image_dataset[uniform_int_distribution<size_t>(0, no_points - 1)(init_generator)].GetImageData());
+                break;
             }
-        }
 
-        cluster_centers = centers; // Return the initialized cluster centers
+            next = discrete_distribution<size_t>(probabilities.begin(), probabilities.end())(init_generator);
+        }
     }
 
-    // Function to assign each data point to the nearest cluster center using range search
+    // Function to assign each data point to the nearest cluster center using range search (reverse assignment).
+    // The LSH or Hypercube index is built on the first call and kept for every later iteration. Each center's buckets are scanned once
+    // per iteration, and its candidates are sorted by distance, so that doubling the radius only walks further down the sorted lists.
+    // A point is claimed by the centers whose ball reaches it first, the nearest one winning conflicts within the same radius,
+    // and points that no ball reaches once the radius stops claiming new points fall back to the exact Lloyd assignment.
     uint assignToNearestClusterRange(Method method)
     {
-        cout << assigned << endl;
         uint changes = 0;
 
-        // Need to create images from centers
-        vector<MNIST_Image> center_images(no_clusters);
-        for (int i = 0; i < no_clusters; i++)
+        if (method == LSH_METHOD && !lsh_index)
+            lsh_index.reset(new LSH(dataset, no_hash_functions, no_hash_tables, seed));
+        else if (method == HYPERCUBE_METHOD && !hypercube_index)
+            hypercube_index.reset(new Hypercube(dataset, no_dim_hypercubes, no_max_hypercubes, no_probes, seed));
+
+        // Scan the buckets of every center once, keeping its candidates sorted by distance
+        vector<vector<pair<double, int>>> candidates(no_clusters);
+        for (int c = 0; c < no_clusters; c++)
         {
-            MNIST_Image image = MNIST_Image(i, cluster_centers[i]);
-            center_images[i] = image;
+            MNIST_Image center_image = MNIST_Image(c, cluster_centers[c]);
+            set<MNIST_Image, MNIST_ImageComparator> neighbors = method == LSH_METHOD
+                                                                    ? lsh_index->RadiusSearch(center_image, std::numeric_limits<int>::max())
+                                                                    : hypercube_index->RadiusSearch(center_image, std::numeric_limits<int>::max());
+
+            for (set<MNIST_Image, MNIST_ImageComparator>::iterator it = neighbors.begin(); it != neighbors.end(); ++it)
+                candidates[c].push_back(make_pair(it->GetDist(), (int)it->GetIndex()));
+            no_distance_evaluations += candidates[c].size();
         }
 
-        // Vector that will keep count of conflicts
-        vector<vector<int>> conflicts(image_dataset.size(), vector<int>(0));
+        // Start from half the smallest distance between two centers, where balls cannot overlap
+        vector<double> half_min_distances = updateCenterDistances();
+        double radius = *min_element(half_min_distances.begin(), half_min_distances.end());
+        if (radius <= 0.0 || radius == std::numeric_limits<double>::max())
+            radius = START_RANGE;
+
+        vector<int> nearest_clusters(image_dataset.size(), -1);
+        vector<double> nearest_distances(image_dataset.size(), std::numeric_limits<double>::max());
+        vector<bool> settled(image_dataset.size(), false);
+        vector<size_t> next_candidate(no_clusters, 0);
+        vector<int> claimed;
+        assigned = 0;
 
-        switch (method)
-        {
-        case LSH_METHOD:
+        for (int step = 0; step < RANGE_STEPS; step++)
         {
-            // For each center
-            // For given range, execute given LSH RadiusSearch using the one center as query
-            LSH lsh = LSH(dataset, no_hash_functions, no_hash_tables);
-            for (int i = 0; i < no_clusters; i++)
+            for (int c = 0; c < no_clusters; c++)
             {
-                // Execute given LSH RadiusSearch using the one center as query
-                set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = lsh.RadiusSearch(center_images[i], range);
-
-                for (set<MNIST_Image, MNIST_ImageComparator>::iterator it = neighbors_in_radius.begin(); it != neighbors_in_radius.end(); ++it)
+                for (; next_candidate[c] < candidates[c].size() && candidates[c][next_candidate[c]].first < radius; next_candidate[c]++)
                 {
-                    MNIST_Image neighbor = *it;
-                    conflicts[neighbor.GetIndex()].push_back(i);
+                    double distance = candidates[c][next_candidate[c]].first;
+                    int i = candidates[c][next_candidate[c]].second;
+
+                    // Points claimed with a smaller radius keep their cluster
+                    if (settled[i])
+                        continue;
+
+                    if (nearest_clusters[i] == -1)
+                        claimed.push_back(i);
+                    if (distance < nearest_distances[i])
+                    {
+                        nearest_distances[i] = distance;
+                        nearest_clusters[i] = c;
+                    }
                 }
             }
 
-            break;
+            range = radius;
+            radius *= 2;
+
+            // Stop once the balls have started claiming points and a whole radius step claims almost no new one,
+            // the far points of the buckets are better served by the exact assignment
+            if (assigned > 0 && claimed.size() < RANGE_MIN_CLAIMED * image_dataset.size())
+                break;
+
+            for (int i : claimed)
+                settled[i] = true;
+            assigned += claimed.size();
+            claimed.clear();
         }
-        case HYPERCUBE_METHOD:
+
+        // Exact assignment of the points that no ball reached
+        for (size_t i = 0; i < image_dataset.size(); i++)
         {
-            // For each center
-            // For given range, execute given Hypercube RadiusSearch using the one center as query
-            Hypercube hypercube = Hypercube(dataset, no_dim_hypercubes, no_max_hypercubes, no_probes);
-            for (int i = 0; i < no_clusters; i++)
+            // The buckets of a center may miss points that are close to it, so a claimed point only leaves its previous cluster for a closer center
+            if (nearest_clusters[i] != -1 && assignments[i] != -1 && nearest_clusters[i] != assignments[i])
             {
-                // Execute given Hypercube RadiusSearch using the one center as query
-                set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = hypercube.RadiusSearch(center_images[i], range);
+                double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[assignments[i]]);
+                if (distance < nearest_distances[i])
+                {
+                    nearest_distances[i] = distance;
+                    nearest_clusters[i] = assignments[i];
+                }
+            }
 
-                for (set<MNIST_Image, MNIST_ImageComparator>::iterator it = neighbors_in_radius.begin(); it != neighbors_in_radius.end(); ++it)
+            if (nearest_clusters[i] == -1)
+            {
+                for (int c = 0; c < no_clusters; c++)
                 {
-                    MNIST_Image neighbor = *it;
-                    conflicts[neighbor.GetIndex()].push_back(i);
+                    double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[c]);
+                    if (distance < nearest_distances[i])
+                    {
+                        nearest_distances[i] = distance;
+                        nearest_clusters[i] = c;
+                    }
                 }
             }
 
-            break;
-        }
+            if (nearest_clusters[i] != assignments[i])
+            {
+                changes++;
+                moveToCluster(i, nearest_clusters[i]);
+            }
         }
 
-        // Resolve conflicts, aka points that fall into 2 radiuses, by calculating distance between point and centers
-        for (int i = 0; i < image_dataset.size(); i++)
+        return changes;
+    }
+
+    // Move the data point to the given cluster, keeping the cluster members in sync with the assignments.
+    // The point is swapped with the last member of its previous cluster and popped, so a move costs O(1).
+    void moveToCluster(int i, int new_cluster)
+    {
+        int prev_cluster = assignments[i];
+
+        // Remove image from previous cluster
+        if (prev_cluster != -1)
         {
-            // cout << i << ", " << conflicts[i].size() << endl;
+            vector<int> &members = clusters[prev_cluster];
+            int last = members.back();
+            members[cluster_positions[i]] = last;
+            cluster_positions[last] = cluster_positions[i];
+            members.pop_back();
+        }
+
+        assignments[i] = new_cluster;
+        cluster_positions[i] = clusters[new_cluster].size();
+        clusters[new_cluster].push_back(i);
+    }
 
-            if (conflicts[i].size() == 1)
+    // Compute the distances between every pair of centers, and for every center half the distance to its closest other center
+    vector<double> updateCenterDistances()
+    {
+        center_distances = vector<double>(no_clusters * no_clusters, 0.0);
+        vector<double> half_min_distances(no_clusters, std::numeric_limits<double>::max());
+
+        for (int a = 0; a < no_clusters; a++)
+        {
+            for (int b = a + 1; b < no_clusters; b++)
             {
-                // cout << i << " > " << conflicts[i][0] << endl;
+                double distance = euclideanDistance(cluster_centers[a], cluster_centers[b]);
+                center_distances[a * no_clusters + b] = distance;
+                center_distances[b * no_clusters + a] = distance;
+                half_min_distances[a] = std::min(half_min_distances[a], distance / 2);
+                half_min_distances[b] = std::min(half_min_distances[b], distance / 2);
+            }
+        }
 
-                int prev_cluster = assignments[i];
-                int new_cluster = conflicts[i][0];
+        return half_min_distances;
+    }
 
-                // if prev_cluster != new_cluster (happens if it was previously unassigned, or if cluster center's changed dramatically)
-                if (prev_cluster != new_cluster)
-                {
-                    changes++;
+    // Function to assign each data point to the nearest cluster center computing every distance,
+    // used for the first iteration of Elkan's and Hamerly's algorithms to initialize the bounds
+    uint assignToNearestClusterExact(bool elkan)
+    {
+        uint changes = 0;
+        upper_bounds = vector<double>(image_dataset.size());
+        lower_bounds = vector<double>(elkan ? image_dataset.size() * no_clusters : image_dataset.size());
 
-                    // Remove from previous cluster
-                    if (prev_cluster != -1)
-                    {
-                        for (int j = 0; j < clusters[prev_cluster].size(); j++)
-                        {
-                            if (image_dataset[i].GetIndex() == clusters[prev_cluster][j].GetIndex())
-                            {
-                                vector<MNIST_Image>::iterator indx = clusters[prev_cluster].begin() + j;
-                                clusters[prev_cluster].erase(indx);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        assigned++;
-                    }
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            double min_distance = std::numeric_limits<double>::max();
+            double second_min_distance = std::numeric_limits<double>::max();
+            int nearest_cluster = 0;
 
-                    // Add to new cluster
-                    assignments[i] = new_cluster;
-                    clusters[new_cluster].push_back(image_dataset[i]);
-                }
-            }
-            else if (conflicts[i].size() > 1)
+            for (int j = 0; j < no_clusters; j++)
             {
-                // cout << i << ": " << conflicts[i].size() << endl;
+                double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[j]);
+                if (elkan)
+                    lower_bounds[i * no_clusters + j] = distance;
 
-                // Compare distances between conflicting clusters
-                int prev_cluster = assignments[i];
-                double min_dist = std::numeric_limits<double>::max();
-                int nearest_cluster = -1;
-                for (int j = 0; j < conflicts[i].size(); j++)
+                if (distance < min_distance)
                 {
-                    // cout << conflicts[i][j] << endl;
-
-                    double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[conflicts[i][j]]);
-                    if (distance < min_dist)
-                    {
-                        min_dist = distance;
-                        nearest_cluster = conflicts[i][j];
-                    }
+                    second_min_distance = min_distance;
+                    min_distance = distance;
+                    nearest_cluster = j;
+                }
+                else if (distance < second_min_distance)
+                {
+                    second_min_distance = distance;
                 }
+            }
+
+            upper_bounds[i] = min_distance;
+            if (!elkan)
+                lower_bounds[i] = second_min_distance;
+
+            changes++;
+            moveToCluster(i, nearest_cluster);
+        }
+
+        return changes;
+    }
+
+    // Function to assign each data point to the nearest cluster center using Elkan's algorithm.
+    // A center is skipped whenever the triangle inequality proves that it cannot be closer than the current one.
+    uint assignToNearestClusterElkan()
+    {
+        uint changes = 0;
+        vector<double> half_min_distances = updateCenterDistances();
+
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            int nearest_cluster = assignments[i];
+            double *lower = &lower_bounds[i * no_clusters];
 
-                // cout << "Nearest Cluster: " << nearest_cluster << ", Distance: " << min_dist << endl;
+            // The point is closer to its center than half the distance to any other center
+            if (upper_bounds[i] <= half_min_distances[nearest_cluster])
+                continue;
 
-                // if prev_cluster != nearest_cluster
-                if (prev_cluster != nearest_cluster)
+            bool upper_is_tight = false;
+            for (int j = 0; j < no_clusters; j++)
+            {
+                if (j == nearest_cluster ||
+                    upper_bounds[i] <= lower[j] ||
+                    upper_bounds[i] <= center_distances[nearest_cluster * no_clusters + j] / 2)
+                    continue;
+
+                if (!upper_is_tight)
                 {
-                    changes++;
+                    upper_bounds[i] = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[nearest_cluster]);
+                    lower[nearest_cluster] = upper_bounds[i];
+                    upper_is_tight = true;
 
-                    // Remove from previous cluster
-                    if (prev_cluster != -1)
-                    {
-                        for (int j = 0; j < clusters[prev_cluster].size(); j++)
-                        {
-                            if (image_dataset[i].GetIndex() == clusters[prev_cluster][j].GetIndex())
-                            {
-                                vector<MNIST_Image>::iterator indx = clusters[prev_cluster].begin() + j;
-                                clusters[prev_cluster].erase(indx);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        assigned++;
-                    }
+                    if (upper_bounds[i] <= lower[j] ||
+                        upper_bounds[i] <= center_distances[nearest_cluster * no_clusters + j] / 2)
+                        continue;
+                }
 
-                    // Add to nearest_cluster
-                    assignments[i] = nearest_cluster;
-                    clusters[nearest_cluster].push_back(image_dataset[i]);
+                double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[j]);
+                lower[j] = distance;
+                if (distance < upper_bounds[i])
+                {
+                    nearest_cluster = j;
+                    upper_bounds[i] = distance;
                 }
             }
-        }
 
-        range *= 2;
+            if (nearest_cluster != assignments[i])
+            {
+                changes++;
+                moveToCluster(i, nearest_cluster);
+            }
+        }
 
         return changes;
     }
 
-    // Function to assign each data point to the nearest cluster center using Lloyd's algorithm
-    uint assignToNearestClusterLloyd()
+    // Function to assign each data point to the nearest cluster center using Hamerly's algorithm.
+    // It keeps a single lower bound, to the second closest center, so it needs less memory than Elkan's.
+    uint assignToNearestClusterHamerly()
     {
         uint changes = 0;
-        cout << "Assigning points to clusters using Lloyd's algorithm..." << endl;
+        vector<double> half_min_distances = updateCenterDistances();
+
         for (size_t i = 0; i < image_dataset.size(); i++)
         {
+            int nearest_cluster = assignments[i];
+            double bound = std::max(half_min_distances[nearest_cluster], lower_bounds[i]);
+            if (upper_bounds[i] <= bound)
+                continue;
 
-            int prev_cluster = assignments[i];
-            double min_distance = std::numeric_limits<double>::max();
-            int nearest_cluster = -1;
+            // Tighten the upper bound and test again before scanning every center
+            upper_bounds[i] = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[nearest_cluster]);
+            if (upper_bounds[i] <= bound)
+                continue;
 
-            // Find the nearest cluster center for the current data point
+            double min_distance = std::numeric_limits<double>::max();
+            double second_min_distance = std::numeric_limits<double>::max();
             for (int j = 0; j < no_clusters; j++)
             {
-                double distance = euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[j]);
-                // cout << distance << ", " << min_distance << ", " << j << endl;
+                double distance = j == assignments[i] ? upper_bounds[i] : euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[j]);
                 if (distance < min_distance)
                 {
+                    second_min_distance = min_distance;
                     min_distance = distance;
                     nearest_cluster = j;
                 }
+                else if (distance < second_min_distance)
+                {
+                    second_min_distance = distance;
+                }
             }
 
-            // Assign the data point to the nearest cluster
-            if (prev_cluster != nearest_cluster)
-            {
+            upper_bounds[i] = min_distance;
+            lower_bounds[i] = second_min_distance;
 
+            if (nearest_cluster != assignments[i])
+            {
                 changes++;
+                moveToCluster(i, nearest_cluster);
+            }
+        }
+
+        return changes;
+    }
+
+    // Function to move every cluster center to the mean of its points, returns how far every center moved
+    vector<double> updateClusterCentersLloyd()
+    {
+        vector<IMAGE_DATA> sums(no_clusters);
+        vector<int> sizes(no_clusters, 0);
+        for (int i = 0; i < no_clusters; i++)
+        {
+            sums[i].fill(0.0);
+        }
+
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            int cluster = assignments[i];
+            sizes[cluster]++;
+            for (size_t j = 0; j < no_dimensions; j++)
+            {
+                sums[cluster][j] += image_dataset[i].GetImageData()[j];
+            }
+        }
+
+        return updateClusterCentersFromSums(sums, sizes);
+    }
+
+    // Function to move every cluster center to the mean given by the sums and sizes of the clusters, returns how far every center moved
+    vector<double> updateClusterCentersFromSums(vector<IMAGE_DATA> &sums, const vector<int> &sizes)
+    {
+        vector<double> shifts(no_clusters, 0.0);
+        for (int i = 0; i < no_clusters; i++)
+        {
+            // An empty cluster keeps its previous center
+            if (sizes[i] == 0)
+                continue;
+
+            for (size_t j = 0; j < no_dimensions; j++)
+            {
+                sums[i][j] /= sizes[i];
+            }
+
+            shifts[i] = euclideanDistance(cluster_centers[i], sums[i]);
+            cluster_centers[i] = sums[i];
+        }
+
+        return shifts;
+    }
+
+    // Function to loosen Elkan's bounds by how far the centers moved
+    void updateBoundsElkan(const vector<double> &shifts)
+    {
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            upper_bounds[i] += shifts[assignments[i]];
+            for (int j = 0; j < no_clusters; j++)
+            {
+                lower_bounds[i * no_clusters + j] = std::max(lower_bounds[i * no_clusters + j] - shifts[j], 0.0);
+            }
+        }
+    }
+
+    // Function to loosen Hamerly's bounds by how far the centers moved
+    void updateBoundsHamerly(const vector<double> &shifts)
+    {
+        // The lower bound of a point may only move by the largest shift among the other centers
+        int max_shift_cluster = 0;
+        double max_shift = 0.0, second_max_shift = 0.0;
+        for (int j = 0; j < no_clusters; j++)
+        {
+            if (shifts[j] > max_shift)
+            {
+                second_max_shift = max_shift;
+                max_shift = shifts[j];
+                max_shift_cluster = j;
+            }
+            else if (shifts[j] > second_max_shift)
+            {
+                second_max_shift = shifts[j];
+            }
+        }
+
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            upper_bounds[i] += shifts[assignments[i]];
+            lower_bounds[i] -= assignments[i] == max_shift_cluster ? second_max_shift : max_shift;
+        }
+    }
+
+    // Compute the squared norms of the points once, for the matrix product form of the distances
+    void computePointNorms()
+    {
+        if (point_norms.size() == image_dataset.size())
+            return;
+
+        point_norms = vector<double>(image_dataset.size());
+        for (size_t i = 0; i < image_dataset.size(); i++)
+        {
+            const IMAGE_DATA &point = image_dataset[i].GetImageData();
+            point_norms[i] = 0.0;
+            for (size_t d = 0; d < no_dimensions; d++)
+            {
+                point_norms[i] += point[d] * point[d];
+            }
+        }
+    }
 
-                // Remove image from previous cluster
-                if (prev_cluster != -1)
+    // Compute the squared distances of the points [first, last) to every center as ||x||^2 + ||c||^2 - 2 x.c,
+    // the dot products forming a matrix product that is tiled so that a few centers are reused across the whole block of points
+    void computeDistanceBlock(size_t first, size_t last, const vector<double> &center_norms, vector<double> &block)
+    {
+        for (int c_first = 0; c_first < no_clusters; c_first += CLUSTER_CENTER_BLOCK)
+        {
+            int c_last = std::min(no_clusters, c_first + CLUSTER_CENTER_BLOCK);
+
+            for (size_t i = first; i < last; i++)
+            {
+                const IMAGE_DATA &point = image_dataset[i].GetImageData();
+                double *row = &block[(i - first) * no_clusters];
+
+                int j = c_first;
+                for (; j + 4 <= c_last; j += 4)
                 {
-                    for (int j = 0; j < clusters[prev_cluster].size(); j++)
+                    const IMAGE_DATA &c0 = cluster_centers[j], &c1 = cluster_centers[j + 1];
+                    const IMAGE_DATA &c2 = cluster_centers[j + 2], &c3 = cluster_centers[j + 3];
+                    double dot0 = 0.0, dot1 = 0.0, dot2 = 0.0, dot3 = 0.0;
+                    for (size_t d = 0; d < no_dimensions; d++)
                     {
-                        if (image_dataset[i].GetIndex() == clusters[prev_cluster][j].GetIndex())
-                        {
-                            vector<MNIST_Image>::iterator indx = clusters[prev_cluster].begin() + j;
-                            clusters[prev_cluster].erase(indx);
-                        }
+                        double x = point[d];
+                        dot0 += x * c0[d];
+                        dot1 += x * c1[d];
+                        dot2 += x * c2[d];
+                        dot3 += x * c3[d];
                     }
+                    row[j] = point_norms[i] + center_norms[j] - 2 * dot0;
+                    row[j + 1] = point_norms[i] + center_norms[j + 1] - 2 * dot1;
+                    row[j + 2] = point_norms[i] + center_norms[j + 2] - 2 * dot2;
+                    row[j + 3] = point_norms[i] + center_norms[j + 3] - 2 * dot3;
                 }
+                for (; j < c_last; j++)
+                {
+                    double dot = 0.0;
+                    for (size_t d = 0; d < no_dimensions; d++)
+                    {
+                        dot += point[d] * cluster_centers[j][d];
+                    }
+                    row[j] = point_norms[i] + center_norms[j] - 2 * dot;
+                }
+            }
+        }
+    }
+
+    // Function to assign each data point to the nearest cluster center using Lloyd's algorithm.
+    // Blocks of points are split across the threads, which accumulate the sums and sizes of the clusters locally,
+    // and the partial sums are reduced into the new centers once every point has been assigned, unless {update_centers} is false.
+    uint assignToNearestClusterLloyd(bool update_centers = true)
+    {
+        cout << "Assigning points to clusters using Lloyd's algorithm..." << endl;
+
+        size_t no_points = image_dataset.size();
+        computePointNorms();
+
+        vector<double> center_norms(no_clusters, 0.0);
+        for (int j = 0; j < no_clusters; j++)
+        {
+            for (size_t d = 0; d < no_dimensions; d++)
+            {
+                center_norms[j] += cluster_centers[j][d] * cluster_centers[j][d];
+            }
+        }
+
+        vector<int> nearest_clusters(no_points);
+        vector<vector<IMAGE_DATA>> partial_sums(no_threads, vector<IMAGE_DATA>(no_clusters));
+        vector<vector<int>> partial_sizes(no_threads, vector<int>(no_clusters, 0));
+        atomic<size_t> next_block(0);
+
+        auto worker = [&](int t)
+        {
+            vector<double> block(CLUSTER_POINT_BLOCK * no_clusters);
+            vector<IMAGE_DATA> &sums = partial_sums[t];
+            vector<int> &sizes = partial_sizes[t];
+            for (int j = 0; j < no_clusters; j++)
+            {
+                sums[j].fill(0.0);
+            }
 
-                // Assign image to nearest cluster
-                assignments[i] = nearest_cluster;
-                clusters[nearest_cluster].push_back(image_dataset[i]);
-                int cluster_size = clusters[nearest_cluster].size();
+            for (size_t first = CLUSTER_POINT_BLOCK * next_block++; first < no_points; first = CLUSTER_POINT_BLOCK * next_block++)
+            {
+                size_t last = std::min(no_points, first + CLUSTER_POINT_BLOCK);
+                computeDistanceBlock(first, last, center_norms, block);
 
-                // Update nearest cluster's center
-                if (cluster_size > 0)
+                for (size_t i = first; i < last; i++)
                 {
-                    for (int j = 0; j < 784; j++)
+                    const double *row = &block[(i - first) * no_clusters];
+                    int nearest_cluster = 0;
+                    for (int j = 1; j < no_clusters; j++)
                     {
-                        unnormalized_cluster_centers[nearest_cluster][j] += image_dataset[i].GetImageData()[j];
-                        cluster_centers[nearest_cluster][j] = unnormalized_cluster_centers[nearest_cluster][j] / cluster_size;
+                        if (row[j] < row[nearest_cluster])
+                            nearest_cluster = j;
                     }
+
+                    nearest_clusters[i] = nearest_cluster;
+                    sizes[nearest_cluster]++;
+                    const IMAGE_DATA &point = image_dataset[i].GetImageData();
+                    for (size_t d = 0; d < no_dimensions; d++)
+                    {
+                        sums[nearest_cluster][d] += point[d];
+                    }
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker, t));
+        worker(0);
+        for (thread &t : threads)
+            t.join();
+
+        no_distance_evaluations += (long long)no_points * no_clusters;
+
+        // Reduce the partial sums of the threads into the new centers
+        for (int t = 1; t < no_threads; t++)
+        {
+            for (int j = 0; j < no_clusters; j++)
+            {
+                partial_sizes[0][j] += partial_sizes[t][j];
+                for (size_t d = 0; d < no_dimensions; d++)
+                {
+                    partial_sums[0][j][d] += partial_sums[t][j][d];
                 }
             }
         }
+        if (update_centers)
+            updateClusterCentersFromSums(partial_sums[0], partial_sizes[0]);
+
+        uint changes = 0;
+        for (size_t i = 0; i < no_points; i++)
+        {
+            if (nearest_clusters[i] != assignments[i])
+            {
+                changes++;
+                moveToCluster(i, nearest_clusters[i]);
+            }
+        }
 
         return changes;
     }
 
+    // Function to compute the mean squared distance of the given points to their nearest center
+    double inertia(const vector<int> &points)
+    {
+        if (points.empty())
+            return 0.0;
+
+        double sum = 0.0;
+        for (int i : points)
+        {
+            double min_distance = std::numeric_limits<double>::max();
+            for (int j = 0; j < no_clusters; j++)
+            {
+                min_distance = std::min(min_distance, euclideanDistance(image_dataset[i].GetImageData(), cluster_centers[j]));
+            }
+            sum += min_distance * min_distance;
+        }
+
+        return sum / points.size();
+    }
+
+    // Function to move the cluster centers with mini-batch k-means.
+    // Every iteration assigns a random batch of points to the current centers, then moves each center towards its points
+    // with a learning rate of 1 / (number of points it has seen), so the centers settle as they accumulate points.
+    // The inertia is tracked on a holdout sample, and the iterations stop once it stops improving.
+    void miniBatchKMeans()
+    {
+        size_t no_points = image_dataset.size();
+
+        // Keep a random sample of points aside, the batches are drawn from the rest
+        vector<int> points(no_points);
+        for (size_t i = 0; i < no_points; i++)
+            points[i] = i;
+        shuffle(points.begin(), points.end(), generator);
+
+        size_t no_holdout = std::min((size_t)holdout_size, no_points / 2);
+        vector<int> holdout(points.begin(), points.begin() + no_holdout);
+        uniform_int_distribution<size_t> sample(no_holdout, no_points - 1);
+
+        vector<long long> center_counts(no_clusters, 0);
+        vector<int> batch(batch_size);
+        vector<int> nearest_clusters(batch_size);
+
+        double best_inertia = inertia(holdout);
+        int stalled = 0;
+        cout << "Mini-batch 0, Holdout inertia: " << best_inertia << endl;
+
+        for (int it = 1; it <= MINIBATCH_ITERATIONS && stalled < MINIBATCH_PATIENCE; it++)
+        {
+            // Assign the whole batch before moving any center
+            for (int b = 0; b < batch_size; b++)
+            {
+                batch[b] = points[sample(generator)];
+
+                double min_distance = std::numeric_limits<double>::max();
+                for (int j = 0; j < no_clusters; j++)
+                {
+                    double distance = euclideanDistance(image_dataset[batch[b]].GetImageData(), cluster_centers[j]);
+                    if (distance < min_distance)
+                    {
+                        min_distance = distance;
+                        nearest_clusters[b] = j;
+                    }
+                }
+            }
+
+            // Move every center towards its points with a per-center learning rate
+            for (int b = 0; b < batch_size; b++)
+            {
+                int cluster = nearest_clusters[b];
+                double learning_rate = 1.0 / ++center_counts[cluster];
+
+                const IMAGE_DATA &point = image_dataset[batch[b]].GetImageData();
+                for (size_t d = 0; d < no_dimensions; d++)
+                {
+                    cluster_centers[cluster][d] += learning_rate * (point[d] - cluster_centers[cluster][d]);
+                }
+            }
+
+            if (it % MINIBATCH_EVALUATION == 0)
+            {
+                double current_inertia = inertia(holdout);
+                cout << "Mini-batch " << it << ", Holdout inertia: " << current_inertia << endl;
+
+                if (current_inertia < best_inertia * (1 - MINIBATCH_TOLERANCE))
+                {
+                    best_inertia = current_inertia;
+                    stalled = 0;
+                }
+                else
+                {
+                    stalled++;
+                }
+            }
+        }
+    }
+
     // Function to update cluster centers using the MacQueen method
     void updateClusterCentersMacQueen()
     {
@@ -443,104 +1036,204 @@ public:
         for (size_t i = 0; i < image_dataset.size(); i++)
         {
             int cluster = assignments[i];
+            if (cluster == -1)
+                continue;
             clusterSizes[cluster]++;
 
-            for (int j = 0; j < 784; j++)
+            for (size_t j = 0; j < no_dimensions; j++)
             {
                 updatedCenters[cluster][j] += image_dataset[i].GetImageData()[j];
             }
         }
 
-        // Normalize the cluster centers
+        // Normalize the cluster centers, an empty cluster keeps its previous center
         for (int i = 0; i < no_clusters; i++)
         {
             if (clusterSizes[i] > 0)
             {
-                for (int j = 0; j < 784; j++)
+                for (size_t j = 0; j < no_dimensions; j++)
                 {
                     updatedCenters[i][j] /= clusterSizes[i];
                 }
+                cluster_centers[i] = updatedCenters[i];
             }
         }
     };
 
-    // Function to calculate the Silhouette score for a single cluster
-    double silhouetteScoreForCluster(const vector<IMAGE_DATA> &cluster)
+    // Function to calculate the silhouette of every cluster and of the whole clustering.
+    // The silhouette of a point needs its mean distance to the members of every cluster: a(i) for its own cluster and b(i) for the
+    // nearest other one. These come from per-cluster distance sums over the whole dataset, for batches of points in parallel.
+    // With {silhouette_sample} set, only that many random points per cluster are evaluated, and the scores come with the half-widths
+    // of their 95% confidence intervals (stratified sampling without replacement); otherwise every point is evaluated and the bounds are 0.
+    void computeSilhouette(vector<double> &scores, vector<double> &bounds, double &overall, double &overall_bound)
     {
-        double silhouette = 0.0;
-
-        for (size_t i = 0; i < cluster.size(); i++)
+        // Choose the points to evaluate in every cluster
+        mt19937 sample_generator(seed);
+        vector<int> evaluated;
+        vector<int> no_evaluated(no_clusters, 0);
+        size_t no_assigned = 0;
+        for (int c = 0; c < no_clusters; c++)
         {
-            double a = 0.0;                                // Mean intra-cluster distance
-            double b = std::numeric_limits<double>::max(); // Mean nearest-cluster distance
-
-            // Calculate mean intra-cluster distance
-            for (size_t j = 0; j < cluster.size(); j++)
-            {
-                if (i != j)
-                {
-                    a += euclideanDistance(cluster[i], cluster[j]);
-                }
-            }
-            if (cluster.size() > 1)
+            vector<int> members = clusters[c];
+            sort(members.begin(), members.end());
+            if (silhouette_sample > 0 && members.size() > (size_t)silhouette_sample)
             {
-                a /= (cluster.size() - 1);
+                shuffle(members.begin(), members.end(), sample_generator);
+                members.resize(silhouette_sample);
             }
 
-            // Calculate mean nearest-cluster distance
-            for (const IMAGE_DATA &otherPoint : cluster)
+            evaluated.insert(evaluated.end(), members.begin(), members.end());
+            no_evaluated[c] = members.size();
+            no_assigned += clusters[c].size();
+        }
+
+        computePointNorms();
+        vector<double> values(evaluated.size(), 0.0);
+        forEachBlock(evaluated.size(), SILHOUETTE_BATCH, [&](int t, size_t batch)
+                     {
+            size_t first = batch * SILHOUETTE_BATCH;
+            size_t last = std::min(evaluated.size(), first + SILHOUETTE_BATCH);
+            vector<double> sums((last - first) * no_clusters, 0.0);
+
+            for (size_t block = 0; block < image_dataset.size(); block += SILHOUETTE_BLOCK)
             {
-                double meanDistanceToOtherCluster = 0.0;
-                for (size_t j = 0; j < cluster.size(); j++)
+                size_t block_end = std::min(image_dataset.size(), block + SILHOUETTE_BLOCK);
+                for (size_t q = first; q < last; q++)
                 {
-                    if (i != j)
+                    const IMAGE_DATA &point = image_dataset[evaluated[q]].GetImageData();
+                    double *row = &sums[(q - first) * no_clusters];
+                    double norm = point_norms[evaluated[q]];
+
+                    // Four dot products at a time share the loads of the evaluated point
+                    size_t j = block;
+                    for (; j + 4 <= block_end; j += 4)
+                    {
+                        const IMAGE_DATA &p0 = image_dataset[j].GetImageData(), &p1 = image_dataset[j + 1].GetImageData();
+                        const IMAGE_DATA &p2 = image_dataset[j + 2].GetImageData(), &p3 = image_dataset[j + 3].GetImageData();
+                        double dot0 = 0.0, dot1 = 0.0, dot2 = 0.0, dot3 = 0.0;
+                        for (size_t d = 0; d < no_dimensions; d++)
+                        {
+                            double x = point[d];
+                            dot0 += x * p0[d];
+                            dot1 += x * p1[d];
+                            dot2 += x * p2[d];
+                            dot3 += x * p3[d];
+                        }
+                        double dots[4] = {dot0, dot1, dot2, dot3};
+                        for (int r = 0; r < 4; r++)
+                        {
+                            if (assignments[j + r] != -1)
+                                row[assignments[j + r]] += sqrt(std::max(norm + point_norms[j + r] - 2 * dots[r], 0.0));
+                        }
+                    }
+                    for (; j < block_end; j++)
                     {
-                        meanDistanceToOtherCluster += euclideanDistance(otherPoint, cluster[j]);
+                        if (assignments[j] != -1)
+                            row[assignments[j]] += sqrt(squaredDistance(point, image_dataset[j].GetImageData()));
                     }
                 }
-                if (cluster.size() > 1)
+            }
+
+            for (size_t q = first; q < last; q++)
+            {
+                const double *row = &sums[(q - first) * no_clusters];
+                int own = assignments[evaluated[q]];
+
+                // A point alone in its cluster has a silhouette of 0
+                if (clusters[own].size() <= 1)
+                    continue;
+
+                double a = row[own] / (clusters[own].size() - 1); // The point's distance to itself is 0
+                double b = std::numeric_limits<double>::max();
+                for (int c = 0; c < no_clusters; c++)
                 {
-                    meanDistanceToOtherCluster /= (cluster.size() - 1);
+                    if (c != own && !clusters[c].empty())
+                        b = std::min(b, row[c] / clusters[c].size());
                 }
-                b = std::min(b, meanDistanceToOtherCluster);
-            }
 
-            // Calculate Silhouette score for the current data point
-            double s = (b - a) / std::max(a, b);
-            silhouette += s;
-        }
+                if (b != std::numeric_limits<double>::max() && std::max(a, b) > 0.0)
+                    values[q] = (b - a) / std::max(a, b);
+            } });
 
-        return silhouette / cluster.size();
-    }
+        no_distance_evaluations += (long long)evaluated.size() * image_dataset.size();
 
-    // Function to calculate the Silhouette score for all clusters and average
-    double silhouetteScore(const vector<vector<IMAGE_DATA>> &clusters)
-    {
-        double averageSilhouette = 0.0;
+        // Aggregate the values of every cluster, and of the whole clustering weighted by the cluster sizes
+        scores = vector<double>(no_clusters, 0.0);
+        bounds = vector<double>(no_clusters, 0.0);
+        overall = 0.0;
+        double overall_variance = 0.0;
 
-        for (const std::vector<IMAGE_DATA> &cluster : clusters)
+        size_t offset = 0;
+        for (int c = 0; c < no_clusters; c++)
         {
-            double clusterSilhouette = silhouetteScoreForCluster(cluster);
-            averageSilhouette += clusterSilhouette;
+            int m = no_evaluated[c];
+            double n = clusters[c].size();
+            if (m == 0)
+                continue;
+
+            double mean = 0.0, variance = 0.0;
+            for (int q = 0; q < m; q++)
+                mean += values[offset + q];
+            mean /= m;
+            for (int q = 0; q < m; q++)
+                variance += (values[offset + q] - mean) * (values[offset + q] - mean);
+            variance = m > 1 ? variance / (m - 1) : 0.0;
+
+            // Variance of the sample mean, with the finite population correction
+            double mean_variance = variance / m * (1.0 - m / n);
+
+            scores[c] = mean;
+            bounds[c] = SILHOUETTE_Z * sqrt(mean_variance);
+            overall += n / no_assigned * mean;
+            overall_variance += (n / no_assigned) * (n / no_assigned) * mean_variance;
+            offset += m;
         }
 
-        return averageSilhouette / clusters.size();
+        overall_bound = SILHOUETTE_Z * sqrt(overall_variance);
     }
 
+    // Get the centers of the clusters.
+    const vector<IMAGE_DATA> &GetClusterCenters() const { return cluster_centers; }
+
+    // Set the number of points per cluster whose silhouette is computed, 0 to compute it for every point.
+    void SetSilhouetteSample(int _silhouette_sample) { silhouette_sample = std::max(_silhouette_sample, 0); }
+
     stringstream getResults()
     {
         stringstream results;
 
-        results << "Algorithm: Lloyds" << endl;
+        switch (method)
+        {
+        case LSH_METHOD:
+            results << "Algorithm: Range Search LSH" << endl;
+            break;
+        case HYPERCUBE_METHOD:
+            results << "Algorithm: Range Search Hypercube" << endl;
+            break;
+        case ELKAN_METHOD:
+            results << "Algorithm: Elkan" << endl;
+            break;
+        case HAMERLY_METHOD:
+            results << "Algorithm: Hamerly" << endl;
+            break;
+        case MINIBATCH_METHOD:
+            results << "Algorithm: Mini-batch" << endl;
+            break;
+        default:
+            results << "Algorithm: Lloyds" << endl;
+            break;
+        }
 
         // Basically print cluster information
         for (size_t i = 0; i < no_clusters; i++)
         {
-            vector<int> assignments_per_cluster;
+            // Members are unordered after swap-and-pop removals, print them in dataset order
+            vector<int> members = clusters[i];
+            sort(members.begin(), members.end());
 
-            for (size_t j = 0; j < image_dataset.size(); j++)
-                if (assignments[j] == i)
-                    assignments_per_cluster.push_back(image_dataset[j].GetIndex());
+            vector<int> assignments_per_cluster;
+            for (int member : members)
+                assignments_per_cluster.push_back(image_dataset[member].GetIndex());
 
             results << "CLUSTER-" << i + 1 << " {size: " << assignments_per_cluster.size() << ", centroid:[";
             for (size_t k = 0; k < assignments_per_cluster.size(); k++)
@@ -552,16 +1245,205 @@ public:
         }
         results << "clustering_time: " << executime_time_sec << " // in seconds" << endl;
 
-        // vector<vector<IMAGE_DATA>> clusters(no_clusters);
-        // for (size_t i = 0; i < image_dataset.size(); i++)
-        //     clusters[assignments[i]].push_back(image_dataset[i].GetImageData());
+        vector<double> scores, bounds;
+        double overall, overall_bound;
+        computeSilhouette(scores, bounds, overall, overall_bound);
+
+        results << "Silhouette: [";
+        for (size_t i = 0; i < no_clusters; i++)
+            results << scores[i] << ",";
+        results << overall << "]" << endl;
+
+        if (silhouette_sample > 0)
+        {
+            results << "Silhouette_confidence_95: [";
+            for (size_t i = 0; i < no_clusters; i++)
+                results << bounds[i] << ",";
+            results << overall_bound << "]" << endl;
+        }
+
+        return results;
+    }
+};
+
+// StreamingCluster runs k-Means with Lloyd's algorithm over a MNIST_Stream, one block of images at a time,
+// so that memory is bounded by a block, the centers and one assignment per point instead of the whole dataset.
+class StreamingCluster
+{
+private:
+    int no_clusters;
+    MNIST_Stream &dataset;
+    int no_threads;
+    unsigned int seed;
+    vector<IMAGE_DATA> cluster_centers;
+    vector<int> assignments;
+    double executime_time_sec;
+
+    // Function to initialize the cluster centers with k-Means++ over a uniform sample of the dataset,
+    // drawn with reservoir sampling during a single pass over the file.
+    void initializeClusterCenters()
+    {
+        size_t no_samples = std::min((size_t)dataset.GetSize(), (size_t)std::max(STREAM_INIT_SAMPLE, no_clusters));
+        vector<IMAGE_DATA> samples;
+        samples.reserve(no_samples);
+        mt19937 generator(seed);
+
+        dataset.ForEachBlock([&](size_t first, const vector<IMAGE_DATA> &images)
+                             {
+            for (size_t i = 0; i < images.size(); i++)
+            {
+                if (samples.size() < no_samples)
+                {
+                    samples.push_back(images[i]);
+                    continue;
+                }
+
+                size_t slot = uniform_int_distribution<size_t>(0, first + i)(generator);
+                if (slot < no_samples)
+                    samples[slot] = images[i];
+            } });
+
+        // k-Means++ over the sample, keeping the distance of every sample to its nearest center up to date
+        vector<double> min_distances(samples.size(), std::numeric_limits<double>::max());
+        cluster_centers.clear();
+        cluster_centers.push_back(samples[uniform_int_distribution<size_t>(0, samples.size() - 1)(generator)]);
+
+        while (cluster_centers.size() < (size_t)no_clusters)
+        {
+            for (size_t i = 0; i < samples.size(); i++)
+            {
+                double distance = EuclideanDistance(2, samples[i], cluster_centers.back());
+                min_distances[i] = std::min(min_distances[i], distance * distance);
+            }
+
+            discrete_distribution<size_t> by_distance(min_distances.begin(), min_distances.end());
+            cluster_centers.push_back(samples[by_distance(generator)]);
+        }
+    }
+
+    // Function to assign every point to the nearest cluster center, one block at a time, and move the centers to the means of their points.
+    // The points of every block are split across the threads, which accumulate the sums and sizes of the clusters locally.
+    uint assignToNearestClusterLloyd()
+    {
+        uint changes = 0;
+        vector<vector<IMAGE_DATA>> partial_sums(no_threads, vector<IMAGE_DATA>(no_clusters));
+        vector<vector<int>> partial_sizes(no_threads, vector<int>(no_clusters, 0));
+        vector<uint> partial_changes(no_threads, 0);
+        for (int t = 0; t < no_threads; t++)
+            for (int j = 0; j < no_clusters; j++)
+                partial_sums[t][j].fill(0.0);
+
+        dataset.ForEachBlock([&](size_t first, const vector<IMAGE_DATA> &images)
+                             {
+            atomic<size_t> next_point(0);
+            auto worker = [&](int t)
+            {
+                for (size_t i = next_point.fetch_add(CLUSTER_POINT_BLOCK); i < images.size(); i = next_point.fetch_add(CLUSTER_POINT_BLOCK))
+                {
+                    for (size_t p = i; p < std::min(images.size(), i + CLUSTER_POINT_BLOCK); p++)
+                    {
+                        int nearest_cluster = 0;
+                        double min_distance = std::numeric_limits<double>::max();
+                        for (int j = 0; j < no_clusters; j++)
+                        {
+                            double distance = EuclideanDistance(2, images[p], cluster_centers[j]);
+                            if (distance < min_distance)
+                            {
+                                min_distance = distance;
+                                nearest_cluster = j;
+                            }
+                        }
+
+                        if (assignments[first + p] != nearest_cluster)
+                        {
+                            assignments[first + p] = nearest_cluster;
+                            partial_changes[t]++;
+                        }
+
+                        partial_sizes[t][nearest_cluster]++;
+                        for (size_t d = 0; d < DIMENSIONS; d++)
+                            partial_sums[t][nearest_cluster][d] += images[p][d];
+                    }
+                }
+            };
+
+            vector<thread> threads;
+            for (int t = 1; t < no_threads; t++)
+                threads.push_back(thread(worker, t));
+            worker(0);
+            for (thread &t : threads)
+                t.join(); });
+
+        // Reduce the partial sums of the threads into the new centers, an empty cluster keeps its previous center
+        for (int j = 0; j < no_clusters; j++)
+        {
+            for (int t = 1; t < no_threads; t++)
+            {
+                partial_sizes[0][j] += partial_sizes[t][j];
+                for (size_t d = 0; d < DIMENSIONS; d++)
+                    partial_sums[0][j][d] += partial_sums[t][j][d];
+            }
+
+            if (partial_sizes[0][j] > 0)
+            {
+                for (size_t d = 0; d < DIMENSIONS; d++)
+                    cluster_centers[j][d] = partial_sums[0][j][d] / partial_sizes[0][j];
+            }
+        }
+
+        for (int t = 0; t < no_threads; t++)
+            changes += partial_changes[t];
+
+        return changes;
+    }
+
+public:
+    // Create a new instance of StreamingCluster and cluster the dataset.
+    StreamingCluster(int _no_clusters, MNIST_Stream &_dataset, int _no_threads = 1, unsigned int _seed = random_device()())
+        : no_clusters(_no_clusters), dataset(_dataset), no_threads(std::max(_no_threads, 1)), seed(_seed)
+    {
+        assignments = vector<int>(dataset.GetSize(), -1); // -1 marks an unassigned point
+
+        Initialization();
+    }
+
+    /* Initialization */
+    void Initialization()
+    {
+        Stopwatch stopwatch;
+
+        initializeClusterCenters();
+
+        uint changes = dataset.GetSize();
+        for (int it = 0; it < 15 && ((double)changes / (double)dataset.GetSize()) > 0.1; it++)
+        {
+            cout << "Assigning points to clusters using Lloyd's algorithm over " << dataset.GetFilePath() << "..." << endl;
+            changes = assignToNearestClusterLloyd();
+            cout << "Changes: " << changes << endl;
+        }
+
+        executime_time_sec = stopwatch.ElapsedSeconds();
+    }
+
+    stringstream getResults()
+    {
+        stringstream results;
+        results << "Algorithm: Lloyds" << endl;
+
+        vector<vector<int>> members(no_clusters);
+        for (size_t i = 0; i < assignments.size(); i++)
+            members[assignments[i]].push_back(i);
+
+        for (int i = 0; i < no_clusters; i++)
+        {
+            results << "CLUSTER-" << i + 1 << " {size: " << members[i].size() << ", centroid:[";
+            for (size_t k = 0; k < members[i].size(); k++)
+                results << members[i][k] << (k + 1 < members[i].size() ? " " : "");
+            results << "]" << endl;
+        }
+        results << "clustering_time: " << executime_time_sec << " // in seconds" << endl;
 
-        // results << "Silhouette: [";
-        // for (size_t i = 0; i < no_clusters; i++)
-        //     if (i < no_clusters - 1)
-        //         results << silhouetteScoreForCluster(clusters[i]) << ",";
-        //     else
-        //         results << silhouetteScoreForCluster(clusters[i]) << "]" << endl; // last
+        // The silhouette needs random access to the dataset, it is not computed while streaming
 
         return results;
     }
@@ -0,0 +1,155 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "mnist.h"
+#include "stats.h"
+
+using namespace std;
+
+// A neighbor found by a search, its distance to the query and its index inside the dataset.
+typedef pair<double, uint> Neighbor;
+
+// QueryContext owns the working memory of the searches: the k nearest neighbors, the candidate lists,
+// the visited tags, the heaps and the PQ table. It is reset between queries instead of being freed,
+// so once its buffers have grown to the size that the queries need, a search does not allocate at all.
+// A context must only be used by one search at a time, ThreadQueryContext() gives every thread its own.
+class QueryContext
+{
+private:
+    vector<Neighbor> nearest; // The nearest neighbors found so far, sorted by increasing distance.
+    int no_neighbours;        // The number of neighbors that the current search keeps.
+    vector<unsigned> tags;    // The epoch in which every image was last visited.
+    unsigned epoch;           // The epoch of the current search, a bump forgets every visit at once.
+
+public:
+    vector<uint> candidates;   // The indices of the candidate images, e.g. of the probed buckets.
+    vector<Neighbor> scored;   // Scored candidates, e.g. by their PQ distance.
+    vector<Neighbor> frontier; // The nodes waiting to be expanded by the graph searches, or the lists probed by IVF.
+    vector<Neighbor> pool;     // The dynamic candidate list of the graph searches.
+    vector<int> links;         // A copy of a neighbor list that may be modified while it is read.
+    vector<double> table;      // The PQ distance table of the query.
+    mt19937 generator;         // The random starting nodes of the graph searches.
+    SearchStats stats;         // The counters of the current search, only updated when built with SEARCH_STATS.
+
+    // Create a new instance of QueryContext.
+    QueryContext() : no_neighbours(0), epoch(0), generator(random_device()()) {}
+
+    QueryContext(const QueryContext &) = delete;
+    QueryContext &operator=(const QueryContext &) = delete;
+
+    // Prepare the context for a search of the {_no_neighbours} nearest of {no_images} images.
+    void Reset(int _no_neighbours, size_t no_images)
+    {
+        no_neighbours = max(_no_neighbours, 0);
+        if (nearest.capacity() < (size_t)no_neighbours + 1)
+            nearest.reserve(no_neighbours + 1);
+
+        nearest.clear();
+        candidates.clear();
+        scored.clear();
+        frontier.clear();
+        pool.clear();
+        stats.Clear();
+        ResetVisited(no_images);
+    }
+
+    // Forget every visited image, without touching the tags unless the epoch wraps around.
+    void ResetVisited(size_t no_images)
+    {
+        if (tags.size() < no_images)
+            tags.resize(no_images, 0);
+
+        if (++epoch == 0)
+        {
+            fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // Mark the image as visited and return whether it had already been visited.
+    bool Visit(uint index)
+    {
+        if (tags[index] == epoch)
+            return true;
+
+        tags[index] = epoch;
+        return false;
+    }
+
+    // Offer an image to the {no_neighbours} nearest ones, the same way InsertNearestNeighbor does with a set:
+    // it is kept while it is one of the nearest, unless an image with the exact same distance already is.
+    bool Offer(double dist, uint index)
+    {
+        if ((int)nearest.size() == no_neighbours && (no_neighbours == 0 || dist >= nearest.back().first))
+            return false;
+
+        vector<Neighbor>::iterator position = lower_bound(nearest.begin(), nearest.end(), dist,
+                                                          [](const Neighbor &neighbor, double value)
+                                                          { return neighbor.first < value; });
+        if (position != nearest.end() && position->first == dist)
+            return false;
+
+        nearest.insert(position, Neighbor(dist, index));
+        if ((int)nearest.size() > no_neighbours)
+            nearest.pop_back();
+
+        return true;
+    }
+
+    // Collect an image of a range search, the collected ones are ordered by FinishCollecting().
+    void Collect(double dist, uint index)
+    {
+        nearest.push_back(Neighbor(dist, index));
+    }
+
+    // Sort the collected images, keeping one image per distance (the lowest index) like the sets of the range searches do.
+    void FinishCollecting()
+    {
+        sort(nearest.begin(), nearest.end());
+        nearest.erase(unique(nearest.begin(), nearest.end(), [](const Neighbor &a, const Neighbor &b)
+                             { return a.first == b.first; }),
+                      nearest.end());
+    }
+
+    // Get the distance that an image must beat to be kept, the distance of the k-th nearest one once there are k.
+    double Bound() const
+    {
+        return (int)nearest.size() < no_neighbours ? numeric_limits<double>::max() : nearest.back().first;
+    }
+
+    // Get the nearest neighbors found by the last search, sorted by increasing distance.
+    const vector<Neighbor> &GetNearest() const { return nearest; }
+
+    // Get the number of neighbors that the current search keeps.
+    int GetNeighboursCount() const { return no_neighbours; }
+
+    // Copy the nearest neighbors found by the last search to a set of images, which the drivers print.
+    set<MNIST_Image, MNIST_ImageComparator> GetNearestSet(const vector<MNIST_Image> &images) const
+    {
+        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
+        for (const Neighbor &neighbor : nearest)
+        {
+            MNIST_Image image = images[neighbor.second];
+            image.SetDist(neighbor.first);
+            nearest_neighbors.insert(nearest_neighbors.end(), image);
+        }
+
+        return nearest_neighbors;
+    }
+};
+
+// Get the query context of the calling thread, its buffers live as long as the thread.
+inline QueryContext &ThreadQueryContext()
+{
+    static thread_local QueryContext context;
+    return context;
+}
+
+#endif // CONTEXT_H
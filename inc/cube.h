@@ -5,17 +5,22 @@
 #include <unordered_map>
 #include <set>
 #include <cstdio>
+#include <cstdint>
 #include <fstream>
 #include <string>
-#include <bitset>
+#include <stdexcept>
 
+#include "context.h"
 #include "hash.h"
+#include "misc.h"
 #include "mnist.h"
+#include "pq.h"
 
 #define WINDOW 400
+#define MAX_CUBE_DIMENSION 32 // The vertex codes are 32-bit integers, one bit per dimension of the cube.
 
 using namespace std;
-using Vertex = vector<MNIST_Image>;
+using Vertex = vector<uint>; // The indices of the images of a vertex.
 
 // Hypercube contains the functionality of the Hypercube algorithm.
 class Hypercube
@@ -25,212 +30,166 @@ private:
     int dimension;
     int max_candidates;
     int probes;
+    size_t no_dimensions;                  // The number of leading coordinates of the images that hold data
     vector<MNIST_Image> images;
-    unordered_map<string, Vertex> vertices; // The vertices essentially act as a Hash Table if you think about it
-    vector<IMAGE_DATA> random_projections;  // These are the random vectors that are used to calculate each h(p) for each hash table
+    unordered_map<uint, Vertex> vertices;  // The vertices essentially act as a Hash Table if you think about it, bit j of a code is f_j(p)
+    vector<IMAGE_DATA> random_projections; // These are the random vectors that are used to calculate each h(p) for each hash table
+    vector<double> random_shifts;          // The random shift t of each h(p)
+    const PQ *pq;                          // The PQ codec scoring the candidates, if any
 
     /* Functions */
-    string IntToBinaryString(int num, int num_bits)
+    // Map the image to the code of its vertex, every dimension contributing a binary digit.
+    uint VertexCode(const IMAGE_DATA &image)
     {
-        return bitset<32>(num).to_string().substr(32 - num_bits);
-    }
-
-    int HammingDistance(const std::string &str1, const std::string &str2)
-    {
-        // Check if the strings have the same length
-        if (str1.length() != str2.length())
-        {
-            throw std::invalid_argument("Input strings must have the same length.");
-        }
-
-        int distance = 0;
-
-        for (size_t i = 0; i < str1.length(); i++)
+        uint vertex_code = 0;
+        for (int j = 0; j < dimension; j++)
         {
-            if (str1[i] != str2[i])
-            {
-                distance++;
-            }
+            uint hash_code = CalculateHashCode(image, random_projections[j], WINDOW, random_shifts[j], no_dimensions);
+            vertex_code |= (hash_code % 2) << j;
         }
 
-        return distance;
+        return vertex_code;
     }
 
-    void Initialization()
+    void Initialization(unsigned int seed)
     {
         // Create random projection vectors
-        random_projections = GetRandomProjections(1, dimension)[0];
+        random_projections = GetRandomProjections(1, dimension, seed)[0];
+        random_shifts = GetRandomShifts(1, dimension, WINDOW, seed)[0];
 
         for (int i = 0; i < (int)images.size(); i++)
-        {
-            MNIST_Image image = images[i];
-            string query_vertex_code = "";
-
-            for (int j = 0; j < dimension; j++)
-            { // For each dimension
-
-                // Map the image to a binary digit, eventually creating a string of 0s and 1s
-                uint hash_code = CalculateHashCode(image.GetImageData(), random_projections[j], WINDOW);
-
-                int binary_digit = hash_code % 2;
-                query_vertex_code += to_string(binary_digit);
-            }
-
-            if (vertices.find(query_vertex_code) == vertices.end())
-            {
-                vertices[query_vertex_code] = vector<MNIST_Image>(0);
-            }
-            vertices[query_vertex_code].push_back(image);
-        }
-    }
-
-    vector<MNIST_Image> GetNearestNeighborsCandidates(vector<vector<Vertex>> vertices_by_hamming_distance)
-    {
-        vector<MNIST_Image> nearest_neighbors_candidates(0);
-
-        for (int i = 0; i < probes; i++)
-        {
-
-            for (int j = 0; j < (int)vertices_by_hamming_distance[i].size(); j++)
-            { // For every vertex with 0 <= hamming distance to query_vertex <= probes (opbv probes <= dimension)
-                Vertex vertex = vertices_by_hamming_distance[i][j];
-
-                for (int k = 0; k < (int)vertex.size(); k++)
-                { // For every image of said vertex
-
-                    // If we've reached max candidates then return
-                    if ((int)nearest_neighbors_candidates.size() == max_candidates)
-                    {
-                        return nearest_neighbors_candidates;
-                    }
-
-                    nearest_neighbors_candidates.push_back(vertex[k]);
-                }
-            }
-        }
-
-        return nearest_neighbors_candidates;
+            vertices[VertexCode(images[i].GetImageData())].push_back(i);
     }
 
 public:
-    // Create a new instance of LSH.
-    Hypercube(MNIST _input, int _d, int _M, int _p)
+    // Create a new instance of LSH, the same seed draws the same projections.
+    Hypercube(MNIST _input, int _d, int _M, int _p, unsigned int seed = random_device()())
     {
         dimension = _d;
         max_candidates = _M;
         probes = _p;
         images = _input.GetImages();
+        no_dimensions = _input.GetDimensionsCount();
+        pq = nullptr;
 
-        Initialization();
-    }
-
-    // Find the {no_nearest} "Nearest Neighbors" vectors of the queried one using the Hypercube algorithm.
-    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
-    {
-        // Find corresponding vertex for query_image
-        string query_vertex_code = "";
-
-        for (int i = 0; i < dimension; i++)
-        { // For each dimension
-
-            // Map the image to a binary digit, eventually creating a string of 0s and 1s
-            uint hash_code = CalculateHashCode(query_image.GetImageData(), random_projections[i], WINDOW);
-
-            int binary_digit = hash_code % 2;
-            query_vertex_code += to_string(binary_digit);
-        }
-
-        vector<MNIST_Image> query_image_vertex(0);
-        if (vertices.find(query_vertex_code) != vertices.end())
+        if (dimension < 1 || dimension > MAX_CUBE_DIMENSION)
         {
-            vector<MNIST_Image> query_image_vertex = vertices[query_vertex_code];
+            throw runtime_error("The dimension of the Hypercube must be between 1 and " + to_string(MAX_CUBE_DIMENSION) + ".\n");
         }
 
-        // Organize vertices by hamming distance to the vertex corresponding to the query_image, so probing logic can take place
-        vector<vector<Vertex>> vertices_by_hamming_distance(dimension + 1);
+        Initialization(seed);
+    }
 
-        for (int i = 0; i < (int)vertices.size(); i++)
+    // Collect up to {max_candidates} images into the context's candidates, probing the vertices by increasing hamming distance
+    // to the vertex of the query, up to {probes} - 1. The vertices at hamming distance h are the query's code XOR every mask of h set bits,
+    // enumerated in increasing order with Gosper's hack, so that no list of vertices is ever built.
+    // The context must have been Reset() for the search, the candidates are appended to its own.
+    void GetNearestNeighborsCandidates(const IMAGE_DATA &query, QueryContext &context)
+    {
+        uint query_vertex_code;
         {
-            string vertex_code = IntToBinaryString(i, dimension);
-            int hamming_distance = HammingDistance(query_vertex_code, vertex_code);
-            if (vertices.find(vertex_code) != vertices.end())
-            {
-                vertices_by_hamming_distance[hamming_distance].push_back(vertices[vertex_code]);
-            }
+            STATS_TIMER(context.stats, HASHING_NS);
+            query_vertex_code = VertexCode(query);
         }
+        uint64_t no_codes = (uint64_t)1 << dimension;
 
-        vector<MNIST_Image> nearest_neighbors_candidates = GetNearestNeighborsCandidates(vertices_by_hamming_distance);
-
-        // Compare distances to query_image
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
-        double min_dist = pow(2, 32) - 5;
-
-        for (int i = 0; i < (int)nearest_neighbors_candidates.size(); i++)
+        for (int hamming_distance = 0; hamming_distance < probes && hamming_distance <= dimension; hamming_distance++)
         {
-            double dist = EuclideanDistance(2, query_image.GetImageData(), images[i].GetImageData());
-            images[i].SetDist(dist);
-
-            if (dist < min_dist)
+            for (uint64_t mask = ((uint64_t)1 << hamming_distance) - 1; mask < no_codes;)
             {
-                if ((int)nearest_neighbors.size() == no_neighbours)
+                STATS_ADD(context.stats, BUCKETS_PROBED, 1);
+                unordered_map<uint, Vertex>::const_iterator vertex = vertices.find(query_vertex_code ^ (uint)mask);
+                if (vertex != vertices.end())
                 {
-                    nearest_neighbors.erase(--nearest_neighbors.end());
-                }
+                    for (uint index : vertex->second)
+                    {
+                        // If we've reached max candidates then return
+                        if ((int)context.candidates.size() == max_candidates)
+                            return;
 
-                nearest_neighbors.insert(images[i]);
+                        context.candidates.push_back(index);
+                    }
+                }
 
-                set<MNIST_Image, MNIST_ImageComparator>::reverse_iterator itr = nearest_neighbors.rbegin();
-                MNIST_Image last_image = *itr;
-                min_dist = last_image.GetDist();
+                // The next mask with the same number of set bits, there is a single mask of 0 bits
+                if (mask == 0)
+                    break;
+                uint64_t lowest = mask & (~mask + 1);
+                uint64_t ripple = mask + lowest;
+                mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
             }
         }
-
-        return nearest_neighbors;
     }
 
-    // Find the vectors inside the given radius of the queried one using Hypercube algorithm.
-    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius)
-    {
-        // Find corresponding vertex for query_image
-        string query_vertex_code = "";
+    // Get the bytes that the index holds besides the images: the vertices and the hash functions.
+    size_t GetMemoryBytes() const { return HeapBytes(vertices) + HeapBytes(random_projections) + HeapBytes(random_shifts); }
 
-        for (int i = 0; i < dimension; i++)
+    // Score the candidates with the given PQ codec, only its best scoring ones get their exact distances computed.
+    // The codec must have encoded the same dataset as the index, nullptr restores the exact scoring.
+    void SetPQ(const PQ *_pq)
+    {
+        if (_pq != nullptr && _pq->GetCodesCount() != images.size())
         {
-            uint hash_code = CalculateHashCode(query_image.GetImageData(), random_projections[i], WINDOW);
-
-            int binary_digit = hash_code % 2;
-            query_vertex_code += to_string(binary_digit);
+            throw runtime_error("The PQ codec encoded " + to_string(_pq->GetCodesCount()) + " vectors, the Hypercube holds " + to_string(images.size()) + ".\n");
         }
 
-        vector<MNIST_Image> query_image_vertex = vertices[query_vertex_code];
+        pq = _pq;
+    }
 
-        // Organize vertices by hamming distance to the vertex corresponding to the query_image
-        vector<vector<Vertex>> vertices_by_hamming_distance(dimension + 1);
+    // Find the {no_neighbours} "Nearest Neighbors" of the query using the Hypercube algorithm, into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query, int no_neighbours, QueryContext &context)
+    {
+        context.Reset(no_neighbours, images.size());
+        GetNearestNeighborsCandidates(query, context);
+        STATS_ADD(context.stats, CANDIDATES, context.candidates.size());
+        STATS_TIMER(context.stats, DISTANCE_NS);
 
-        for (int i = 0; i < (int)vertices.size(); i++)
+        if (pq != nullptr)
         {
-            string vertex_code = IntToBinaryString(i, dimension);
-            int hamming_distance = HammingDistance(query_vertex_code, vertex_code);
-            vertices_by_hamming_distance[hamming_distance].push_back(vertices[vertex_code]);
+            pq->ComputeDistanceTable(query, context.table);
+            pq->ScoreCandidates(context);
+            pq->Rerank(query, context, images);
+            return;
         }
 
-        vector<MNIST_Image> nearest_neighbors_candidates = GetNearestNeighborsCandidates(vertices_by_hamming_distance);
+        // Compare distances to the query
+        for (uint index : context.candidates)
+            context.Offer(EuclideanDistance(2, query, images[index].GetImageData(), no_dimensions), index);
+    }
+
+    // Find the {no_nearest} "Nearest Neighbors" vectors of the queried one using the Hypercube algorithm.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_neighbours, context);
 
-        // Compare distances to query_image
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
+        return context.GetNearestSet(images);
+    }
 
-        for (int i = 0; i < (int)nearest_neighbors_candidates.size(); i++)
-        {
-            double dist = EuclideanDistance(2, query_image.GetImageData(), images[i].GetImageData());
-            images[i].SetDist(dist);
+    // Find the images inside the given radius of the query using Hypercube algorithm, into the context's nearest neighbors.
+    void RadiusSearch(const IMAGE_DATA &query, int radius, QueryContext &context)
+    {
+        context.Reset(0, images.size());
+        GetNearestNeighborsCandidates(query, context);
 
+        // Compare distances to the query
+        for (uint index : context.candidates)
+        {
+            double dist = EuclideanDistance(2, query, images[index].GetImageData(), no_dimensions);
             if (dist < radius)
-            {
-                nearest_neighbors.insert(images[i]);
-            }
+                context.Collect(dist, index);
         }
 
-        return nearest_neighbors;
+        context.FinishCollecting();
+    }
+
+    // Find the vectors inside the given radius of the queried one using Hypercube algorithm.
+    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius)
+    {
+        QueryContext &context = ThreadQueryContext();
+        RadiusSearch(query_image.GetImageData(), radius, context);
+
+        return context.GetNearestSet(images);
     }
 };
 
@@ -0,0 +1,268 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IDX3_MAGIC 2051    // Magic number of the MNIST idx3 images files.
+#define IDX3_HEADER 16     // Size of the header of an idx3 file: magic, count, rows and columns.
+#define VECS_PREFIX 4      // Size of the dimension that prefixes every vector of the fvecs/bvecs/ivecs files.
+#define FORMAT_PROBE 65536 // Number of leading bytes of a file that its format is detected on.
+
+using namespace std;
+
+// The vector file formats that the datasets are read from.
+enum VectorFormat
+{
+    IDX3_FORMAT,    // MNIST images: a big endian header, then rows x columns uint8 pixels per image.
+    FVECS_FORMAT,   // TEXMEX (SIFT1M/GIST1M): per vector, its little endian int32 dimension then the float32 elements.
+    BVECS_FORMAT,   // TEXMEX: per vector, its int32 dimension then the uint8 elements.
+    IVECS_FORMAT,   // TEXMEX: per vector, its int32 dimension then the int32 elements.
+    FLOAT32_FORMAT, // Headerless row-major matrix of float32 elements.
+    UINT8_FORMAT    // Headerless row-major matrix of uint8 elements.
+};
+
+// Get the name of a vector file format.
+inline string FormatName(VectorFormat format)
+{
+    switch (format)
+    {
+    case IDX3_FORMAT:
+        return "idx3";
+    case FVECS_FORMAT:
+        return "fvecs";
+    case BVECS_FORMAT:
+        return "bvecs";
+    case IVECS_FORMAT:
+        return "ivecs";
+    case FLOAT32_FORMAT:
+        return "float32";
+    default:
+        return "uint8";
+    }
+}
+
+// The layout of a vector file: a header, then {count} fixed size records, each one a prefix followed by the elements.
+struct VectorLayout
+{
+    VectorFormat format; // The format of the file.
+    size_t header;       // The number of bytes before the first record.
+    size_t prefix;       // The number of bytes before the elements of every record.
+    size_t element;      // The number of bytes of every element.
+    size_t dimensions;   // The number of elements of every record.
+    size_t count;        // The number of records.
+    uint32_t rows;       // The number of rows of the images, 1 for the formats that are not images.
+    uint32_t columns;    // The number of columns of the images, the dimension for the formats that are not images.
+
+    // Get the number of bytes of every record.
+    size_t Stride() const { return prefix + dimensions * element; }
+
+    // Get the offset of the given record inside the file.
+    size_t Offset(size_t record) const { return header + record * Stride(); }
+};
+
+// Function that extracts a big endian unsigned integer value.
+inline uint32_t ExtractBigEndian(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | (uint32_t)bytes[3];
+}
+
+// Function that extracts a little endian unsigned integer value.
+inline uint32_t ExtractLittleEndian(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[3] << 24 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[0];
+}
+
+// Check that the given bytes read as plausible float32 values: finite, and either zero or of a sane magnitude.
+// Integers read as floats are denormals or huge, which tells fvecs from ivecs and float32 from uint8 matrices.
+inline bool LooksLikeFloats(const uint8_t *bytes, size_t no_floats)
+{
+    for (size_t i = 0; i < no_floats; i++)
+    {
+        float value;
+        memcpy(&value, bytes + i * 4, 4);
+        if (!isfinite(value) || (value != 0.0f && (fabs(value) < 1e-20f || fabs(value) > 1e20f)))
+            return false;
+    }
+
+    return true;
+}
+
+// Detect the layout of a vector file of {dimensions} elements per vector, from its extension, magic number and size.
+// {head} holds the first min(file_size, FORMAT_PROBE) bytes of the file.
+inline VectorLayout DetectLayout(const uint8_t *head, size_t head_size, size_t file_size, size_t dimensions, const string &file_path)
+{
+    string extension = file_path.substr(min(file_path.find_last_of('.'), file_path.size()));
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    auto dimension_error = [&](size_t found)
+    {
+        return runtime_error("The vectors of the file have " + to_string(found) + " dimensions instead of " + to_string(dimensions) +
+                             ", rebuild with DIMENSIONS=" + to_string(found) + ": " + file_path + "\n");
+    };
+
+    // MNIST idx3: the magic number, and a size that matches the header
+    if (head_size >= IDX3_HEADER && ExtractBigEndian(head) == IDX3_MAGIC)
+    {
+        size_t count = ExtractBigEndian(head + 4);
+        uint32_t rows = ExtractBigEndian(head + 8), columns = ExtractBigEndian(head + 12);
+        if (file_size >= IDX3_HEADER + count * rows * columns)
+        {
+            if ((size_t)rows * columns != dimensions)
+                throw dimension_error((size_t)rows * columns);
+
+            return VectorLayout{IDX3_FORMAT, IDX3_HEADER, 0, 1, dimensions, count, rows, columns};
+        }
+    }
+
+    // fvecs/bvecs/ivecs: every record starts with its dimension, so the first one tells the record size
+    if (head_size >= VECS_PREFIX && extension != ".f32" && extension != ".u8")
+    {
+        size_t found = ExtractLittleEndian(head);
+        for (size_t element : {(size_t)4, (size_t)1})
+        {
+            if (element == 1 && (extension == ".fvecs" || extension == ".ivecs"))
+                continue;
+            if (element == 4 && extension == ".bvecs")
+                continue;
+
+            size_t stride = VECS_PREFIX + found * element;
+            if (found == 0 || found > (1u << 20) || file_size % stride != 0)
+                continue;
+
+            // The prefix of the second record must agree too, when there is one
+            if (file_size > stride && head_size >= stride + VECS_PREFIX && ExtractLittleEndian(head + stride) != found)
+                continue;
+
+            if (found != dimensions)
+                throw dimension_error(found);
+
+            VectorFormat format = BVECS_FORMAT;
+            if (element == 4)
+            {
+                bool floats = LooksLikeFloats(head + VECS_PREFIX, min(found, (head_size - VECS_PREFIX) / 4));
+                format = extension == ".ivecs" || (extension != ".fvecs" && !floats) ? IVECS_FORMAT : FVECS_FORMAT;
+            }
+
+            return VectorLayout{format, 0, VECS_PREFIX, element, dimensions, file_size / stride, 1, (uint32_t)dimensions};
+        }
+    }
+
+    // Headerless row-major matrices: the size must be a whole number of vectors, and uint8 pixels read as floats
+    // are denormals or huge as soon as a few of them are not zero, so the whole probe is checked.
+    // The .f32 and .u8 extensions settle the matrices that are too sparse to tell.
+    bool float32 = file_size % (dimensions * 4) == 0 && extension != ".u8" &&
+                   (extension == ".f32" || LooksLikeFloats(head, head_size / 4));
+    if (float32)
+        return VectorLayout{FLOAT32_FORMAT, 0, 0, 4, dimensions, file_size / (dimensions * 4), 1, (uint32_t)dimensions};
+    if (file_size % dimensions == 0 && extension != ".f32")
+        return VectorLayout{UINT8_FORMAT, 0, 0, 1, dimensions, file_size / dimensions, 1, (uint32_t)dimensions};
+
+    throw runtime_error("Unrecognized vector file, expected idx3, fvecs, bvecs, ivecs or a float32/uint8 matrix of " +
+                        to_string(dimensions) + " dimensions: " + file_path + "\n");
+}
+
+// Decode a record of the given layout into {out}, which holds {layout.dimensions} values.
+inline void DecodeRecord(const uint8_t *record, const VectorLayout &layout, double *out)
+{
+    const uint8_t *elements = record + layout.prefix;
+    size_t dimensions = layout.dimensions;
+
+    switch (layout.format)
+    {
+    case IDX3_FORMAT:
+        // The MNIST pixels have always been stored in reverse order, kept so that the results stay the same
+        for (size_t i = 0; i < dimensions; i++)
+            out[dimensions - 1 - i] = (double)elements[i];
+        break;
+    case BVECS_FORMAT:
+    case UINT8_FORMAT:
+        for (size_t i = 0; i < dimensions; i++)
+            out[i] = (double)elements[i];
+        break;
+    case FVECS_FORMAT:
+    case FLOAT32_FORMAT:
+        for (size_t i = 0; i < dimensions; i++)
+        {
+            float value;
+            memcpy(&value, elements + i * 4, 4);
+            out[i] = (double)value;
+        }
+        break;
+    case IVECS_FORMAT:
+        for (size_t i = 0; i < dimensions; i++)
+            out[i] = (double)(int32_t)ExtractLittleEndian(elements + i * 4);
+        break;
+    }
+}
+
+// MappedFile maps a whole file read-only, so that its records are decoded straight from the page cache
+// instead of being copied to an intermediate buffer first.
+class MappedFile
+{
+private:
+    const uint8_t *data; // The mapped bytes of the file.
+    size_t size;         // The size of the file.
+
+public:
+    // Map the given file.
+    MappedFile(const string &file_path) : data(nullptr), size(0)
+    {
+        int fd = open(file_path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            throw runtime_error("Failed to read the file: " + file_path + "\n");
+        }
+
+        size = info.st_size;
+        if (size > 0)
+        {
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                close(fd);
+                throw runtime_error("Failed to map the file: " + file_path + "\n");
+            }
+
+            // The file is decoded front to back
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = (const uint8_t *)mapping;
+        }
+
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data != nullptr)
+            munmap((void *)data, size);
+    }
+
+    // Get the bytes of the file.
+    const uint8_t *GetData() const { return data; }
+
+    // Get the size of the file.
+    size_t GetSize() const { return size; }
+};
+
+#endif // FORMATS_H
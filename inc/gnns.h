@@ -2,9 +2,14 @@
 #define GNNS_H
 
 #include <vector>
-#include <list>
+#include <algorithm>
+#include <numeric>
+#include <queue>
 #include <set>
+#include <stdexcept>
+#include <string>
 
+#include "context.h"
 #include "lsh.h"
 
 #define GREEDY_STEPS 20
@@ -20,25 +25,237 @@ private:
     int no_expansions;          // Number of expansions to use (default: 30).
     int no_restarts;            // Number of random restarts (default: 1).
     vector<MNIST_Image> images; // The MNIST dataset's images converted to d-vectors.
+    size_t no_dimensions;       // The number of leading coordinates of the images that hold data.
     LSH lsh;                    // The LSH is going to be used to find the candinates.
-    list<int> *graph;           // Graph implementation using adjacency list.
+    vector<vector<int>> graph;  // Graph implementation using adjacency list.
+    vector<int> lsh_degree;     // The number of LSH edges at the front of every node's list, the augmented edges follow them.
+    bool reverse_edges;         // Whether the reverse of every LSH edge is added to the graph.
+    int max_degree;             // Max out-degree of a node when adding the reverse and the connecting edges.
+    int no_long_range;          // Number of random long-range edges added to every node.
+    int entry_node;             // The node closest to the dataset's mean, used as the first starting node.
+    unsigned int seed;          // Seed of the LSH that finds the neighbors and of the long-range edges.
+    int prefetch_distance;      // How many neighbors ahead the search prefetches (default: PREFETCH_DISTANCE).
+    const PQ *pq;               // The PQ codec that scores the nodes during the search, if any.
+
+    // Find the node closest to the mean of the dataset.
+    int FindEntryNode()
+    {
+        IMAGE_DATA mean;
+        mean.fill(0.0);
+        for (int i = 0; i < (int)images.size(); i++)
+            for (int j = 0; j < DIMENSIONS; j++)
+                mean[j] += images[i].GetImageData()[j] / images.size();
+
+        int nearest = 0;
+        double min_dist = pow(2, 32) - 5;
+        for (int i = 0; i < (int)images.size(); i++)
+        {
+            double dist = EuclideanDistance(2, mean, images[i].GetImageData(), no_dimensions);
+            if (dist < min_dist)
+            {
+                min_dist = dist;
+                nearest = i;
+            }
+        }
+
+        return nearest;
+    }
+
+    // Add the directed edge (u, v) if it does not exist already.
+    bool AddEdge(int u, int v)
+    {
+        if (u == v || find(graph[u].begin(), graph[u].end(), v) != graph[u].end())
+            return false;
+
+        graph[u].push_back(v);
+        return true;
+    }
+
+    // Add the reverse of the LSH edges as long as the target node keeps room for its long-range edges below {max_degree}.
+    // The edges are visited by rank, so that the closest neighbors of every node get their reverse edge first.
+    void AddReverseEdges()
+    {
+        vector<vector<int>> forward_edges = graph;
+        size_t max_rank = 0;
+        for (int u = 0; u < (int)graph.size(); u++)
+            max_rank = max(max_rank, forward_edges[u].size());
+
+        for (size_t rank = 0; rank < max_rank; rank++)
+        {
+            for (int u = 0; u < (int)graph.size(); u++)
+            {
+                if (rank >= forward_edges[u].size())
+                    continue;
+
+                int v = forward_edges[u][rank];
+                if ((int)graph[v].size() < max_degree - no_long_range)
+                    AddEdge(v, u);
+            }
+        }
+    }
+
+    // Add {no_long_range} edges from every node to uniformly random nodes, which act as shortcuts for the greedy search.
+    // A node only gets the ones that fit below {max_degree}.
+    void AddLongRangeEdges()
+    {
+        mt19937 gen(seed);
+        uniform_int_distribution<int> random_image_index(0, images.size() - 1);
+
+        for (int u = 0; u < (int)graph.size(); u++)
+            for (int i = 0; i < no_long_range; i++)
+            {
+                int v = random_image_index(gen);
+                if ((int)graph[u].size() < max_degree)
+                    AddEdge(u, v);
+            }
+    }
+
+    // Make every node reachable from the entry node following the directed edges.
+    // A breadth-first search from the entry node runs over the graph, and whenever it stops short of a node,
+    // a reached node gets an edge to that node (and the node one back) and the search goes on from there.
+    // The edge starts at the entry node while it is below {max_degree}, else at the first node reached that is,
+    // so the cap holds unless every reached node is past it. Only the first unreached node of every unreachable part is linked.
+    void ConnectToEntryNode()
+    {
+        vector<bool> visited(graph.size(), false);
+        vector<int> reached;
+        size_t next_hub = 0; // The reached nodes before it are all at {max_degree}, their degree only grows.
+        queue<int> frontier;
+        frontier.push(entry_node);
+        visited[entry_node] = true;
+
+        for (int u = 0; u < (int)graph.size(); u++)
+        {
+            while (!frontier.empty())
+            {
+                int w = frontier.front();
+                frontier.pop();
+                reached.push_back(w);
+
+                for (int v : graph[w])
+                {
+                    if (!visited[v])
+                    {
+                        visited[v] = true;
+                        frontier.push(v);
+                    }
+                }
+            }
+
+            if (visited[u])
+                continue;
+
+            int hub = entry_node;
+            if ((int)graph[hub].size() >= max_degree)
+            {
+                while (next_hub < reached.size() && (int)graph[reached[next_hub]].size() >= max_degree)
+                    next_hub++;
+                if (next_hub < reached.size())
+                    hub = reached[next_hub];
+            }
+
+            AddEdge(hub, u);
+            if ((int)graph[u].size() < max_degree)
+                AddEdge(u, entry_node);
+            frontier.push(u);
+            visited[u] = true;
+        }
+    }
+
+    // Label every node with the weakly connected component it belongs to (union-find over the undirected edges).
+    vector<int> FindComponents()
+    {
+        vector<int> parent(graph.size());
+        iota(parent.begin(), parent.end(), 0);
+
+        for (int u = 0; u < (int)graph.size(); u++)
+        {
+            for (int v : graph[u])
+            {
+                int root_u = u, root_v = v;
+                while (parent[root_u] != root_u)
+                    root_u = parent[root_u] = parent[parent[root_u]];
+                while (parent[root_v] != root_v)
+                    root_v = parent[root_v] = parent[parent[root_v]];
+                parent[root_u] = root_v;
+            }
+        }
+
+        for (int u = 0; u < (int)graph.size(); u++)
+        {
+            int root = u;
+            while (parent[root] != root)
+                root = parent[root];
+            parent[u] = root;
+        }
+
+        return parent;
+    }
+
+    // Count the nodes that can be reached from {start} following the directed edges.
+    int CountReachable(int start)
+    {
+        vector<bool> visited(graph.size(), false);
+        queue<int> frontier;
+        frontier.push(start);
+        visited[start] = true;
+        int reached = 0;
+
+        while (!frontier.empty())
+        {
+            int u = frontier.front();
+            frontier.pop();
+            reached++;
+
+            for (int v : graph[u])
+            {
+                if (!visited[v])
+                {
+                    visited[v] = true;
+                    frontier.push(v);
+                }
+            }
+        }
+
+        return reached;
+    }
 
 public:
     // Create a new instance of GNNS.
-    GNNS(MNIST _input, int _no_lsh_neighbors, int _no_expansions, int _no_restarts)
+    // Create a new instance of GNNS, the same seed builds the same graph.
+    GNNS(MNIST _input, int _no_lsh_neighbors, int _no_expansions, int _no_restarts, unsigned int _seed = random_device()())
     {
         input = _input;
         no_lsh_neighbors = _no_lsh_neighbors;
         no_expansions = _no_expansions;
         no_restarts = _no_restarts;
         images = _input.GetImages();
+        no_dimensions = _input.GetDimensionsCount();
+        reverse_edges = false;
+        max_degree = 0;
+        no_long_range = 0;
+        entry_node = 0;
+        seed = _seed;
+        prefetch_distance = PREFETCH_DISTANCE;
+        pq = nullptr;
+
+        graph = vector<vector<int>>(_input.GetImagesCount());
+    }
 
-        graph = new list<int>[_input.GetImagesCount()];
+    // Augment the LSH graph with reverse edges and {_no_long_range} long-range edges per node, the augmented nodes stay at {_max_degree} edges at most.
+    // An augmented graph also gets the edges that make every node reachable from the entry node.
+    // The search expands at most {no_expansions} LSH edges of a node, and every augmented edge of it.
+    // Must be called before Initialization().
+    void SetAugmentation(bool _reverse_edges, int _max_degree, int _no_long_range)
+    {
+        reverse_edges = _reverse_edges;
+        max_degree = _max_degree;
+        no_long_range = _no_long_range;
     }
 
     void Initialization()
     {
-        lsh = LSH(input, 10, 15);
+        lsh = LSH(input, 10, 15, seed);
         cout << "[i] Initializing GNNS construction" << endl;
         printProgress(0.0);
         // for each image in input find a set of nearest neighbors
@@ -60,45 +277,152 @@ public:
         }
 
         printProgress(1.0);
-        cout << endl
-             << "[i] Finished GNNS construction" << endl;
+        cout << endl;
+
+        lsh_degree = vector<int>(graph.size());
+        for (int u = 0; u < (int)graph.size(); u++)
+            lsh_degree[u] = graph[u].size();
+
+        entry_node = FindEntryNode();
+
+        if (reverse_edges)
+            AddReverseEdges();
+
+        if (no_long_range > 0)
+            AddLongRangeEdges();
+
+        if (reverse_edges || no_long_range > 0)
+            ConnectToEntryNode();
+
+        PrintConnectivity();
+
+        cout << "[i] Finished GNNS construction" << endl;
     }
 
-    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_nearest_neighbours, MNIST_Image query_image)
+    // Print the connectivity stats of the graph.
+    void PrintConnectivity()
+    {
+        vector<int> components = FindComponents();
+        sort(components.begin(), components.end());
+        int no_components = unique(components.begin(), components.end()) - components.begin();
+
+        size_t no_edges = 0, max_out_degree = 0;
+        for (int u = 0; u < (int)graph.size(); u++)
+        {
+            no_edges += graph[u].size();
+            max_out_degree = max(max_out_degree, graph[u].size());
+        }
+
+        cout << "[i] GNNS graph: " << no_edges << " edges, "
+             << "avg degree " << (double)no_edges / graph.size() << ", "
+             << "max degree " << max_out_degree << ", "
+             << no_components << " weakly connected components, "
+             << CountReachable(entry_node) << "/" << graph.size() << " nodes reachable from entry node " << entry_node << endl;
+    }
+
+    // Get the bytes that the index holds besides the images: the edges, and the LSH that found the neighbors.
+    size_t GetMemoryBytes() const { return HeapBytes(graph) + HeapBytes(lsh_degree) + lsh.GetMemoryBytes(); }
+
+    // Set the number of expansions and random restarts of the search, the graph is not affected by them.
+    void SetSearchParameters(int _no_expansions, int _no_restarts)
+    {
+        no_expansions = _no_expansions;
+        no_restarts = _no_restarts;
+    }
+
+    // Set how many neighbors ahead the search prefetches, 0 disables prefetching.
+    void SetPrefetchDistance(int _prefetch_distance)
     {
-        set<MNIST_Image, MNIST_ImageComparator> possible_nearest_neighbors; // Used for sorting the final vector of ANN
+        prefetch_distance = _prefetch_distance;
+    }
 
-        random_device rd;
-        mt19937 gen(rd());
+    // Navigate the graph with the distances of the given PQ codec, and rerank the best scoring visited nodes exactly.
+    // The codec must have encoded the same dataset as the graph, nullptr restores the exact search.
+    void SetPQ(const PQ *_pq)
+    {
+        if (_pq != nullptr && _pq->GetCodesCount() != images.size())
+        {
+            throw runtime_error("The PQ codec encoded " + to_string(_pq->GetCodesCount()) + " vectors, the GNNS graph holds " + to_string(images.size()) + ".\n");
+        }
+
+        pq = _pq;
+    }
+
+    // Find the {no_nearest_neighbours} nearest visited nodes of the query with greedy searches from random nodes,
+    // into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query_data, int no_nearest_neighbours, QueryContext &context)
+    {
+        context.Reset(no_nearest_neighbours, images.size());
+
+        // With PQ every visited node is scored through the ADC table, and all of them are kept for the reranking
+        if (pq != nullptr)
+            pq->ComputeDistanceTable(query_data, context.table);
+
+        auto distance = [&](int node)
+        {
+            STATS_ADD(context.stats, CANDIDATES, 1);
+            // Only the stats builds tag the visited nodes, the macro arguments stay free of side effects
+#ifdef SEARCH_STATS
+            bool seen = context.Visit(node);
+#endif
+            STATS_ADD(context.stats, DUPLICATES, seen);
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            if (pq == nullptr)
+                return EuclideanDistance(2, query_data, images[node].GetImageData(), no_dimensions);
+
+            context.candidates.push_back(node);
+            return pq->AsymmetricDistance(context.table, node);
+        };
+
+        // Without PQ the visited nodes are offered straight to the nearest neighbors
+        auto offer = [&](int node, double dist)
+        {
+            if (pq == nullptr)
+                context.Offer(dist, node);
+        };
 
         uniform_int_distribution<int> random_image_index(0, images.size() - 1);
 
         for (int i = 0; i < no_restarts; i++)
         {
-            // Select a graph's node to start at random
-            int index = random_image_index(gen);
-            MNIST_Image node_image = images[index];
+            // Select a graph's node to start at random, the first restart of an augmented graph starts at the entry node
+            int index = random_image_index(context.generator);
+            if (i == 0 && (reverse_edges || no_long_range > 0))
+                index = entry_node;
+            STATS_ADD(context.stats, RESTARTS, 1);
 
-            double min_dist = EuclideanDistance(2, query_image.GetImageData(), node_image.GetImageData());
-            node_image.SetDist(min_dist);
+            double min_dist = distance(index);
 
-            // Insert starting node to nearest_neighbors
-            possible_nearest_neighbors.insert(node_image);
+            // Insert starting node to the nearest neighbors
+            offer(index, min_dist);
 
             // Execute t greedy steps
             for (int t = 0; t < GREEDY_STEPS; t++)
             {
-                int exp = 0;      // Number of expansions so far
+                // The first {no_expansions} LSH edges are expanded, then every augmented edge that follows the LSH ones
+                const vector<int> &neighbors = graph[index];
+                int no_lsh_expanded = min(lsh_degree[index], no_expansions);
+                int no_neighbors = no_lsh_expanded + (int)neighbors.size() - lsh_degree[index];
+                auto neighbor_at = [&](int j)
+                { return neighbors[j < no_lsh_expanded ? j : j - no_lsh_expanded + lsh_degree[index]]; };
                 int curr_nn = -1; // Symbolizes the index of the expanded node with min distance to the query
+                STATS_ADD(context.stats, EXPANSIONS, no_neighbors);
+
+                // Start fetching the first neighbors while the rest of the loop is set up
+                for (int j = 0; j < min(prefetch_distance, no_neighbors); j++)
+                    PrefetchImageData(images[neighbor_at(j)].GetImageData());
 
                 // Execute no_expansions expansions
-                for (int neighbor_index : graph[index])
+                for (int j = 0; j < no_neighbors; j++)
                 {
-                    MNIST_Image neighbor_image = images[neighbor_index];
-                    double dist = EuclideanDistance(2, query_image.GetImageData(), neighbor_image.GetImageData());
-                    neighbor_image.SetDist(dist);
+                    // Fetch the neighbor {prefetch_distance} positions ahead while computing the current distance
+                    if (prefetch_distance > 0 && j + prefetch_distance < no_neighbors)
+                        PrefetchImageData(images[neighbor_at(j + prefetch_distance)].GetImageData());
 
-                    possible_nearest_neighbors.insert(neighbor_image);
+                    int neighbor_index = neighbor_at(j);
+                    double dist = distance(neighbor_index);
+
+                    offer(neighbor_index, dist);
 
                     // Mark the next graph node to be expanded
                     if (dist < min_dist)
@@ -106,12 +430,6 @@ public:
                         min_dist = dist;
                         curr_nn = neighbor_index;
                     }
-
-                    exp++;
-                    if (no_expansions == exp)
-                    {
-                        break;
-                    }
                 }
 
                 // In case we reached a local minimum.
@@ -122,27 +440,24 @@ public:
 
                 // Else, we use the current nearest neighbor to the query as the next node to expand
                 index = curr_nn;
-                node_image = images[curr_nn];
-                double dist = EuclideanDistance(2, query_image.GetImageData(), node_image.GetImageData());
-                node_image.SetDist(dist);
+                STATS_ADD(context.stats, HOPS, 1);
             }
         }
 
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
-
-        int nn_num = 0;
-        for (MNIST_Image nn : possible_nearest_neighbors)
+        if (pq != nullptr)
         {
-            if (nn_num == no_nearest_neighbours)
-            {
-                break;
-            }
-
-            nearest_neighbors.insert(nn);
-            nn_num++;
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            pq->ScoreCandidates(context);
+            pq->Rerank(query_data, context, images);
         }
+    }
+
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_nearest_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_nearest_neighbours, context);
 
-        return nearest_neighbors;
+        return context.GetNearestSet(images);
     }
 
     void PrintGraph()
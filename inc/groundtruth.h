@@ -0,0 +1,398 @@
+#ifndef GROUNDTRUTH_H
+#define GROUNDTRUTH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "hash.h"
+#include "mnist.h"
+#include "misc.h"
+#include "stream.h"
+#include "vptree.h"
+
+#define GROUNDTRUTH_MAGIC 0x48545247 // "GRTH" in little endian, written at the start of a ground truth file.
+#define GROUNDTRUTH_BATCH 16         // Number of queries scanned together against each block of the dataset.
+#define GROUNDTRUTH_BLOCK 128        // Number of dataset images per block, small enough to stay in the cache.
+
+using namespace std;
+
+// Add the 8 bytes of a value to a 64-bit FNV-1a hash.
+inline void FingerprintWord(uint64_t &hash, uint64_t value)
+{
+    for (int byte = 0; byte < 8; byte++)
+    {
+        hash ^= (value >> (8 * byte)) & 0xFF;
+        hash *= 1099511628211ULL;
+    }
+}
+
+// Add the bit pattern of a coordinate to the hash, so that every value counts and not only its integer part.
+inline void FingerprintCoordinate(uint64_t &hash, double coordinate)
+{
+    uint64_t bits;
+    memcpy(&bits, &coordinate, sizeof(bits));
+    FingerprintWord(hash, bits);
+}
+
+// Compute a 64-bit FNV-1a fingerprint of the images of a dataset, used to match ground truth files to their inputs.
+uint64_t Fingerprint(MNIST &dataset)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const vector<MNIST_Image> &images = dataset.GetImages();
+
+    FingerprintWord(hash, images.size());
+    for (const MNIST_Image &image : images)
+        for (double coordinate : image.GetImageData())
+            FingerprintCoordinate(hash, coordinate);
+
+    return hash;
+}
+
+// Compute the same fingerprint as above while streaming the dataset from its file.
+uint64_t Fingerprint(MNIST_Stream &dataset)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    FingerprintWord(hash, dataset.GetSize());
+    dataset.ForEachBlock([&](size_t first, const vector<IMAGE_DATA> &images)
+                         {
+        for (const IMAGE_DATA &image : images)
+            for (double coordinate : image)
+                FingerprintCoordinate(hash, coordinate); });
+
+    return hash;
+}
+
+// GroundTruth holds the exact {k} nearest neighbors of every query of a query file.
+// Files store one ivecs row (k, ids) followed by one fvecs row (k, distances) per query, after a header with the fingerprints.
+class GroundTruth
+{
+private:
+    uint64_t dataset_fingerprint;         // Fingerprint of the dataset the neighbors belong to.
+    uint64_t query_fingerprint;           // Fingerprint of the queries.
+    int k;                                // Number of neighbors stored per query.
+    vector<vector<int32_t>> neighbor_ids; // The indices of the exact nearest neighbors, nearest first.
+    vector<vector<float>> distances;      // The distances of the exact nearest neighbors.
+
+    // Scan the whole dataset for the batch of queries [first, last), one cache-sized block of images at a time.
+    void ComputeBatch(vector<MNIST_Image> &images, vector<MNIST_Image> &queries, size_t first, size_t last)
+    {
+        vector<priority_queue<pair<double, int32_t>>> nearest(last - first); // Furthest first
+
+        for (size_t block = 0; block < images.size(); block += GROUNDTRUTH_BLOCK)
+        {
+            size_t block_end = min(images.size(), block + GROUNDTRUTH_BLOCK);
+
+            for (size_t q = first; q < last; q++)
+            {
+                priority_queue<pair<double, int32_t>> &heap = nearest[q - first];
+                const IMAGE_DATA &query_data = queries[q].GetImageData();
+
+                for (size_t i = block; i < block_end; i++)
+                {
+                    double dist = EuclideanDistance(2, query_data, images[i].GetImageData(), DIMENSIONS);
+                    if ((int)heap.size() < k)
+                        heap.push(make_pair(dist, (int32_t)images[i].GetIndex()));
+                    else if (dist < heap.top().first)
+                    {
+                        heap.pop();
+                        heap.push(make_pair(dist, (int32_t)images[i].GetIndex()));
+                    }
+                }
+            }
+        }
+
+        for (size_t q = first; q < last; q++)
+            StoreNearest(q, nearest[q - first]);
+    }
+
+    // Store the content of a query's heap of nearest neighbors, nearest first.
+    void StoreNearest(size_t q, priority_queue<pair<double, int32_t>> &heap)
+    {
+        neighbor_ids[q].resize(heap.size());
+        distances[q].resize(heap.size());
+
+        for (int i = (int)heap.size() - 1; i >= 0; i--)
+        {
+            neighbor_ids[q][i] = heap.top().second;
+            distances[q][i] = (float)heap.top().first;
+            heap.pop();
+        }
+    }
+
+public:
+    // Create an empty instance of GroundTruth.
+    GroundTruth() : dataset_fingerprint(0), query_fingerprint(0), k(0) {}
+
+    // Compute the exact {_k} nearest neighbors of every query, splitting the batches of queries across {no_threads} threads.
+    void Compute(MNIST &input, MNIST &query, int _k, int no_threads)
+    {
+        k = _k;
+        dataset_fingerprint = Fingerprint(input);
+        query_fingerprint = Fingerprint(query);
+
+        vector<MNIST_Image> images = input.GetImages();
+        vector<MNIST_Image> queries = query.GetImages();
+        neighbor_ids = vector<vector<int32_t>>(queries.size());
+        distances = vector<vector<float>>(queries.size());
+
+        atomic<size_t> next_batch(0);
+        size_t no_batches = (queries.size() + GROUNDTRUTH_BATCH - 1) / GROUNDTRUTH_BATCH;
+
+        auto worker = [&](bool report_progress)
+        {
+            for (size_t batch = next_batch++; batch < no_batches; batch = next_batch++)
+            {
+                size_t first = batch * GROUNDTRUTH_BATCH;
+                ComputeBatch(images, queries, first, min(queries.size(), first + GROUNDTRUTH_BATCH));
+
+                if (report_progress)
+                    printProgress((double)batch / (double)no_batches);
+            }
+        };
+
+        printProgress(0.0);
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker, false));
+        worker(true);
+        for (thread &t : threads)
+            t.join();
+
+        printProgress(1.0);
+        cout << endl;
+    }
+
+    // Compute the exact {_k} nearest neighbors of every query while streaming the dataset from its file, with bounded memory.
+    // Every block of the dataset is scanned by all the queries, split across {no_threads} threads, before the next one is read.
+    void ComputeStreaming(MNIST_Stream &input, MNIST &query, int _k, int no_threads)
+    {
+        k = _k;
+        dataset_fingerprint = Fingerprint(input);
+        query_fingerprint = Fingerprint(query);
+
+        vector<MNIST_Image> queries = query.GetImages();
+        neighbor_ids = vector<vector<int32_t>>(queries.size());
+        distances = vector<vector<float>>(queries.size());
+        vector<priority_queue<pair<double, int32_t>>> nearest(queries.size()); // Furthest first
+
+        printProgress(0.0);
+
+        input.ForEachBlock([&](size_t first_image, const vector<IMAGE_DATA> &images)
+                           {
+            atomic<size_t> next_query(0);
+            auto worker = [&]()
+            {
+                for (size_t q = next_query++; q < queries.size(); q = next_query++)
+                {
+                    priority_queue<pair<double, int32_t>> &heap = nearest[q];
+                    const IMAGE_DATA &query_data = queries[q].GetImageData();
+
+                    for (size_t i = 0; i < images.size(); i++)
+                    {
+                        double dist = EuclideanDistance(2, query_data, images[i], DIMENSIONS);
+                        if ((int)heap.size() < k)
+                            heap.push(make_pair(dist, (int32_t)(first_image + i)));
+                        else if (dist < heap.top().first)
+                        {
+                            heap.pop();
+                            heap.push(make_pair(dist, (int32_t)(first_image + i)));
+                        }
+                    }
+                }
+            };
+
+            vector<thread> threads;
+            for (int t = 1; t < no_threads; t++)
+                threads.push_back(thread(worker));
+            worker();
+            for (thread &t : threads)
+                t.join();
+
+            printProgress((double)(first_image + images.size()) / (double)input.GetSize()); });
+
+        for (size_t q = 0; q < queries.size(); q++)
+            StoreNearest(q, nearest[q]);
+
+        printProgress(1.0);
+        cout << endl;
+    }
+
+    // Compute the exact {_k} nearest neighbors of every query with a VP-tree over the dataset, which prunes most of the distances.
+    // The queries are split across {no_threads} threads, the tree is shared since its searches do not modify it.
+    void ComputeVPTree(MNIST &input, MNIST &query, int _k, int no_threads)
+    {
+        k = _k;
+        dataset_fingerprint = Fingerprint(input);
+        query_fingerprint = Fingerprint(query);
+
+        VPTree tree = VPTree(input);
+        vector<MNIST_Image> queries = query.GetImages();
+        neighbor_ids = vector<vector<int32_t>>(queries.size());
+        distances = vector<vector<float>>(queries.size());
+
+        atomic<size_t> next_query(0);
+        atomic<size_t> no_evaluations(0);
+        auto worker = [&](bool report_progress)
+        {
+            size_t evaluations = 0;
+            for (size_t q = next_query++; q < queries.size(); q = next_query++)
+            {
+                vector<pair<double, uint>> nearest = tree.Search(queries[q].GetImageData(), k, evaluations);
+
+                neighbor_ids[q].resize(nearest.size());
+                distances[q].resize(nearest.size());
+                for (size_t i = 0; i < nearest.size(); i++)
+                {
+                    neighbor_ids[q][i] = (int32_t)nearest[i].second;
+                    distances[q][i] = (float)nearest[i].first;
+                }
+
+                if (report_progress)
+                    printProgress((double)q / (double)queries.size());
+            }
+            no_evaluations += evaluations;
+        };
+
+        printProgress(0.0);
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker, false));
+        worker(true);
+        for (thread &t : threads)
+            t.join();
+
+        printProgress(1.0);
+        cout << endl;
+        cout << "[i] VP-tree evaluated " << (double)no_evaluations / max(queries.size(), (size_t)1) / max(tree.GetSize(), (size_t)1) * 100.0
+             << "% of the distances of Brute Force" << endl;
+    }
+
+    // Save the ground truth in a binary file.
+    void Save(const string &file_path)
+    {
+        ofstream file(file_path, ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        uint32_t magic = GROUNDTRUTH_MAGIC;
+        uint32_t no_queries = neighbor_ids.size();
+        file.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+        file.write(reinterpret_cast<const char *>(&dataset_fingerprint), sizeof(dataset_fingerprint));
+        file.write(reinterpret_cast<const char *>(&query_fingerprint), sizeof(query_fingerprint));
+        file.write(reinterpret_cast<const char *>(&no_queries), sizeof(no_queries));
+
+        for (size_t q = 0; q < neighbor_ids.size(); q++)
+        {
+            int32_t row_size = neighbor_ids[q].size();
+            file.write(reinterpret_cast<const char *>(&row_size), sizeof(row_size));
+            file.write(reinterpret_cast<const char *>(neighbor_ids[q].data()), row_size * sizeof(int32_t));
+            file.write(reinterpret_cast<const char *>(&row_size), sizeof(row_size));
+            file.write(reinterpret_cast<const char *>(distances[q].data()), row_size * sizeof(float));
+        }
+
+        if (!file)
+        {
+            throw runtime_error("Failed to write the file: " + file_path + "\n");
+        }
+    }
+
+    // Load a ground truth file and make sure that it was computed for the given dataset and queries.
+    // Every row is checked to hold at most one neighbor per image and only indexes of images, so a corrupt file cannot index past them.
+    void Load(const string &file_path, MNIST &input, MNIST &query)
+    {
+        ifstream file(file_path, ios::binary);
+        if (!file.is_open())
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        uint32_t magic = 0, no_queries = 0;
+        file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        file.read(reinterpret_cast<char *>(&dataset_fingerprint), sizeof(dataset_fingerprint));
+        file.read(reinterpret_cast<char *>(&query_fingerprint), sizeof(query_fingerprint));
+        file.read(reinterpret_cast<char *>(&no_queries), sizeof(no_queries));
+
+        if (!file || magic != GROUNDTRUTH_MAGIC)
+        {
+            throw runtime_error("Not a ground truth file: " + file_path + "\n");
+        }
+        if (dataset_fingerprint != Fingerprint(input) || query_fingerprint != Fingerprint(query))
+        {
+            throw runtime_error("The ground truth was computed for a different dataset or query file: " + file_path + "\n");
+        }
+        if (no_queries != query.GetImagesCount())
+        {
+            throw runtime_error("Corrupt ground truth file, it holds " + to_string(no_queries) + " queries instead of " + to_string(query.GetImagesCount()) + ": " + file_path + "\n");
+        }
+
+        int32_t no_images = input.GetImagesCount();
+        neighbor_ids = vector<vector<int32_t>>(no_queries);
+        distances = vector<vector<float>>(no_queries);
+        k = 0;
+
+        for (size_t q = 0; q < no_queries; q++)
+        {
+            int32_t row_size = 0, distances_size = 0;
+            file.read(reinterpret_cast<char *>(&row_size), sizeof(row_size));
+            if (!file || row_size < 0 || row_size > no_images)
+            {
+                throw runtime_error("Corrupt ground truth file, bad row size of query " + to_string(q) + ": " + file_path + "\n");
+            }
+            neighbor_ids[q].resize(row_size);
+            file.read(reinterpret_cast<char *>(neighbor_ids[q].data()), row_size * sizeof(int32_t));
+            for (int32_t id : neighbor_ids[q])
+            {
+                if (id < 0 || id >= no_images)
+                {
+                    throw runtime_error("Corrupt ground truth file, bad neighbor " + to_string(id) + " of query " + to_string(q) + ": " + file_path + "\n");
+                }
+            }
+            file.read(reinterpret_cast<char *>(&distances_size), sizeof(distances_size));
+            if (!file || distances_size != row_size)
+            {
+                throw runtime_error("Corrupt ground truth file, bad row size of query " + to_string(q) + ": " + file_path + "\n");
+            }
+            distances[q].resize(row_size);
+            file.read(reinterpret_cast<char *>(distances[q].data()), row_size * sizeof(float));
+            k = max(k, (int)row_size);
+        }
+
+        if (!file)
+        {
+            throw runtime_error("Failed to read the file: " + file_path + "\n");
+        }
+    }
+
+    // Get the number of neighbors stored per query.
+    int GetK() { return k; }
+
+    // Get the {no_neighbours} exact nearest neighbors of the query with the given index, in the same form as BRUTE returns them.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, uint query_index, vector<MNIST_Image> &images)
+    {
+        if (query_index >= neighbor_ids.size() || no_neighbours > k)
+        {
+            throw runtime_error("The ground truth does not contain enough neighbors for the query.\n");
+        }
+
+        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
+        for (int i = 0; i < no_neighbours && i < (int)neighbor_ids[query_index].size(); i++)
+            InsertNearestNeighbor(nearest_neighbors, no_neighbours, images[neighbor_ids[query_index][i]], distances[query_index][i]);
+
+        return nearest_neighbors;
+    }
+};
+
+#endif // GROUNDTRUTH_H
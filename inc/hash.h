@@ -4,27 +4,42 @@
 #include <cmath>
 #include <array>
 #include <cstdint>
-#include <ctime>
 #include <random>
 
 #include "mnist.h"
 
 using namespace std;
 
+// The random streams of an index, every one is drawn from its own generator.
+enum RandomStream
+{
+    PROJECTIONS_STREAM,
+    SHIFTS_STREAM,
+    MULTIPLIERS_STREAM
+};
+
+// Create the generator of one random stream of an index from the seed of the index.
+// seed_seq scrambles the seed together with the stream, so the streams are unrelated even though they share the seed.
+mt19937 StreamGenerator(unsigned int seed, RandomStream stream)
+{
+    seed_seq sequence{seed, (unsigned int)stream};
+    return mt19937(sequence);
+}
+
 // Generate the random projection vectors.
-vector<vector<IMAGE_DATA>> GetRandomProjections(int no_hash_tables, int no_hash_functions)
+vector<vector<IMAGE_DATA>> GetRandomProjections(int no_hash_tables, int no_hash_functions, unsigned int seed)
 {
     vector<vector<IMAGE_DATA>> random_projections(no_hash_tables);
 
-    default_random_engine generator(static_cast<unsigned>(time(nullptr))); // code for generating random numbers using normal distribution
-    normal_distribution<double> distribution(0.0, 1.0);                    // the numbers range from -1 to +1
+    mt19937 generator = StreamGenerator(seed, PROJECTIONS_STREAM); // code for generating random numbers using normal distribution
+    normal_distribution<double> distribution(0.0, 1.0);            // the numbers range from -1 to +1
 
     for (int i = 0; i < no_hash_tables; i++)
     { // For each hash table, get an array of random projections to use
         random_projections[i] = vector<IMAGE_DATA>(no_hash_functions);
         for (int j = 0; j < no_hash_functions; j++)
         { // Get a different random vector/projection for each hash function
-            for (int k = 0; k < 784; k++)
+            for (int k = 0; k < DIMENSIONS; k++)
             {
                 random_projections[i][j][k] = distribution(generator) + 1; // + 1 is for normalization purposes, having negative values would mess up the final hash code
             }
@@ -34,39 +49,66 @@ vector<vector<IMAGE_DATA>> GetRandomProjections(int no_hash_tables, int no_hash_
     return random_projections;
 }
 
+// Generate the random shift t of every h(p) function, uniform in [0, window).
+// Like the projections, they belong to the index: a query must be hashed with the same shifts as the dataset.
+vector<vector<double>> GetRandomShifts(int no_hash_tables, int no_hash_functions, int window, unsigned int seed)
+{
+    vector<vector<double>> random_shifts(no_hash_tables, vector<double>(no_hash_functions));
+
+    mt19937 generator = StreamGenerator(seed, SHIFTS_STREAM);
+    uniform_real_distribution<double> distribution(0.0, window);
+
+    for (int i = 0; i < no_hash_tables; i++)
+        for (int j = 0; j < no_hash_functions; j++)
+            random_shifts[i][j] = distribution(generator);
+
+    return random_shifts;
+}
+
+// Generate the random multipliers r_i combining the h(p) functions of every hash table into g(p).
+vector<vector<int>> GetRandomMultipliers(int no_hash_tables, int no_hash_functions, unsigned int seed)
+{
+    vector<vector<int>> random_multipliers(no_hash_tables, vector<int>(no_hash_functions));
+
+    mt19937 generator = StreamGenerator(seed, MULTIPLIERS_STREAM);
+    uniform_int_distribution<int> distribution(-40, 40);
+
+    for (int i = 0; i < no_hash_tables; i++)
+        for (int j = 0; j < no_hash_functions; j++)
+            random_multipliers[i][j] = distribution(generator);
+
+    return random_multipliers;
+}
+
 // This is the hash code for each different h(p) function, as shown in theory
 // It's a separate function from CalculateFinalHashCode, as it is needed by it's own for Hypercube
-uint CalculateHashCode(IMAGE_DATA image, IMAGE_DATA random_projection, int window)
+// Only the first {no_dimensions} coordinates hold data, the rest of the image is zero and adds nothing to the inner product.
+uint CalculateHashCode(const IMAGE_DATA &image, const IMAGE_DATA &random_projection, int window, double shift, size_t no_dimensions = DIMENSIONS)
 {
     // Calculate inner product between image and random projection, aka p [dot product] v
     double sum = 0;
-    for (int i = 0; i < 784; i++)
+    for (size_t i = 0; i < no_dimensions; i++)
     {
         sum += (double)image[i] * random_projection[i];
     }
 
-    srand(time(0));
-    sum += rand() % (uint)window; // rand() % (uint) window === t  (theory)
+    sum += shift; // t (theory)
 
     double hash_code = sum / (uint)window; // Divide by w
 
-    return (uint)floor(hash_code);
+    return (uint)(int64_t)floor(hash_code); // Negative inner products (e.g. of reduced vectors) wrap around
 }
 
 // This is the final hash code barring the (% TableSize) operation at the end, so that optimization of LSH can be possible (see theory)
-uint CalculateFinalHashCode(IMAGE_DATA image, vector<IMAGE_DATA> random_projections, int no_hash_functions, int window)
+uint CalculateFinalHashCode(const IMAGE_DATA &image, const vector<IMAGE_DATA> &random_projections, const vector<double> &random_shifts,
+                            const vector<int> &random_multipliers, int no_hash_functions, int window, size_t no_dimensions = DIMENSIONS)
 {
     uint sum = 0;
 
-    random_device rd;
-    mt19937 gen(rd());
-
-    uniform_int_distribution<int> random_ri(-40, 40);
-
     for (int k = 0; k < no_hash_functions; k++)
     { // For each hashing function
-        uint hash_code = CalculateHashCode(image, random_projections[k], window);
-        int ri = random_ri(gen);
+        uint hash_code = CalculateHashCode(image, random_projections[k], window, random_shifts[k], no_dimensions);
+        int ri = random_multipliers[k];
 
         sum += (ri * hash_code) % 4294967291; // Recall (ab) mod m = ((a mod m)(b mod m)) mod m
     }
@@ -76,11 +118,54 @@ uint CalculateFinalHashCode(IMAGE_DATA image, vector<IMAGE_DATA> random_projecti
     return final_hash_code;
 }
 
+// The squared L2 distance of the first {no_dimensions} coordinates of two vectors of any element type.
+// The additions go to 4 independent accumulators by coordinate (i % 4), so they do not wait on each other,
+// and every other distance of the repo that needs the exact same value (e.g. VPTree's) sums in that order.
+template <typename T>
+inline double SquaredDistance(const T *a, const T *b, size_t no_dimensions)
+{
+    double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+
+    size_t i = 0;
+    for (; i + 4 <= no_dimensions; i += 4)
+    {
+        for (size_t l = 0; l < 4; l++)
+        {
+            double diff = (double)a[i + l] - (double)b[i + l];
+            lanes[l] += diff * diff;
+        }
+    }
+    for (size_t l = 0; l < no_dimensions % 4; l++)
+    {
+        double diff = (double)a[i + l] - (double)b[i + l];
+        lanes[l] += diff * diff;
+    }
+
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// The squared L2 distance of two vectors of the compile-time dimension {D}, the constant trip count lets the compiler unroll the kernel.
+template <size_t D, typename T>
+inline double SquaredDistance(const T *a, const T *b)
+{
+    return SquaredDistance(a, b, D);
+}
+
 // This function calculates the distance between 2 images depending on p, aka the metric specified (as asked)
-double EuclideanDistance(int p, IMAGE_DATA data_point_a, IMAGE_DATA data_point_b)
+// Only the first {no_dimensions} coordinates are compared.
+double EuclideanDistance(int p, const IMAGE_DATA &data_point_a, const IMAGE_DATA &data_point_b, size_t no_dimensions)
 {
+    // The L2 metric is by far the most common, so avoid the generic pow() calls for it
+    if (p == 2)
+    {
+        if (no_dimensions == DIMENSIONS)
+            return sqrt(SquaredDistance<DIMENSIONS>(data_point_a.data(), data_point_b.data()));
+
+        return sqrt(SquaredDistance(data_point_a.data(), data_point_b.data(), no_dimensions));
+    }
+
     double sum = 0.0;
-    for (size_t i = 0; i < 784; i++)
+    for (size_t i = 0; i < no_dimensions; i++)
     {
         double diff = data_point_a[i] - data_point_b[i];
         sum += pow(abs(diff), p);
@@ -89,4 +174,10 @@ double EuclideanDistance(int p, IMAGE_DATA data_point_a, IMAGE_DATA data_point_b
     return pow(sum, 1.0 / p);
 }
 
+// The distance of 2 images over all of their coordinates.
+double EuclideanDistance(int p, const IMAGE_DATA &data_point_a, const IMAGE_DATA &data_point_b)
+{
+    return EuclideanDistance(p, data_point_a, data_point_b, DIMENSIONS);
+}
+
 #endif // HASH_H
\ No newline at end of file
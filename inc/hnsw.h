@@ -0,0 +1,456 @@
+#ifndef HNSW_H
+#define HNSW_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "context.h"
+#include "hash.h"
+#include "mnist.h"
+#include "misc.h"
+
+#define HNSW_MAGIC 0x57534E48 // "HNSW" in little endian, written at the start of a saved index.
+#define HNSW_MAX_LEVEL 64     // No drawn level comes close, -log of the smallest double times 1/ln(2) is below 54.
+
+using namespace std;
+
+// A candidate of the HNSW search, the distance to the query and the index of the node.
+typedef Neighbor HNSW_Candidate;
+
+// HNSW contains the functionality of the Hierarchical Navigable Small World graph algorithm.
+class HNSW
+{
+private:
+    int max_connections;               // Max number of neighbors of a node in the upper layers, M (default: 16).
+    int max_connections_base;          // Max number of neighbors of a node in the base layer, 2M.
+    int ef_construction;               // Size of the dynamic candidate list while building (default: 200).
+    int ef_search;                     // Size of the dynamic candidate list while searching (default: 50).
+    int no_threads;                    // Number of threads used to build the graph.
+    double level_multiplier;           // Normalization factor of the random levels, 1 / ln(M).
+    unsigned int seed;                 // Seed of the random levels.
+    vector<MNIST_Image> images;        // The MNIST dataset's images converted to d-vectors.
+    size_t no_dimensions;              // The number of leading coordinates of the images that hold data.
+    vector<int> levels;                // The top layer of every node.
+    vector<vector<vector<int>>> links; // The neighbors of every node on each of its layers.
+    int entry_point;                   // The node the searches start from, it lives on the top layer.
+    int max_level;                     // The top layer of the graph.
+
+    // Get the neighbors of a node. While the graph is being built concurrently, the node is locked
+    // and its neighbors are copied to {copy}, which is returned instead.
+    const vector<int> &GetNeighbors(int node, int layer, vector<mutex> *node_locks, vector<int> &copy)
+    {
+        if (node_locks == nullptr)
+            return links[node][layer];
+
+        lock_guard<mutex> lock((*node_locks)[node]);
+        copy = links[node][layer];
+        return copy;
+    }
+
+    // Greedily move towards the query on the given layer, the same as a search with ef = 1.
+    HNSW_Candidate GreedyClosest(const IMAGE_DATA &query, HNSW_Candidate current, int layer, vector<mutex> *node_locks, QueryContext &context)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (int neighbor : GetNeighbors(current.second, layer, node_locks, context.links))
+            {
+                double dist = EuclideanDistance(2, query, images[neighbor].GetImageData(), no_dimensions);
+                if (dist < current.first)
+                {
+                    current = HNSW_Candidate(dist, neighbor);
+                    changed = true;
+                }
+            }
+        }
+
+        return current;
+    }
+
+    // Find the {ef} nearest nodes to the query on the given layer, starting from the entry points in the context's pool.
+    // The result replaces the entry points, sorted by increasing distance.
+    void SearchLayer(const IMAGE_DATA &query, int ef, int layer, QueryContext &context, vector<mutex> *node_locks)
+    {
+        vector<HNSW_Candidate> &candidates = context.frontier; // A heap, closest first
+        vector<HNSW_Candidate> &nearest = context.pool;        // A heap, furthest first
+
+        context.ResetVisited(images.size());
+        candidates.assign(nearest.begin(), nearest.end());
+        for (const HNSW_Candidate &entry : nearest)
+            context.Visit(entry.second);
+        make_heap(candidates.begin(), candidates.end(), greater<HNSW_Candidate>());
+        make_heap(nearest.begin(), nearest.end());
+
+        while (!candidates.empty())
+        {
+            pop_heap(candidates.begin(), candidates.end(), greater<HNSW_Candidate>());
+            HNSW_Candidate current = candidates.back();
+            candidates.pop_back();
+
+            // Every remaining candidate is further than the furthest of the nearest ones
+            if (current.first > nearest.front().first)
+                break;
+
+            const vector<int> &neighbors = GetNeighbors(current.second, layer, node_locks, context.links);
+            for (size_t j = 0; j < neighbors.size(); j++)
+            {
+                if (j + PREFETCH_DISTANCE < neighbors.size())
+                    PrefetchImageData(images[neighbors[j + PREFETCH_DISTANCE]].GetImageData());
+
+                int neighbor = neighbors[j];
+                if (context.Visit(neighbor))
+                    continue;
+
+                double dist = EuclideanDistance(2, query, images[neighbor].GetImageData(), no_dimensions);
+                if ((int)nearest.size() < ef || dist < nearest.front().first)
+                {
+                    candidates.push_back(HNSW_Candidate(dist, neighbor));
+                    push_heap(candidates.begin(), candidates.end(), greater<HNSW_Candidate>());
+                    nearest.push_back(HNSW_Candidate(dist, neighbor));
+                    push_heap(nearest.begin(), nearest.end());
+
+                    if ((int)nearest.size() > ef)
+                    {
+                        pop_heap(nearest.begin(), nearest.end());
+                        nearest.pop_back();
+                    }
+                }
+            }
+        }
+
+        sort_heap(nearest.begin(), nearest.end());
+    }
+
+    // Select up to {no_neighbors} of the sorted candidates with the heuristic of the HNSW paper:
+    // a candidate is kept only if it is closer to the base node than to every already selected neighbor,
+    // which keeps edges pointing in diverse directions.
+    vector<HNSW_Candidate> SelectNeighbors(const vector<HNSW_Candidate> &candidates, int no_neighbors)
+    {
+        vector<HNSW_Candidate> selected;
+
+        for (const HNSW_Candidate &candidate : candidates)
+        {
+            if ((int)selected.size() == no_neighbors)
+                break;
+
+            bool diverse = true;
+            for (const HNSW_Candidate &neighbor : selected)
+            {
+                double dist = EuclideanDistance(2, images[candidate.second].GetImageData(), images[neighbor.second].GetImageData(), no_dimensions);
+                if (dist < candidate.first)
+                {
+                    diverse = false;
+                    break;
+                }
+            }
+
+            if (diverse)
+                selected.push_back(candidate);
+        }
+
+        return selected;
+    }
+
+    // Insert the node to the graph, the node's layers must already be allocated.
+    void InsertNode(int node, int &top_entry_point, int &top_level, mutex &entry_lock, QueryContext &context, vector<mutex> &node_locks)
+    {
+        const IMAGE_DATA &query = images[node].GetImageData();
+        int level = levels[node];
+
+        // A node that raises the top layer holds the entry lock during its insertion
+        unique_lock<mutex> entry_guard(entry_lock);
+        int current_entry = top_entry_point;
+        int current_level = top_level;
+        if (level <= current_level)
+            entry_guard.unlock();
+
+        HNSW_Candidate current(EuclideanDistance(2, query, images[current_entry].GetImageData(), no_dimensions), current_entry);
+        for (int layer = current_level; layer > level; layer--)
+            current = GreedyClosest(query, current, layer, &node_locks, context);
+
+        // The nearest nodes found on every layer are the entry points of the layer below
+        context.pool.assign(1, current);
+        for (int layer = min(level, current_level); layer >= 0; layer--)
+        {
+            int layer_max_connections = layer == 0 ? max_connections_base : max_connections;
+
+            SearchLayer(query, ef_construction, layer, context, &node_locks);
+            vector<HNSW_Candidate> neighbors = SelectNeighbors(context.pool, max_connections);
+
+            {
+                lock_guard<mutex> lock(node_locks[node]);
+                for (const HNSW_Candidate &neighbor : neighbors)
+                    links[node][layer].push_back(neighbor.second);
+            }
+
+            // Add the reverse edges, shrinking the neighbor lists that overflow
+            for (const HNSW_Candidate &neighbor : neighbors)
+            {
+                lock_guard<mutex> lock(node_locks[neighbor.second]);
+                vector<int> &neighbor_links = links[neighbor.second][layer];
+
+                if ((int)neighbor_links.size() < layer_max_connections)
+                {
+                    neighbor_links.push_back(node);
+                    continue;
+                }
+
+                const IMAGE_DATA &neighbor_data = images[neighbor.second].GetImageData();
+                vector<HNSW_Candidate> candidates(1, HNSW_Candidate(neighbor.first, node));
+                for (int link : neighbor_links)
+                    candidates.push_back(HNSW_Candidate(EuclideanDistance(2, neighbor_data, images[link].GetImageData(), no_dimensions), link));
+                sort(candidates.begin(), candidates.end());
+
+                vector<HNSW_Candidate> kept = SelectNeighbors(candidates, layer_max_connections);
+                neighbor_links.clear();
+                for (const HNSW_Candidate &link : kept)
+                    neighbor_links.push_back(link.second);
+            }
+        }
+
+        if (level > current_level)
+        {
+            top_entry_point = node;
+            top_level = level;
+        }
+    }
+
+public:
+    // Create a new instance of HNSW, the same seed draws the same levels.
+    HNSW(MNIST _input, int _max_connections, int _ef_construction, int _ef_search, int _no_threads, unsigned int _seed = random_device()())
+    {
+        max_connections = max(_max_connections, 2);
+        max_connections_base = 2 * max_connections;
+        ef_construction = max(_ef_construction, max_connections);
+        ef_search = _ef_search;
+        no_threads = max(_no_threads, 1);
+        level_multiplier = 1.0 / log((double)max_connections);
+        seed = _seed;
+        images = _input.GetImages();
+        no_dimensions = _input.GetDimensionsCount();
+        entry_point = 0;
+        max_level = 0;
+    }
+
+    // Build the graph inserting the images from {no_threads} threads.
+    void Initialization()
+    {
+        cout << "[i] Initializing HNSW construction" << endl;
+
+        // Draw every node's level up front, so that the layers can be allocated before the threads start
+        mt19937 gen(seed);
+        uniform_real_distribution<double> distribution(0.0, 1.0);
+
+        levels = vector<int>(images.size());
+        links = vector<vector<vector<int>>>(images.size());
+        for (int i = 0; i < (int)images.size(); i++)
+        {
+            levels[i] = (int)floor(-log(1.0 - distribution(gen)) * level_multiplier);
+            links[i] = vector<vector<int>>(levels[i] + 1);
+        }
+
+        if (images.empty())
+            return;
+
+        entry_point = 0;
+        max_level = levels[0];
+
+        mutex entry_lock;
+        vector<mutex> node_locks(images.size());
+        atomic<int> next_node(1);
+
+        auto worker = [&](bool report_progress)
+        {
+            QueryContext context;
+
+            for (int node = next_node++; node < (int)images.size(); node = next_node++)
+            {
+                InsertNode(node, entry_point, max_level, entry_lock, context, node_locks);
+
+                if (report_progress && node % 100 == 0)
+                    printProgress((double)node / (double)images.size());
+            }
+        };
+
+        printProgress(0.0);
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker, false));
+        worker(true);
+        for (thread &t : threads)
+            t.join();
+
+        printProgress(1.0);
+        cout << endl
+             << "[i] Finished HNSW construction (" << max_level + 1 << " layers)" << endl;
+    }
+
+    // Find the {no_nearest_neighbours} nearest nodes of the query, into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query, int no_nearest_neighbours, QueryContext &context)
+    {
+        context.Reset(no_nearest_neighbours, images.size());
+        if (images.empty())
+            return;
+
+        HNSW_Candidate current(EuclideanDistance(2, query, images[entry_point].GetImageData(), no_dimensions), entry_point);
+        for (int layer = max_level; layer > 0; layer--)
+            current = GreedyClosest(query, current, layer, nullptr, context);
+
+        context.pool.push_back(current);
+        SearchLayer(query, max(ef_search, no_nearest_neighbours), 0, context, nullptr);
+
+        for (const HNSW_Candidate &candidate : context.pool)
+            context.Offer(candidate.first, candidate.second);
+    }
+
+    // Find the {no_nearest_neighbours} "Nearest Neighbors" of the queried image.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_nearest_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_nearest_neighbours, context);
+
+        return context.GetNearestSet(images);
+    }
+
+    // Get the bytes that the graph holds besides the images: the levels and the links of every layer.
+    size_t GetMemoryBytes() const { return HeapBytes(levels) + HeapBytes(links); }
+
+    // Set the size of the dynamic candidate list used by the searches.
+    void SetEfSearch(int _ef_search)
+    {
+        ef_search = _ef_search;
+    }
+
+    // Save the layered graph in a binary file.
+    void Save(const string &file_path)
+    {
+        ofstream file(file_path, ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        uint32_t header[] = {HNSW_MAGIC, (uint32_t)images.size(), (uint32_t)max_connections, (uint32_t)ef_construction, (uint32_t)entry_point, (uint32_t)max_level};
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+        for (int i = 0; i < (int)images.size(); i++)
+        {
+            uint32_t level = levels[i];
+            file.write(reinterpret_cast<const char *>(&level), sizeof(level));
+
+            for (const vector<int> &layer_links : links[i])
+            {
+                uint32_t no_links = layer_links.size();
+                file.write(reinterpret_cast<const char *>(&no_links), sizeof(no_links));
+                file.write(reinterpret_cast<const char *>(layer_links.data()), no_links * sizeof(int));
+            }
+        }
+
+        if (!file)
+        {
+            throw runtime_error("Failed to write the file: " + file_path + "\n");
+        }
+    }
+
+    // Load a layered graph, previously saved for the same dataset, instead of building it.
+    void Load(const string &file_path)
+    {
+        ifstream file(file_path, ios::binary);
+        if (!file.is_open())
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        uint32_t header[6];
+        file.read(reinterpret_cast<char *>(header), sizeof(header));
+        if (!file || header[0] != HNSW_MAGIC)
+        {
+            throw runtime_error("Not an HNSW index file: " + file_path + "\n");
+        }
+        if (header[1] != images.size())
+        {
+            throw runtime_error("The HNSW index was built for a dataset of a different size: " + file_path + "\n");
+        }
+
+        // Every count and index is checked before it sizes or indexes anything, so a corrupt file fails here instead of in the searches.
+        if (header[2] < 2 || header[2] > (uint32_t)INT32_MAX / 2 || header[5] > HNSW_MAX_LEVEL ||
+            (!images.empty() && header[4] >= images.size()))
+        {
+            throw runtime_error("Corrupt HNSW index header: " + file_path + "\n");
+        }
+
+        max_connections = header[2];
+        max_connections_base = 2 * max_connections;
+        ef_construction = header[3];
+        entry_point = header[4];
+        max_level = header[5];
+        level_multiplier = 1.0 / log((double)max_connections);
+
+        levels = vector<int>(images.size());
+        links = vector<vector<vector<int>>>(images.size());
+        for (int i = 0; i < (int)images.size(); i++)
+        {
+            uint32_t level;
+            file.read(reinterpret_cast<char *>(&level), sizeof(level));
+            if (!file)
+            {
+                throw runtime_error("Failed to read the file: " + file_path + "\n");
+            }
+            if (level > (uint32_t)max_level)
+            {
+                throw runtime_error("Corrupt HNSW index, bad level of node " + to_string(i) + ": " + file_path + "\n");
+            }
+            levels[i] = level;
+            links[i] = vector<vector<int>>(level + 1);
+
+            for (int layer = 0; layer <= (int)level; layer++)
+            {
+                vector<int> &layer_links = links[i][layer];
+                uint32_t no_links;
+                file.read(reinterpret_cast<char *>(&no_links), sizeof(no_links));
+                if (!file)
+                {
+                    throw runtime_error("Failed to read the file: " + file_path + "\n");
+                }
+                if (no_links > (uint32_t)(layer == 0 ? max_connections_base : max_connections))
+                {
+                    throw runtime_error("Corrupt HNSW index, bad number of links of node " + to_string(i) + ": " + file_path + "\n");
+                }
+                layer_links.resize(no_links);
+                file.read(reinterpret_cast<char *>(layer_links.data()), no_links * sizeof(int));
+
+                for (int neighbor : layer_links)
+                {
+                    if (neighbor < 0 || neighbor >= (int)images.size())
+                    {
+                        throw runtime_error("Corrupt HNSW index, bad link of node " + to_string(i) + ": " + file_path + "\n");
+                    }
+                }
+            }
+        }
+
+        if (!file)
+        {
+            throw runtime_error("Failed to read the file: " + file_path + "\n");
+        }
+        if (!images.empty() && levels[entry_point] != max_level)
+        {
+            throw runtime_error("Corrupt HNSW index, the entry point is not on the top layer: " + file_path + "\n");
+        }
+
+        cout << "[i] Loaded HNSW index (" << max_level + 1 << " layers) from " << file_path << endl;
+    }
+};
+
+#endif // HNSW_H
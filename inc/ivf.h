@@ -0,0 +1,213 @@
+#ifndef IVF_H
+#define IVF_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "cluster.h"
+#include "context.h"
+#include "hash.h"
+#include "mnist.h"
+#include "misc.h"
+#include "pq.h"
+
+#define IVF_LISTS 128          // Default number of inverted lists, aka coarse centroids.
+#define IVF_PROBES 8           // Default number of nearest lists scanned per query.
+#define IVF_TRAIN_SAMPLE 10000 // Number of dataset vectors the coarse centroids are trained on.
+
+using namespace std;
+
+// IVF is an inverted file index: the dataset is partitioned by k-Means into {no_lists} lists, one per coarse centroid,
+// and a query only scans the {no_probes} lists whose centroids are the nearest to it.
+// Optionally the lists store PQ codes of the residuals (vector - centroid), which are scored with ADC and reranked exactly.
+class IVF
+{
+private:
+    int no_lists;                 // The number of inverted lists.
+    int no_probes;                // The number of lists scanned per query.
+    vector<MNIST_Image> images;   // The MNIST dataset's images converted to d-vectors.
+    size_t no_dimensions;         // The number of leading coordinates of the images that hold data.
+    vector<IMAGE_DATA> centroids; // The coarse centroid of every list.
+    vector<vector<uint>> lists;   // The indices of the images that belong to every list.
+    unique_ptr<PQ> pq;            // The PQ codec of the residuals, if any.
+
+    // Train the coarse centroids with Cluster's k-Means on a random sample of the dataset.
+    void TrainCentroids(int no_threads, unsigned int seed)
+    {
+        vector<MNIST_Image> sample = images;
+        mt19937 generator(seed);
+        shuffle(sample.begin(), sample.end(), generator);
+        sample.resize(min(sample.size(), (size_t)IVF_TRAIN_SAMPLE));
+
+        no_lists = min(no_lists, (int)sample.size());
+
+        cout << "[i] IVF training " << no_lists << " coarse centroids on " << sample.size() << " vectors." << endl;
+        Cluster cluster = Cluster(no_lists, 0, 0, 0, 0, 0, MNIST(sample, no_dimensions), "lloyd", no_threads, MINIBATCH_SIZE, MINIBATCH_HOLDOUT, seed);
+        centroids = cluster.GetClusterCenters();
+    }
+
+    // Assign every image to the list of its nearest centroid, splitting the images across {no_threads} threads.
+    void FillLists(int no_threads)
+    {
+        cout << "[i] IVF assigning the dataset to the lists." << endl;
+
+        vector<int> nearest_list(images.size());
+        atomic<size_t> next_image(0);
+        auto worker = [&]()
+        {
+            vector<Neighbor> nearest;
+            for (size_t i = next_image++; i < images.size(); i = next_image++)
+            {
+                NearestLists(images[i].GetImageData(), 1, nearest);
+                nearest_list[i] = nearest[0].second;
+            }
+        };
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker));
+        worker();
+        for (thread &t : threads)
+            t.join();
+
+        lists = vector<vector<uint>>(no_lists);
+        for (size_t i = 0; i < images.size(); i++)
+            lists[nearest_list[i]].push_back(images[i].GetIndex());
+    }
+
+    // Get the (distance, list) pairs of the {count} centroids nearest to the given vector into {nearest}, nearest first.
+    void NearestLists(const IMAGE_DATA &data, int count, vector<Neighbor> &nearest) const
+    {
+        nearest.resize(centroids.size());
+        for (int l = 0; l < (int)centroids.size(); l++)
+            nearest[l] = Neighbor(EuclideanDistance(2, data, centroids[l], no_dimensions), l);
+
+        count = min(count, (int)nearest.size());
+        partial_sort(nearest.begin(), nearest.begin() + count, nearest.end());
+        nearest.resize(count);
+    }
+
+public:
+    // Create a new instance of IVF, training {_no_lists} coarse centroids and filling the lists.
+    IVF(MNIST &input, int _no_lists, int _no_probes, int no_threads = 1, unsigned int seed = random_device()())
+    {
+        images = input.GetImages();
+        no_dimensions = input.GetDimensionsCount();
+        if (images.empty())
+        {
+            throw runtime_error("Cannot build an IVF index on an empty dataset.\n");
+        }
+
+        no_lists = max(_no_lists, 1);
+        no_threads = max(no_threads, 1);
+
+        TrainCentroids(no_threads, seed);
+        FillLists(no_threads);
+        SetProbes(_no_probes);
+    }
+
+    // Store PQ codes of the residuals with {no_subspaces} subspaces, the lists are then scored with ADC
+    // and only the {rerank} best scoring images get their exact distances computed.
+    void EnablePQ(int no_subspaces, int rerank = PQ_RERANK, int no_threads = 1, unsigned int seed = random_device()())
+    {
+        vector<MNIST_Image> residuals(images.size());
+        for (int l = 0; l < no_lists; l++)
+        {
+            for (uint index : lists[l])
+            {
+                IMAGE_DATA residual;
+                for (int d = 0; d < DIMENSIONS; d++)
+                    residual[d] = images[index].GetImageData()[d] - centroids[l][d];
+                residuals[index] = MNIST_Image(index, residual);
+            }
+        }
+
+        MNIST residual_dataset = MNIST(residuals, no_dimensions);
+        pq.reset(new PQ(residual_dataset, no_subspaces, rerank, no_threads, seed));
+    }
+
+    // Get the bytes that the index holds besides the images: the centroids, the lists and the PQ codes.
+    size_t GetMemoryBytes() const { return HeapBytes(centroids) + HeapBytes(lists) + (pq ? pq->GetMemoryBytes() : 0); }
+
+    // Set the number of lists scanned per query, it only affects the search.
+    void SetProbes(int _no_probes) { no_probes = min(max(_no_probes, 1), no_lists); }
+
+    // Get the number of inverted lists.
+    int GetListsCount() { return no_lists; }
+
+    // Find the {no_neighbours} nearest images of the query scanning the {no_probes} nearest lists, into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query_data, int no_neighbours, QueryContext &context)
+    {
+        context.Reset(no_neighbours, 0);
+        NearestLists(query_data, no_probes, context.frontier);
+
+        if (pq != nullptr)
+        {
+            // The residual of the query changes with every list, and so does its ADC table
+            IMAGE_DATA residual;
+            for (const Neighbor &list : context.frontier)
+            {
+                for (int d = 0; d < DIMENSIONS; d++)
+                    residual[d] = query_data[d] - centroids[list.second][d];
+                pq->ComputeDistanceTable(residual, context.table);
+
+                for (uint index : lists[list.second])
+                    context.scored.push_back(Neighbor(pq->AsymmetricDistance(context.table, index), index));
+            }
+
+            pq->Rerank(query_data, context, images);
+            return;
+        }
+
+        for (const Neighbor &list : context.frontier)
+        {
+            for (uint index : lists[list.second])
+                context.Offer(EuclideanDistance(2, query_data, images[index].GetImageData(), no_dimensions), index);
+        }
+    }
+
+    // Find the {no_neighbours} "Nearest Neighbors" vectors of the queried one scanning the {no_probes} nearest lists.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_neighbours, context);
+
+        return context.GetNearestSet(images);
+    }
+
+    // Find the images inside the given radius of the query scanning the {no_probes} nearest lists, into the context's nearest neighbors.
+    void RadiusSearch(const IMAGE_DATA &query_data, int radius, QueryContext &context)
+    {
+        context.Reset(0, 0);
+        NearestLists(query_data, no_probes, context.frontier);
+
+        for (const Neighbor &list : context.frontier)
+        {
+            for (uint index : lists[list.second])
+            {
+                double dist = EuclideanDistance(2, query_data, images[index].GetImageData(), no_dimensions);
+                if (dist < radius)
+                    context.Collect(dist, index);
+            }
+        }
+
+        context.FinishCollecting();
+    }
+
+    // Find the vectors inside the given radius of the queried one scanning the {no_probes} nearest lists.
+    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius)
+    {
+        QueryContext &context = ThreadQueryContext();
+        RadiusSearch(query_image.GetImageData(), radius, context);
+
+        return context.GetNearestSet(images);
+    }
+};
+
+#endif // IVF_H
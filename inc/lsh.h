@@ -6,18 +6,25 @@
 #include <fstream>
 #include <cmath>
 #include <vector>
+#include <deque>
+#include <set>
 #include <unordered_map>
 #include <string>
 #include <ctime>
 #include <random>
 
+#include "context.h"
 #include "hash.h"
 #include "mnist.h"
 #include "misc.h"
+#include "pq.h"
 
 using namespace std;
 
 #define WINDOW 400
+#define TOMBSTONE_RATIO 0.1 // Fraction of tombstoned bucket entries that triggers compaction.
+#define COMPACTION_STEP 8   // Number of buckets compacted per Insert/Erase while compaction is pending.
+#define BUCKET_LOAD 16      // Average number of images per bucket that the table size is chosen for, n/16 yields the best results for W = 400.
 
 // LSH contains the functionality of the Locality-Sensitive Hashing algorithm.
 class LSH
@@ -25,33 +32,142 @@ class LSH
 private:
     int no_hash_functions;                                        // The number of hash functions inside the "amplified" one.
     int no_hash_tables;                                           // The number of hash tables used for LSH.
+    size_t no_dimensions;                                         // The number of leading coordinates of the images that hold data.
     vector<MNIST_Image> images;                                   // The MNIST dataset's images converted to d-vectors.
-    vector<unordered_map<uint, vector<MNIST_Image>>> hash_tables; // The LSH Hash Tables.
+    vector<unordered_map<uint, vector<uint>>> hash_tables;        // The LSH Hash Tables, every bucket holds the indices of its images.
     vector<vector<IMAGE_DATA>> random_projections;                // These are the random vectors that are used to calculate each h(p) for each hash table.
+    vector<vector<double>> random_shifts;                         // The random shift t of each h(p) for each hash table.
+    vector<vector<int>> random_multipliers;                       // The random r_i combining the h(p) of each hash table into g(p).
+    uint table_size;                                              // The number of buckets of each hash table, doubled once the images outgrow it.
+    vector<vector<uint>> image_codes;                             // The g(p) of every image for each hash table, its bucket is g(p) % table_size.
+    vector<bool> erased;                                          // Tombstones of the erased images, indexed by the image index.
+    vector<int> pending_entries;                                  // The bucket entries of every erased image that the compaction has not removed yet.
+    vector<uint> free_slots;                                      // The indices of the erased images without entries left, reused by Insert.
+    int no_live_images;                                           // The number of images that have not been erased.
+    int no_tombstones;                                            // The number of bucket entries that belong to erased images.
+    deque<pair<int, uint>> dirty_buckets;                         // The (hash table, bucket) pairs that still contain tombstoned entries.
+    bool compacting;                                              // Whether an incremental compaction is currently in progress.
+    const PQ *pq;                                                 // The PQ codec scoring the candidates, if any.
+
+    // Hash the image at the given position of {images} into every hash table.
+    void HashImage(int j)
+    {
+        if ((int)image_codes.size() <= j)
+            image_codes.resize(j + 1, vector<uint>(no_hash_tables));
+
+        for (int i = 0; i < no_hash_tables; i++)
+        {
+            // hash_code_for_querying_trick can be used as an optimization to LSH, haven't implemented it yet
+            uint hash_code_for_querying_trick = CalculateFinalHashCode(images[j].GetImageData(), random_projections[i], random_shifts[i], random_multipliers[i], no_hash_functions, WINDOW, no_dimensions);
+            uint final_hash_code = hash_code_for_querying_trick % table_size;
 
-    void Initialization()
+            hash_tables[i][final_hash_code].push_back(j);
+            image_codes[j][i] = hash_code_for_querying_trick;
+        }
+    }
+
+    // Count a bucket entry of an erased image as removed, its index can be reused once it has none left.
+    void RemoveEntry(uint index)
     {
-        cout << "[i] LSH started hashing the dataset." << endl;
+        no_tombstones--;
+        if (--pending_entries[index] == 0)
+            free_slots.push_back(index);
+    }
 
-        // For each hash table, create {number_of_hashing_functions} random projections
-        random_projections = GetRandomProjections(no_hash_tables, no_hash_functions);
+    // Remove the tombstoned entries of a single bucket.
+    void CompactBucket(int table, uint code)
+    {
+        unordered_map<uint, vector<uint>>::iterator bucket = hash_tables[table].find(code);
+        if (bucket == hash_tables[table].end())
+            return;
 
-        for (int i = 0; i < no_hash_tables; i++)
-        { // For each hash table
+        vector<uint> &bucket_images = bucket->second;
+        size_t kept = 0;
+        for (size_t j = 0; j < bucket_images.size(); j++)
+        {
+            if (erased[bucket_images[j]])
+            {
+                RemoveEntry(bucket_images[j]);
+                continue;
+            }
 
-            for (int j = 0; j < (int)images.size(); j++)
-            { // For each image in input set
+            if (kept != j)
+                bucket_images[kept] = bucket_images[j];
+            kept++;
+        }
+        bucket_images.resize(kept);
 
-                // hash_code_for_querying_trick can be used as an optimization to LSH, haven't implemented it yet
-                uint hash_code_for_querying_trick = CalculateFinalHashCode(images[j].GetImageData(), random_projections[i], no_hash_functions, WINDOW);
-                // images[j].SetId(hash_code_for_querying_trick);
+        if (bucket_images.empty())
+            hash_tables[table].erase(bucket);
+    }
 
-                uint final_hash_code = hash_code_for_querying_trick % ((uint)(images.size() / 16)); // Mod by n/16 to get final_hash_code, found it yields the best results for W = 400
+    // Compact a bounded number of dirty buckets, so that the cost of a single update stays constant.
+    // Compaction starts once the tombstones exceed {TOMBSTONE_RATIO} of the entries and runs until no dirty bucket is left.
+    void CompactionStep()
+    {
+        if (!compacting && no_tombstones > TOMBSTONE_RATIO * no_live_images * no_hash_tables)
+            compacting = true;
 
-                hash_tables[i][final_hash_code].push_back(images[j]);
+        for (int step = 0; compacting && step < COMPACTION_STEP; step++)
+        {
+            if (dirty_buckets.empty())
+            {
+                compacting = false;
+                break;
             }
 
-            printProgress(static_cast<double>(i) / no_hash_tables);
+            pair<int, uint> bucket = dirty_buckets.front();
+            dirty_buckets.pop_front();
+            CompactBucket(bucket.first, bucket.second);
+        }
+    }
+
+    // Rebuild the hash tables with {table_size} buckets from the stored codes, dropping every tombstone on the way.
+    // No hash function is evaluated again, so this costs O(n * L) and doubling the size keeps it amortized O(L) per Insert.
+    void Rehash()
+    {
+        for (int i = 0; i < no_hash_tables; i++)
+            hash_tables[i].clear();
+
+        for (uint j = 0; j < images.size(); j++)
+        {
+            if (erased[j])
+            {
+                if (pending_entries[j] > 0)
+                {
+                    pending_entries[j] = 0;
+                    free_slots.push_back(j);
+                }
+                continue;
+            }
+
+            for (int i = 0; i < no_hash_tables; i++)
+                hash_tables[i][image_codes[j][i] % table_size].push_back(j);
+        }
+
+        no_tombstones = 0;
+        dirty_buckets.clear();
+        compacting = false;
+    }
+
+    void Initialization(unsigned int seed)
+    {
+        cout << "[i] LSH started hashing the dataset." << endl;
+
+        // For each hash table, create {number_of_hashing_functions} random projections
+        random_projections = GetRandomProjections(no_hash_tables, no_hash_functions, seed);
+        random_shifts = GetRandomShifts(no_hash_tables, no_hash_functions, WINDOW, seed);
+        random_multipliers = GetRandomMultipliers(no_hash_tables, no_hash_functions, seed);
+
+        // Mod by n/16 to get final_hash_code, found it yields the best results for W = 400
+        table_size = max((uint)(images.size() / BUCKET_LOAD), (uint)1);
+
+        for (int j = 0; j < (int)images.size(); j++)
+        { // For each image in input set
+            HashImage(j);
+
+            if (j % 1000 == 0)
+                printProgress(static_cast<double>(j) / images.size());
         }
 
         printProgress(1);
@@ -62,100 +178,241 @@ private:
 
 public:
     // Constructors
-    LSH() {}
+    LSH() : no_dimensions(DIMENSIONS), pq(nullptr) {}
 
-    // Create a new instance of LSH.
-    LSH(MNIST _input, int _no_hash_functions, int _no_hash_tables)
+    // Create a new instance of LSH, the same seed draws the same hash functions.
+    LSH(MNIST _input, int _no_hash_functions, int _no_hash_tables, unsigned int seed = random_device()())
     {
         no_hash_functions = _no_hash_functions;
         no_hash_tables = _no_hash_tables;
         images = _input.GetImages();
-        hash_tables = vector<unordered_map<uint, vector<MNIST_Image>>>(_no_hash_tables);
+        no_dimensions = _input.GetDimensionsCount();
+        hash_tables = vector<unordered_map<uint, vector<uint>>>(_no_hash_tables);
+        erased = vector<bool>(images.size(), false);
+        pending_entries = vector<int>(images.size(), 0);
+        no_live_images = images.size();
+        no_tombstones = 0;
+        compacting = false;
+        pq = nullptr;
+
+        Initialization(seed);
+    }
+
+    // Insert a new image to the index and return the index assigned to it.
+    // The index of an erased image is reused once the compaction has removed all of its entries,
+    // so the memory follows the number of live images instead of the number of inserts.
+    uint Insert(IMAGE_DATA data)
+    {
+        // The codec only holds the codes of the images it was trained with, a new image would be scored past them
+        if (pq != nullptr)
+        {
+            throw runtime_error("Cannot insert to an LSH index that scores its candidates with PQ.\n");
+        }
+
+        // Double the buckets once the images outgrow them, the stored codes place the images again without hashing them
+        if (no_live_images + 1 > 2 * BUCKET_LOAD * (int)table_size)
+        {
+            table_size *= 2;
+            Rehash();
+        }
+
+        uint index;
+        if (!free_slots.empty())
+        {
+            index = free_slots.back();
+            free_slots.pop_back();
+            images[index] = MNIST_Image(index, data);
+            erased[index] = false;
+        }
+        else
+        {
+            index = images.size();
+            images.push_back(MNIST_Image(index, data));
+            erased.push_back(false);
+            pending_entries.push_back(0);
+        }
+        no_live_images++;
+        HashImage(index);
 
-        Initialization();
+        CompactionStep();
+
+        return index;
     }
 
-    // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Locality-Sensitive Hashing algorithm.
-    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
+    // Erase the image with the given index from the index.
+    // The bucket entries are only tombstoned here and they are removed later by the compaction.
+    bool Erase(uint index)
     {
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors; // Used for sorting the final vector of ANN
-        double min_dist = pow(2, 32) - 5;
+        if (index >= images.size() || erased[index])
+            return false;
+
+        erased[index] = true;
+        no_live_images--;
+        pending_entries[index] = no_hash_tables;
+
         for (int i = 0; i < no_hash_tables; i++)
-        { // For each hash table
+        {
+            no_tombstones++;
+            dirty_buckets.push_back(make_pair(i, image_codes[index][i] % table_size));
+        }
 
-            // Find query_image's hash code for given table, same way as for the input set
-            uint hash_code_for_querying_trick = CalculateFinalHashCode(query_image.GetImageData(), random_projections[i], no_hash_functions, WINDOW);
-            // query_image.SetId(hash_code_for_querying_trick);
-            uint final_hash_code = hash_code_for_querying_trick % ((uint)(images.size() / 16));
+        CompactionStep();
 
-            // If the query_image ends up in an empty bucket for this hash table
-            if (hash_tables[i][final_hash_code].size() == 0)
-                continue;
+        return true;
+    }
+
+    // Remove every pending tombstone from the hash tables at once.
+    void Compact()
+    {
+        while (!dirty_buckets.empty())
+        {
+            pair<int, uint> bucket = dirty_buckets.front();
+            dirty_buckets.pop_front();
+            CompactBucket(bucket.first, bucket.second);
+        }
+
+        compacting = false;
+    }
+
+    // Get the number of images that are currently stored in the index.
+    int GetSize() { return no_live_images; }
+
+    // Get the number of bucket entries waiting to be compacted.
+    int GetTombstonesCount() { return no_tombstones; }
+
+    // Get the number of image slots, live or erased, that the index holds.
+    int GetSlotsCount() { return images.size(); }
+
+    // Get the number of buckets of each hash table.
+    uint GetTableSize() { return table_size; }
+
+    // Whether the image with the given index is stored in the index.
+    bool Contains(uint index) { return index < images.size() && !erased[index]; }
+
+    // Get the bytes that the index holds besides the images: the buckets, the hash functions and the g(p) of the images.
+    size_t GetMemoryBytes() const
+    {
+        return HeapBytes(hash_tables) + HeapBytes(random_projections) + HeapBytes(random_shifts) + HeapBytes(random_multipliers) +
+               HeapBytes(image_codes) + HeapBytes(erased) + HeapBytes(pending_entries) + HeapBytes(free_slots) + HeapBytes(dirty_buckets);
+    }
+
+    // Score the candidates with the given PQ codec, only its best scoring ones get their exact distances computed.
+    // The codec must have encoded the same dataset as the index, nullptr restores the exact scoring.
+    void SetPQ(const PQ *_pq)
+    {
+        if (_pq != nullptr && _pq->GetCodesCount() != images.size())
+        {
+            throw runtime_error("The PQ codec encoded " + to_string(_pq->GetCodesCount()) + " vectors, the LSH index holds " + to_string(images.size()) + ".\n");
+        }
+
+        pq = _pq;
+    }
+
+    // Find the {no_neighbours} "Nearest Neighbors" of the query using the Locality-Sensitive Hashing algorithm,
+    // into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query, int no_neighbours, QueryContext &context)
+    {
+        context.Reset(no_neighbours, images.size());
 
-            vector<MNIST_Image> bucket_images = hash_tables[i][final_hash_code];
+        for (int i = 0; i < no_hash_tables; i++)
+        { // For each hash table
 
-            // For each image found in the same bucket as query_image
-            // Calculate distance for each image in the same bucket as query_image (basically the whole point of LSH)
-            for (int j = 0; j < (int)bucket_images.size(); j++)
+            // Find the query's hash code for given table, same way as for the input set
+            uint final_hash_code;
             {
-                // if (query_image.GetId() != bucket_images[j].GetId())
-                //     continue;
+                STATS_TIMER(context.stats, HASHING_NS);
+                uint hash_code_for_querying_trick = CalculateFinalHashCode(query, random_projections[i], random_shifts[i], random_multipliers[i], no_hash_functions, WINDOW, no_dimensions);
+                final_hash_code = hash_code_for_querying_trick % table_size;
+            }
 
-                double dist = EuclideanDistance(2, query_image.GetImageData(), bucket_images[j].GetImageData());
-                bucket_images[j].SetDist(dist);
+            // If the query ends up in an empty bucket for this hash table
+            STATS_ADD(context.stats, BUCKETS_PROBED, 1);
+            unordered_map<uint, vector<uint>>::const_iterator bucket = hash_tables[i].find(final_hash_code);
+            if (bucket == hash_tables[i].end())
+                continue;
 
-                // If found a better ANN than the current worst ANN
-                // Remove worst ANN
-                // Insert new ANN, set sorts itself
-                if (dist < min_dist)
-                {
-                    if ((int)nearest_neighbors.size() == no_neighbours)
-                        nearest_neighbors.erase(--nearest_neighbors.end());
+            // For each image found in the same bucket as the query, that has not been erased and was not found in a previous table
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            for (uint index : bucket->second)
+            {
+                if (erased[index])
+                    continue;
 
-                    nearest_neighbors.insert(bucket_images[j]);
-                    set<MNIST_Image, MNIST_ImageComparator>::reverse_iterator itr = nearest_neighbors.rbegin(); // Could be replaced by nearest_neighbors.end(), didn't work for some reason
-                    MNIST_Image last_image = *itr;
-                    min_dist = last_image.GetDist();
+                if (context.Visit(index))
+                {
+                    STATS_ADD(context.stats, DUPLICATES, 1);
+                    continue;
                 }
+
+                // With PQ the candidates are only collected here, and scored all together afterwards
+                if (pq != nullptr)
+                    context.candidates.push_back(index);
+                else
+                    context.Offer(EuclideanDistance(2, query, images[index].GetImageData(), no_dimensions), index);
+                STATS_ADD(context.stats, CANDIDATES, 1);
             }
         }
 
-        return nearest_neighbors;
+        if (pq != nullptr)
+        {
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            pq->ComputeDistanceTable(query, context.table);
+            pq->ScoreCandidates(context);
+            pq->Rerank(query, context, images);
+        }
     }
 
-    // Find the vectors inside the given radius of the queried one using Locality-Sensitive Hashing algorithm.
-    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius)
+    // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Locality-Sensitive Hashing algorithm.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image)
     {
-        set<MNIST_Image, MNIST_ImageComparator> vectors_inside_radius; // Used for sorting the final vector of ANN
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_neighbours, context);
+
+        return context.GetNearestSet(images);
+    }
+
+    // Find the images inside the given radius of the query using Locality-Sensitive Hashing algorithm,
+    // into the context's nearest neighbors.
+    void RadiusSearch(const IMAGE_DATA &query, int radius, QueryContext &context)
+    {
+        context.Reset(0, images.size());
 
         for (int i = 0; i < no_hash_tables; i++)
         {
             // Find the queried image's hash code for the corresponding hash table.
-            uint hash_code_for_querying_trick = CalculateFinalHashCode(query_image.GetImageData(), random_projections[i], no_hash_functions, WINDOW);
-            uint final_hash_code = hash_code_for_querying_trick % ((uint)(images.size() / 16));
+            uint hash_code_for_querying_trick = CalculateFinalHashCode(query, random_projections[i], random_shifts[i], random_multipliers[i], no_hash_functions, WINDOW, no_dimensions);
+            uint final_hash_code = hash_code_for_querying_trick % table_size;
 
             // If the queried image ends up in an empty bucket for this hash table, then continue to the next hash table.
-            if (hash_tables[i][final_hash_code].size() == 0)
+            unordered_map<uint, vector<uint>>::const_iterator bucket = hash_tables[i].find(final_hash_code);
+            if (bucket == hash_tables[i].end())
                 continue;
 
             // Else, for each image found in the same bucket as queried one,
             // calculate the distance for each image in the same bucket as the queried one.
             // If the image is inside the radius,
-            // then insert it to the found vectors.
-            vector<MNIST_Image> bucket_images = hash_tables[i][final_hash_code];
-            for (int j = 0; j < (int)bucket_images.size(); j++)
+            // then collect it.
+            for (uint index : bucket->second)
             {
-                double dist = EuclideanDistance(2, query_image.GetImageData(), bucket_images[j].GetImageData());
-                bucket_images[j].SetDist(dist);
+                if (erased[index] || context.Visit(index))
+                    continue;
 
+                double dist = EuclideanDistance(2, query, images[index].GetImageData(), no_dimensions);
                 if (dist < radius)
-                {
-                    vectors_inside_radius.insert(bucket_images[j]); // It sorts itself! Output will be tidy!
-                }
+                    context.Collect(dist, index);
             }
         }
 
-        return vectors_inside_radius;
+        context.FinishCollecting();
+    }
+
+    // Find the vectors inside the given radius of the queried one using Locality-Sensitive Hashing algorithm.
+    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius)
+    {
+        QueryContext &context = ThreadQueryContext();
+        RadiusSearch(query_image.GetImageData(), radius, context);
+
+        return context.GetNearestSet(images); // It sorts itself! Output will be tidy!
     }
 };
 
@@ -1,6 +1,11 @@
 #ifndef MISC_H
 #define MISC_H
 #include <stdio.h>
+#include <climits>
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+#include <vector>
 
 #define PBSTR "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||"
 #define PBWIDTH 60
@@ -14,4 +19,44 @@ void printProgress(double percentage)
     fflush(stdout);
 }
 
+// Get the bytes that the elements of a vector hold on the heap, the indexes add them up to report their memory.
+template <typename T>
+size_t HeapBytes(const std::vector<T> &elements) { return elements.capacity() * sizeof(T); }
+
+inline size_t HeapBytes(const std::vector<bool> &elements) { return elements.capacity() / CHAR_BIT; }
+
+template <typename T>
+size_t HeapBytes(const std::deque<T> &elements) { return elements.size() * sizeof(T); }
+
+template <typename T>
+size_t HeapBytes(const std::vector<std::vector<T>> &elements)
+{
+    size_t bytes = elements.capacity() * sizeof(std::vector<T>);
+    for (const std::vector<T> &element : elements)
+        bytes += HeapBytes(element);
+
+    return bytes;
+}
+
+// The bucket array and one node per entry (the entry and the pointer to the next node), plus the vectors of the entries.
+template <typename Key, typename T>
+size_t HeapBytes(const std::unordered_map<Key, std::vector<T>> &table)
+{
+    size_t bytes = table.bucket_count() * sizeof(void *);
+    for (const std::pair<const Key, std::vector<T>> &entry : table)
+        bytes += sizeof(void *) + sizeof(entry) + HeapBytes(entry.second);
+
+    return bytes;
+}
+
+template <typename Key, typename T>
+size_t HeapBytes(const std::vector<std::unordered_map<Key, std::vector<T>>> &tables)
+{
+    size_t bytes = tables.capacity() * sizeof(std::unordered_map<Key, std::vector<T>>);
+    for (const std::unordered_map<Key, std::vector<T>> &table : tables)
+        bytes += HeapBytes(table);
+
+    return bytes;
+}
+
 #endif // MISC_H
\ No newline at end of file
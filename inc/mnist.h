@@ -5,16 +5,34 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <set>
 #include <fstream>
 #include <string>
 #include <cmath>
 
+#include "formats.h"
+
 using namespace std;
 
-#define DIMENSIONS 784 // 28 * 28
+// The number of coordinates of every vector, 28 * 28 for MNIST.
+// Other datasets need another build, e.g. `make DIMENSIONS=3072` for 32 * 32 * 3 images.
+#ifndef DIMENSIONS
+#define DIMENSIONS 784
+#endif
+
+#define PREFETCH_DISTANCE 4 // How many neighbors ahead the graph searches prefetch.
+#define PREFETCH_LINES 4    // How many cache lines of an image are prefetched, the hardware prefetcher streams the rest.
 
 typedef array<double, DIMENSIONS> IMAGE_DATA;
 
+// Prefetch the first cache lines of the pixel values of an image.
+inline void PrefetchImageData(const IMAGE_DATA &data)
+{
+    const char *bytes = reinterpret_cast<const char *>(data.data());
+    for (int line = 0; line < PREFETCH_LINES; line++)
+        __builtin_prefetch(bytes + line * 64);
+}
+
 // MNIST_Image represents an image inside a MNIST dataset.
 class MNIST_Image
 {
@@ -36,19 +54,19 @@ public:
     }
 
     // Get the index of the image inside the MNIST dataset.
-    uint GetIndex()
+    uint GetIndex() const
     {
         return indx_dataset;
     }
 
     // Get the array containing the pixel values of the image.
-    IMAGE_DATA GetImageData()
+    const IMAGE_DATA &GetImageData() const
     {
         return data;
     }
 
     // Get the distance.
-    double GetDist()
+    double GetDist() const
     {
         return distance;
     }
@@ -60,7 +78,7 @@ public:
     }
 
     // Get the id.
-    int GetId()
+    int GetId() const
     {
         return id;
     }
@@ -76,13 +94,16 @@ public:
     {
         stringstream result;
 
-        result << "++++++++++++++++++++++++++++++" << endl;
-        for (int32_t i = 27; i >= 0; i--)
+        // The vectors are drawn as the largest square image they fill
+        int32_t side = (int32_t)sqrt((double)DIMENSIONS);
+
+        result << string(side + 2, '+') << endl;
+        for (int32_t i = side - 1; i >= 0; i--)
         {
             result << "+";
-            for (int32_t j = 27; j >= 0; j--)
+            for (int32_t j = side - 1; j >= 0; j--)
             {
-                int pixelValue = data[i * 28 + j];
+                int pixelValue = data[i * side + j];
                 char displayChar = '#';
 
                 // Use ' ' for white and '#' for black based on the pixel value
@@ -97,7 +118,7 @@ public:
             result << endl;
         }
 
-        result << "++++++++++++++++++++++++++++++";
+        result << string(side + 2, '+');
 
         return result.str();
     };
@@ -114,113 +135,69 @@ struct MNIST_ImageComparator
 {
     bool operator()(const MNIST_Image &a, const MNIST_Image &b) const
     {
-        MNIST_Image first_image = a;
-        MNIST_Image second_image = b;
-        return first_image.GetDist() < second_image.GetDist();
+        return a.GetDist() < b.GetDist();
     }
 };
 
-// MNIST contains the required functionality for reading MNIST dataset files.
+// Insert the image with the given distance into a set that keeps only the {no_neighbours} nearest ones.
+// The image is copied only when it makes it into the set.
+inline void InsertNearestNeighbor(set<MNIST_Image, MNIST_ImageComparator> &nearest_neighbors, int no_neighbours, const MNIST_Image &image, double dist)
+{
+    if ((int)nearest_neighbors.size() == no_neighbours && dist >= nearest_neighbors.rbegin()->GetDist())
+        return;
+
+    MNIST_Image neighbor = image;
+    neighbor.SetDist(dist);
+    nearest_neighbors.insert(neighbor);
+
+    if ((int)nearest_neighbors.size() > no_neighbours)
+        nearest_neighbors.erase(--nearest_neighbors.end());
+}
+
+// MNIST contains the required functionality for reading the dataset files.
+// Despite its name it reads every vector file format of formats.h (idx3, fvecs, bvecs, ivecs, raw float32/uint8),
+// detected from the file itself, so every index and driver accepts them.
 class MNIST
 {
 private:
     string file_path;           // The MNIST file path.
-    uint32_t magic_number;      // The MNIST magic number.
+    uint32_t magic_number;      // The MNIST magic number, 0 for the formats that have none.
     uint32_t no_images;         // The total number of MNIST images.
     uint32_t no_rows;           // The number of rows that the images have.
     uint32_t no_columns;        // The number of columns that the images have.
+    VectorFormat format;        // The format of the file.
     vector<MNIST_Image> images; // Vector containing all the MNIST images.
 
-    // Function that extracts a unsigned integer value at the given offset.
-    uint32_t ExtractIntFromBytes(const vector<uint8_t> &bytes, size_t offset)
-    {
-        if (bytes.size() < offset + 4)
-        {
-            throw runtime_error("Vector does not contain enough bytes to convert to a 32-bit integer at the specified offset.");
-        }
-
-        uint32_t integerVal = 0;
-
-        // Extract 4 bytes and convert to a 32-bit integer in a reverse byte order
-        for (int i = 0; i < 4; i++)
-        {
-            integerVal |= static_cast<uint32_t>(bytes[offset + 3 - i]) << (i * 8);
-        }
-
-        return integerVal;
-    }
-
-    // Function that extracts the MNIST image data at the given offset.
-    IMAGE_DATA ExtractArrayFromBytes(const vector<uint8_t> &bytes, size_t offset)
-    {
-        if (bytes.size() < offset + 784)
-        {
-            throw runtime_error("Vector does not contain enough bytes to extract the specified size.");
-        }
-
-        IMAGE_DATA data;
-
-        for (size_t i = 0; i < 784; i++)
-        {
-            data[783 - i] = (double)bytes[offset + i];
-        }
-
-        return data;
-    }
-
-    // Function that read a MNIST file and populates the class instance.
-    vector<uint8_t> ReadFileAsBytes(const string &file_path)
-    {
-        vector<uint8_t> file_bytes;
-
-        // Open the file in binary mode
-        ifstream file(file_path, ios::binary);
-
-        // Check if the file is open
-        if (!file.is_open())
-        {
-            throw runtime_error("Failed to open the file: " + file_path + "\n");
-        }
-
-        // Read the file into a vector of bytes
-        file.seekg(0, ios::end); // Move to the end of the file to determine its size
-        size_t file_size = file.tellg();
-        file_bytes.resize(file_size);
-        file.seekg(0, ios::beg); // Move back to the beginning of the file
-        file.read(reinterpret_cast<char *>(file_bytes.data()), file_size);
-
-        // Check if the file was read successfully
-        if (!file)
-        {
-            throw runtime_error("Failed to read the file: " + file_path + "\n");
-        }
-
-        // Close the file
-        file.close();
-
-        return file_bytes;
-    }
-
 public:
-    // Create a new instance of MNIST.
+    // Create a new instance of MNIST, decoding the vectors straight from the mapped file.
     MNIST(const string _file_path)
     {
         file_path = _file_path;
-        vector<uint8_t> file_bytes = ReadFileAsBytes(file_path);
+        MappedFile file(file_path);
 
-        magic_number = ExtractIntFromBytes(file_bytes, 0);
-        no_images = ExtractIntFromBytes(file_bytes, 4);
-        no_rows = ExtractIntFromBytes(file_bytes, 8);
-        no_columns = ExtractIntFromBytes(file_bytes, 12);
+        VectorLayout layout = DetectLayout(file.GetData(), min(file.GetSize(), (size_t)FORMAT_PROBE), file.GetSize(), DIMENSIONS, file_path);
+        format = layout.format;
+        magic_number = format == IDX3_FORMAT ? IDX3_MAGIC : 0;
+        no_images = layout.count;
+        no_rows = layout.rows;
+        no_columns = layout.columns;
 
+        images.reserve(no_images);
+        IMAGE_DATA data;
         for (size_t i = 0; i < no_images; i++)
         {
-            images.push_back(MNIST_Image((uint)i, ExtractArrayFromBytes(file_bytes, 16 + i * 784)));
+            DecodeRecord(file.GetData() + layout.Offset(i), layout, data.data());
+            images.push_back(MNIST_Image((uint)i, data));
         }
     };
 
     // Create a new instance of MNIST.
-    MNIST(){};
+    MNIST() : magic_number(0), no_images(0), no_rows(0), no_columns(0), format(IDX3_FORMAT) {}
+
+    // Create a new in-memory instance of MNIST holding the given images, e.g. a sample of another dataset.
+    // Only the {_no_dimensions} leading coordinates of the images hold data, e.g. after a Projection, and the rest are zero.
+    MNIST(const vector<MNIST_Image> &_images, uint32_t _no_dimensions = DIMENSIONS)
+        : magic_number(0), no_images(_images.size()), no_rows(1), no_columns(_no_dimensions), format(FLOAT32_FORMAT), images(_images) {}
 
     // Get the MNIST file path.
     string GetFilePath() { return file_path; }
@@ -237,13 +214,21 @@ public:
     // Get the number of columns of the MNIST images.
     uint32_t GetColumnsCount() { return no_columns; }
 
-    // Get the MNIST's images.
-    vector<MNIST_Image> GetImages() { return images; }
+    // Get the number of leading coordinates of the images that hold data, the indexes compare only these.
+    // It is DIMENSIONS for the vectors of a file, and the number of components for reduced ones.
+    uint32_t GetDimensionsCount() { return no_rows * no_columns > 0 ? no_rows * no_columns : DIMENSIONS; }
+
+    // Get the format of the file.
+    VectorFormat GetFormat() { return format; }
+
+    // Get the MNIST's images, without copying them.
+    const vector<MNIST_Image> &GetImages() const { return images; }
 
     /* Print the MNINST metadata. */
     void PrintMetadata()
     {
         cout << "MNIST File:        " << GetFilePath() << endl;
+        cout << "Format:            " << FormatName(GetFormat()) << endl;
         cout << "Magic Number:      " << GetMagicNumber() << endl;
         cout << "Number of Images:  " << GetImagesCount() << endl;
         cout << "Number of Rows:    " << GetRowsCount() << endl;
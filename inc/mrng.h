@@ -3,9 +3,12 @@
 
 #include <deque>
 #include <vector>
-#include <list>
+#include <algorithm>
 #include <set>
+#include <stdexcept>
+#include <string>
 
+#include "context.h"
 #include "hash.h"
 #include "lsh.h"
 #include "mnist.h"
@@ -19,8 +22,11 @@ private:
     int no_candidates;
     MNIST input;
     vector<MNIST_Image> images; // The MNIST dataset's images converted to d-vectors.
+    size_t no_dimensions;       // The number of leading coordinates of the images that hold data.
     LSH lsh;                    // The LSH is going to be used to find the candinates.
-    list<int> *graph;           // Graph implementation using adjacency list.
+    vector<vector<int>> graph;  // Graph implementation using adjacency list.
+    int prefetch_distance;      // How many neighbors ahead the search prefetches (default: PREFETCH_DISTANCE).
+    const PQ *pq;               // The PQ codec that scores the nodes during the search, if any.
 
 public:
     // Create a new instance of LSH.
@@ -29,7 +35,31 @@ public:
         no_candidates = _no_candidates;
         input = _input;
         images = _input.GetImages();
-        graph = new list<int>[_input.GetImagesCount()];
+        no_dimensions = _input.GetDimensionsCount();
+        graph = vector<vector<int>>(_input.GetImagesCount());
+        prefetch_distance = PREFETCH_DISTANCE;
+        pq = nullptr;
+    }
+
+    // Set how many neighbors ahead the search prefetches, 0 disables prefetching.
+    void SetPrefetchDistance(int _prefetch_distance)
+    {
+        prefetch_distance = _prefetch_distance;
+    }
+
+    // Get the bytes that the index holds besides the images: the edges, and the LSH that found the candidates.
+    size_t GetMemoryBytes() const { return HeapBytes(graph) + lsh.GetMemoryBytes(); }
+
+    // Navigate the graph with the distances of the given PQ codec, and rerank the best scoring checked nodes exactly.
+    // The codec must have encoded the same dataset as the graph, nullptr restores the exact search.
+    void SetPQ(const PQ *_pq)
+    {
+        if (_pq != nullptr && _pq->GetCodesCount() != images.size())
+        {
+            throw runtime_error("The PQ codec encoded " + to_string(_pq->GetCodesCount()) + " vectors, the MRNG graph holds " + to_string(images.size()) + ".\n");
+        }
+
+        pq = _pq;
     }
 
     void Initialization()
@@ -64,9 +94,9 @@ public:
             {
                 for (auto t : Lp)
                 {
-                    auto pr = EuclideanDistance(2, p.GetImageData(), r.GetImageData());
-                    auto pt = EuclideanDistance(2, p.GetImageData(), t.GetImageData());
-                    auto tr = EuclideanDistance(2, r.GetImageData(), t.GetImageData());
+                    auto pr = EuclideanDistance(2, p.GetImageData(), r.GetImageData(), no_dimensions);
+                    auto pt = EuclideanDistance(2, p.GetImageData(), t.GetImageData(), no_dimensions);
+                    auto tr = EuclideanDistance(2, r.GetImageData(), t.GetImageData(), no_dimensions);
 
                     if (pr > pt && pr > tr)
                     {
@@ -95,63 +125,88 @@ public:
              << "[i] Finished MRNG Construction." << endl;
     }
 
-    // Find the nearest neighbour for the query_image
-    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_nearest_neighbours, MNIST_Image query_image)
+    // Find the {no_nearest_neighbours} nearest checked nodes of the query with a search from a random node,
+    // into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query_data, int no_nearest_neighbours, QueryContext &context)
     {
-        set<MNIST_Image, MNIST_ImageComparator> possible_nearest_neighbors; // Used for sorting the final vector of ANN
-        vector<MNIST_Image> unchecked_nodes;                                // Store unchecked nodes
+        context.Reset(no_nearest_neighbours, images.size());
+        vector<Neighbor> &unchecked_nodes = context.frontier; // Store unchecked nodes as (distance, index)
+
+        // With PQ every node is scored through the ADC table, and the checked ones are kept for the reranking
+        if (pq != nullptr)
+            pq->ComputeDistanceTable(query_data, context.table);
 
-        random_device rd;
-        mt19937 gen(rd());
+        auto distance = [&](int node)
+        {
+            STATS_ADD(context.stats, CANDIDATES, 1);
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            if (pq == nullptr)
+                return EuclideanDistance(2, query_data, images[node].GetImageData(), no_dimensions);
+
+            return pq->AsymmetricDistance(context.table, node);
+        };
 
         uniform_int_distribution<int> random_image_index(0, images.size() - 1);
 
         // Select a graph's node to start at random
-        int index = random_image_index(gen);
-        MNIST_Image node_image = images[index];
-        double dist = EuclideanDistance(2, query_image.GetImageData(), node_image.GetImageData());
-        node_image.SetDist(dist);
+        int index = random_image_index(context.generator);
+        double dist = distance(index);
 
-        unchecked_nodes.push_back(node_image);
+        unchecked_nodes.push_back(Neighbor(dist, index));
+        STATS_ADD(context.stats, RESTARTS, 1);
 
-        for (int i = 1; i < no_candidates; i++)
+        for (int i = 1; i < no_candidates && !unchecked_nodes.empty(); i++)
         {
             // Check the first unchecked node
-            MNIST_Image node_to_check = *unchecked_nodes.begin();
+            Neighbor node_to_check = unchecked_nodes.front();
             unchecked_nodes.erase(unchecked_nodes.begin());
-            possible_nearest_neighbors.insert(node_to_check);
-
-            for (int neighbor_index : graph[node_to_check.GetIndex()])
+            STATS_ADD(context.stats, HOPS, 1);
+#ifdef SEARCH_STATS
+            bool seen = context.Visit(node_to_check.second);
+#endif
+            STATS_ADD(context.stats, DUPLICATES, seen);
+            if (pq != nullptr)
+                context.candidates.push_back(node_to_check.second);
+            else
+                context.Offer(node_to_check.first, node_to_check.second);
+
+            const vector<int> &neighbors = graph[node_to_check.second];
+            int no_neighbors = neighbors.size();
+            STATS_ADD(context.stats, EXPANSIONS, no_neighbors);
+
+            // Start fetching the first neighbors while the rest of the loop is set up
+            for (int j = 0; j < min(prefetch_distance, no_neighbors); j++)
+                PrefetchImageData(images[neighbors[j]].GetImageData());
+
+            for (int j = 0; j < no_neighbors; j++)
             {
-                MNIST_Image neighbor_image = images[neighbor_index];
-                dist = EuclideanDistance(2, query_image.GetImageData(), neighbor_image.GetImageData());
-                neighbor_image.SetDist(dist);
+                // Fetch the neighbor {prefetch_distance} positions ahead while computing the current distance
+                if (prefetch_distance > 0 && j + prefetch_distance < no_neighbors)
+                    PrefetchImageData(images[neighbors[j + prefetch_distance]].GetImageData());
 
-                unchecked_nodes.push_back(neighbor_image);
+                dist = distance(neighbors[j]);
+                unchecked_nodes.push_back(Neighbor(dist, neighbors[j]));
             }
 
             // Sort unchecked nodes
-            sort(
-                unchecked_nodes.begin(),
-                unchecked_nodes.end(),
-                MNIST_ImageComparator());
+            sort(unchecked_nodes.begin(), unchecked_nodes.end());
         }
 
-        set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
-
-        int nn_num = 0;
-        for (MNIST_Image nn : possible_nearest_neighbors)
+        if (pq != nullptr)
         {
-            if (nn_num == no_nearest_neighbours)
-            {
-                break;
-            }
-
-            nearest_neighbors.insert(nn);
-            nn_num++;
+            STATS_TIMER(context.stats, DISTANCE_NS);
+            pq->ScoreCandidates(context);
+            pq->Rerank(query_data, context, images);
         }
+    }
+
+    // Find the nearest neighbour for the query_image
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_nearest_neighbours, MNIST_Image query_image)
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_nearest_neighbours, context);
 
-        return nearest_neighbors;
+        return context.GetNearestSet(images);
     }
 
     void PrintGraph()
@@ -0,0 +1,282 @@
+#ifndef PQ_H
+#define PQ_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "context.h"
+#include "hash.h"
+#include "misc.h"
+#include "mnist.h"
+
+#define PQ_SUBSPACES 16      // Default number of subspaces, every vector is encoded to that many bytes.
+#define PQ_CENTROIDS 256     // Number of centroids of every sub-codebook, so that a code fits in a byte.
+#define PQ_TRAIN_SAMPLE 5000 // Number of dataset vectors the sub-codebooks are trained on.
+#define PQ_ITERATIONS 20     // Max number of Lloyd iterations per sub-codebook.
+#define PQ_RERANK 100        // Default number of candidates reranked with their exact distances.
+
+using namespace std;
+
+// PQ is a Product Quantization codec: the vectors are split into {no_subspaces} contiguous subspaces,
+// and every sub-vector is replaced by the index of its nearest centroid in the sub-codebook of its subspace.
+// A query is scored against the codes with Asymmetric Distance Computation (ADC): the distances of the query's sub-vectors
+// to every centroid are computed once into a table, and the distance to a code is then a sum of {no_subspaces} table lookups.
+class PQ
+{
+private:
+    int no_subspaces;                 // The number of subspaces, aka the number of bytes per code.
+    int subspace_size;                // The number of dimensions of every subspace.
+    int no_centroids;                 // The number of centroids of every sub-codebook.
+    int rerank;                       // The number of best scoring candidates that are reranked with their exact distances.
+    vector<vector<double>> codebooks; // The centroids of every subspace, {no_centroids} x {subspace_size} per subspace.
+    vector<uint8_t> codes;            // The codes of the dataset vectors, {no_subspaces} bytes per vector.
+
+    // Get the squared distance of two sub-vectors.
+    double SubspaceDistance(const double *a, const double *b) const
+    {
+        double dist = 0.0;
+        for (int d = 0; d < subspace_size; d++)
+        {
+            double diff = a[d] - b[d];
+            dist += diff * diff;
+        }
+
+        return dist;
+    }
+
+    // Get the centroid of subspace {s} that is nearest to the sub-vector, and its squared distance.
+    int NearestCentroid(int s, const double *sub_data, double &min_dist) const
+    {
+        int nearest = 0;
+        min_dist = numeric_limits<double>::max();
+
+        for (int c = 0; c < no_centroids; c++)
+        {
+            double dist = SubspaceDistance(sub_data, &codebooks[s][c * subspace_size]);
+            if (dist < min_dist)
+            {
+                min_dist = dist;
+                nearest = c;
+            }
+        }
+
+        return nearest;
+    }
+
+    // Train the sub-codebook of subspace {s} with k-Means on the sub-vectors of the sample: k-Means++ seeding, then Lloyd's iterations.
+    // This is the same algorithm as Cluster, run in the {subspace_size} dimensions of the subspace instead of the whole vectors.
+    void TrainSubspace(int s, const vector<IMAGE_DATA> &sample, unsigned int seed)
+    {
+        mt19937 generator(seed);
+        vector<double> &codebook = codebooks[s];
+        codebook = vector<double>(no_centroids * subspace_size);
+
+        auto copy_centroid = [&](int c, size_t i)
+        {
+            copy(&sample[i][s * subspace_size], &sample[i][s * subspace_size] + subspace_size, &codebook[c * subspace_size]);
+        };
+
+        // k-Means++: every next centroid is picked with probability proportional to its squared distance to the nearest one
+        vector<double> nearest_dist(sample.size(), numeric_limits<double>::max());
+        copy_centroid(0, uniform_int_distribution<size_t>(0, sample.size() - 1)(generator));
+        for (int c = 1; c < no_centroids; c++)
+        {
+            for (size_t i = 0; i < sample.size(); i++)
+                nearest_dist[i] = min(nearest_dist[i], SubspaceDistance(&sample[i][s * subspace_size], &codebook[(c - 1) * subspace_size]));
+
+            // Constant subspaces (e.g. the always blank borders of the images) need a single centroid, the rest are duplicates of it
+            if (accumulate(nearest_dist.begin(), nearest_dist.end(), 0.0) == 0.0)
+            {
+                copy_centroid(c, 0);
+                continue;
+            }
+
+            discrete_distribution<size_t> next(nearest_dist.begin(), nearest_dist.end());
+            copy_centroid(c, next(generator));
+        }
+
+        // Lloyd's iterations until no sub-vector changes centroid
+        vector<int> assignments(sample.size(), -1);
+        for (int iteration = 0; iteration < PQ_ITERATIONS; iteration++)
+        {
+            vector<double> sums(no_centroids * subspace_size, 0.0);
+            vector<int> sizes(no_centroids, 0);
+            size_t changes = 0;
+
+            for (size_t i = 0; i < sample.size(); i++)
+            {
+                double dist;
+                const double *sub_data = &sample[i][s * subspace_size];
+                int nearest = NearestCentroid(s, sub_data, dist);
+
+                if (nearest != assignments[i])
+                {
+                    assignments[i] = nearest;
+                    changes++;
+                }
+
+                sizes[nearest]++;
+                for (int d = 0; d < subspace_size; d++)
+                    sums[nearest * subspace_size + d] += sub_data[d];
+            }
+
+            if (changes == 0)
+                break;
+
+            // Empty centroids keep their position
+            for (int c = 0; c < no_centroids; c++)
+            {
+                if (sizes[c] == 0)
+                    continue;
+                for (int d = 0; d < subspace_size; d++)
+                    codebook[c * subspace_size + d] = sums[c * subspace_size + d] / sizes[c];
+            }
+        }
+    }
+
+    // Train the sub-codebooks on a random sample of the dataset, the subspaces are split across {no_threads} threads.
+    void Train(const vector<MNIST_Image> &images, int no_threads, unsigned int seed)
+    {
+        vector<size_t> order(images.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        mt19937 generator(seed);
+        shuffle(order.begin(), order.end(), generator);
+
+        vector<IMAGE_DATA> sample(min(order.size(), (size_t)PQ_TRAIN_SAMPLE));
+        for (size_t i = 0; i < sample.size(); i++)
+            sample[i] = images[order[i]].GetImageData();
+
+        no_centroids = min((int)sample.size(), PQ_CENTROIDS);
+
+        cout << "[i] PQ training " << no_subspaces << " sub-codebooks of " << no_centroids << " centroids on " << sample.size() << " vectors." << endl;
+
+        atomic<int> next_subspace(0);
+        auto worker = [&]()
+        {
+            for (int s = next_subspace++; s < no_subspaces; s = next_subspace++)
+                TrainSubspace(s, sample, seed + s + 1);
+        };
+
+        vector<thread> threads;
+        for (int t = 1; t < no_threads; t++)
+            threads.push_back(thread(worker));
+        worker();
+        for (thread &t : threads)
+            t.join();
+    }
+
+public:
+    // Create an empty instance of PQ.
+    PQ() : no_subspaces(0), subspace_size(0), no_centroids(0), rerank(PQ_RERANK) {}
+
+    // Train a PQ codec with {_no_subspaces} subspaces on the dataset, and encode every dataset vector.
+    // The subspaces split the leading coordinates that hold data, all of them but for reduced vectors.
+    PQ(MNIST &input, int _no_subspaces, int _rerank = PQ_RERANK, int no_threads = 1, unsigned int seed = random_device()())
+    {
+        int no_dimensions = input.GetDimensionsCount();
+        if (_no_subspaces <= 0 || no_dimensions % _no_subspaces != 0)
+        {
+            throw runtime_error("The number of PQ subspaces must divide " + to_string(no_dimensions) + ".\n");
+        }
+
+        no_subspaces = _no_subspaces;
+        subspace_size = no_dimensions / no_subspaces;
+        no_centroids = 0;
+        rerank = max(_rerank, 1);
+        codebooks = vector<vector<double>>(no_subspaces);
+
+        vector<MNIST_Image> images = input.GetImages();
+        if (images.empty())
+        {
+            throw runtime_error("Cannot train PQ on an empty dataset.\n");
+        }
+
+        Train(images, max(no_threads, 1), seed);
+
+        cout << "[i] PQ encoding the dataset." << endl;
+        codes = vector<uint8_t>(images.size() * no_subspaces);
+        for (size_t i = 0; i < images.size(); i++)
+            Encode(images[i].GetImageData(), &codes[(size_t)images[i].GetIndex() * no_subspaces]);
+    }
+
+    // Get the number of subspaces, aka the number of bytes per code.
+    int GetCodeSize() const { return no_subspaces; }
+
+    // Get the bytes of the codebooks and of the codes.
+    size_t GetMemoryBytes() const { return HeapBytes(codebooks) + HeapBytes(codes); }
+
+    // Get the number of dataset vectors encoded.
+    size_t GetCodesCount() const { return no_subspaces > 0 ? codes.size() / no_subspaces : 0; }
+
+    // Encode a vector to {no_subspaces} bytes, the nearest centroid of every subspace.
+    void Encode(const IMAGE_DATA &data, uint8_t *code) const
+    {
+        double dist;
+        for (int s = 0; s < no_subspaces; s++)
+            code[s] = (uint8_t)NearestCentroid(s, &data[s * subspace_size], dist);
+    }
+
+    // Compute the ADC table of a query: the squared distance of each of its sub-vectors to every centroid of the subspace.
+    void ComputeDistanceTable(const IMAGE_DATA &query, vector<double> &table) const
+    {
+        table.resize(no_subspaces * no_centroids);
+
+        for (int s = 0; s < no_subspaces; s++)
+        {
+            const double *sub_query = &query[s * subspace_size];
+            for (int c = 0; c < no_centroids; c++)
+                table[s * no_centroids + c] = SubspaceDistance(sub_query, &codebooks[s][c * subspace_size]);
+        }
+    }
+
+    // Get the approximate distance of the query whose ADC table is given to the dataset vector with the given index.
+    double AsymmetricDistance(const vector<double> &table, uint index) const
+    {
+        const uint8_t *code = &codes[(size_t)index * no_subspaces];
+        const double *row = table.data();
+
+        double dist = 0.0;
+        for (int s = 0; s < no_subspaces; s++, row += no_centroids)
+            dist += row[code[s]];
+
+        return sqrt(dist);
+    }
+
+    // Score the context's candidates with its ADC table, appending them to its scored candidates.
+    // The candidate indices may contain duplicates, they are removed first.
+    void ScoreCandidates(QueryContext &context) const
+    {
+        sort(context.candidates.begin(), context.candidates.end());
+        context.candidates.erase(unique(context.candidates.begin(), context.candidates.end()), context.candidates.end());
+
+        for (uint index : context.candidates)
+            context.scored.push_back(Neighbor(AsymmetricDistance(context.table, index), index));
+    }
+
+    // Rerank the {rerank} best of the context's scored (approximate distance, index) candidates with their exact distances,
+    // offering them to the context's nearest neighbors.
+    void Rerank(const IMAGE_DATA &query, QueryContext &context, const vector<MNIST_Image> &images) const
+    {
+        vector<Neighbor> &scored = context.scored;
+        size_t no_reranked = min(scored.size(), (size_t)max(rerank, context.GetNeighboursCount()));
+        nth_element(scored.begin(), scored.begin() + no_reranked, scored.end());
+
+        for (size_t i = 0; i < no_reranked; i++)
+            context.Offer(EuclideanDistance(2, query, images[scored[i].second].GetImageData(), (size_t)no_subspaces * subspace_size), scored[i].second);
+    }
+
+    // Get the number of best scoring candidates that are reranked.
+    int GetRerank() const { return rerank; }
+};
+
+#endif // PQ_H
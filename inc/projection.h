@@ -0,0 +1,328 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "mnist.h"
+
+#define PROJECTION_COMPONENTS 64 // Default number of components the vectors are reduced to.
+#define PCA_TRAIN_SAMPLE 5000    // Number of dataset vectors the covariance matrix is estimated on.
+#define PCA_ITERATIONS 30        // Number of subspace iterations that converge to the principal components.
+#define JACOBI_SWEEPS 30         // Max number of sweeps of the Jacobi eigenvalue algorithm.
+
+using namespace std;
+
+// Projection reduces the vectors to their first {no_components} coordinates in a new basis, fitted once on the dataset.
+// PCA keeps the directions of largest variance (MNIST has long runs of always blank border pixels, and most of its variance
+// lives in less than 100 components), while sparse random projection (Li et al.) needs no fitting and preserves the distances in expectation.
+// The reduced vectors are stored at the front of IMAGE_DATA with zeros after them, so every index works on them unchanged,
+// and the reduced dataset reports the number of components as its dimensions, so the indexes only compare the coordinates that hold data.
+class Projection
+{
+private:
+    string method;                          // "pca" or "rp".
+    int no_components;                      // The number of components the vectors are reduced to.
+    IMAGE_DATA mean;                        // The mean of the dataset, subtracted before the PCA projection.
+    vector<IMAGE_DATA> components;          // PCA: the principal components, largest variance first.
+    vector<vector<pair<int, double>>> sparse_components; // RP: the non zero (coordinate, weight) pairs of every component.
+    double explained_variance;              // PCA: the fraction of the dataset's variance that the components keep.
+
+    // Orthonormalize the columns of the {DIMENSIONS} x {no_components} matrix with the modified Gram-Schmidt process.
+    void Orthonormalize(vector<IMAGE_DATA> &basis)
+    {
+        for (int c = 0; c < no_components; c++)
+        {
+            for (int p = 0; p < c; p++)
+            {
+                double dot = 0.0;
+                for (int d = 0; d < DIMENSIONS; d++)
+                    dot += basis[c][d] * basis[p][d];
+                for (int d = 0; d < DIMENSIONS; d++)
+                    basis[c][d] -= dot * basis[p][d];
+            }
+
+            double norm = 0.0;
+            for (int d = 0; d < DIMENSIONS; d++)
+                norm += basis[c][d] * basis[c][d];
+            norm = sqrt(norm);
+
+            for (int d = 0; d < DIMENSIONS; d++)
+                basis[c][d] = norm > 0.0 ? basis[c][d] / norm : 0.0;
+        }
+    }
+
+    // Diagonalize the symmetric {n} x {n} matrix with the cyclic Jacobi eigenvalue algorithm.
+    // The eigenvalues are left on its diagonal and the eigenvectors are the columns of {eigenvectors}.
+    static void Jacobi(vector<vector<double>> &matrix, vector<vector<double>> &eigenvectors)
+    {
+        int n = matrix.size();
+        eigenvectors = vector<vector<double>>(n, vector<double>(n, 0.0));
+        for (int i = 0; i < n; i++)
+            eigenvectors[i][i] = 1.0;
+
+        for (int sweep = 0; sweep < JACOBI_SWEEPS; sweep++)
+        {
+            double off_diagonal = 0.0;
+            for (int p = 0; p < n; p++)
+                for (int q = p + 1; q < n; q++)
+                    off_diagonal += matrix[p][q] * matrix[p][q];
+            if (off_diagonal < 1e-18)
+                break;
+
+            for (int p = 0; p < n; p++)
+            {
+                for (int q = p + 1; q < n; q++)
+                {
+                    if (matrix[p][q] == 0.0)
+                        continue;
+
+                    // The rotation that zeroes matrix[p][q]
+                    double theta = (matrix[q][q] - matrix[p][p]) / (2.0 * matrix[p][q]);
+                    double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                    double c = 1.0 / sqrt(t * t + 1.0);
+                    double s = t * c;
+
+                    for (int k = 0; k < n; k++)
+                    {
+                        double kp = matrix[k][p], kq = matrix[k][q];
+                        matrix[k][p] = c * kp - s * kq;
+                        matrix[k][q] = s * kp + c * kq;
+                    }
+                    for (int k = 0; k < n; k++)
+                    {
+                        double pk = matrix[p][k], qk = matrix[q][k];
+                        matrix[p][k] = c * pk - s * qk;
+                        matrix[q][k] = s * pk + c * qk;
+                    }
+                    for (int k = 0; k < n; k++)
+                    {
+                        double kp = eigenvectors[k][p], kq = eigenvectors[k][q];
+                        eigenvectors[k][p] = c * kp - s * kq;
+                        eigenvectors[k][q] = s * kp + c * kq;
+                    }
+                }
+            }
+        }
+    }
+
+    // Fit PCA on a random sample of the dataset: estimate the covariance matrix, converge to its dominant subspace
+    // with subspace iterations, then split the subspace into the principal components with a small Jacobi eigensolver.
+    void FitPCA(const vector<MNIST_Image> &images, mt19937 &generator)
+    {
+        vector<size_t> order(images.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        shuffle(order.begin(), order.end(), generator);
+        order.resize(min(order.size(), (size_t)PCA_TRAIN_SAMPLE));
+
+        mean.fill(0.0);
+        for (size_t i : order)
+            for (int d = 0; d < DIMENSIONS; d++)
+                mean[d] += images[i].GetImageData()[d] / order.size();
+
+        // The covariance matrix, only its upper triangle is accumulated
+        cout << "[i] PCA estimating the covariance matrix on " << order.size() << " vectors." << endl;
+        vector<vector<double>> covariance(DIMENSIONS, vector<double>(DIMENSIONS, 0.0));
+        IMAGE_DATA centered;
+        for (size_t i : order)
+        {
+            for (int d = 0; d < DIMENSIONS; d++)
+                centered[d] = images[i].GetImageData()[d] - mean[d];
+
+            for (int a = 0; a < DIMENSIONS; a++)
+            {
+                if (centered[a] == 0.0)
+                    continue;
+                for (int b = a; b < DIMENSIONS; b++)
+                    covariance[a][b] += centered[a] * centered[b];
+            }
+        }
+
+        double total_variance = 0.0;
+        for (int a = 0; a < DIMENSIONS; a++)
+        {
+            for (int b = a; b < DIMENSIONS; b++)
+            {
+                covariance[a][b] /= order.size();
+                covariance[b][a] = covariance[a][b];
+            }
+            total_variance += covariance[a][a];
+        }
+
+        // Subspace iterations: the basis converges to the span of the {no_components} dominant eigenvectors
+        cout << "[i] PCA computing " << no_components << " principal components." << endl;
+        normal_distribution<double> normal(0.0, 1.0);
+        vector<IMAGE_DATA> basis(no_components);
+        for (IMAGE_DATA &column : basis)
+            for (double &value : column)
+                value = normal(generator);
+        Orthonormalize(basis);
+
+        vector<IMAGE_DATA> product(no_components);
+        auto multiply = [&]()
+        {
+            for (int c = 0; c < no_components; c++)
+            {
+                for (int a = 0; a < DIMENSIONS; a++)
+                {
+                    double sum = 0.0;
+                    for (int b = 0; b < DIMENSIONS; b++)
+                        sum += covariance[a][b] * basis[c][b];
+                    product[c][a] = sum;
+                }
+            }
+        };
+
+        for (int iteration = 0; iteration < PCA_ITERATIONS; iteration++)
+        {
+            multiply();
+            basis.swap(product);
+            Orthonormalize(basis);
+        }
+
+        // Rayleigh-Ritz: diagonalize the covariance restricted to the subspace, its eigenvectors rotate the basis to the components
+        multiply();
+        vector<vector<double>> restricted(no_components, vector<double>(no_components, 0.0));
+        for (int p = 0; p < no_components; p++)
+            for (int q = 0; q < no_components; q++)
+                for (int d = 0; d < DIMENSIONS; d++)
+                    restricted[p][q] += basis[p][d] * product[q][d];
+
+        vector<vector<double>> eigenvectors;
+        Jacobi(restricted, eigenvectors);
+
+        vector<pair<double, int>> eigenvalues(no_components);
+        for (int c = 0; c < no_components; c++)
+            eigenvalues[c] = make_pair(restricted[c][c], c);
+        sort(eigenvalues.rbegin(), eigenvalues.rend());
+
+        components = vector<IMAGE_DATA>(no_components);
+        double kept_variance = 0.0;
+        for (int c = 0; c < no_components; c++)
+        {
+            int column = eigenvalues[c].second;
+            components[c].fill(0.0);
+            for (int p = 0; p < no_components; p++)
+                for (int d = 0; d < DIMENSIONS; d++)
+                    components[c][d] += eigenvectors[p][column] * basis[p][d];
+            kept_variance += eigenvalues[c].first;
+        }
+
+        explained_variance = total_variance > 0.0 ? kept_variance / total_variance : 1.0;
+        cout << "[i] PCA kept " << explained_variance * 100.0 << "% of the variance." << endl;
+    }
+
+    // Draw the sparse random projection: every weight is +-sqrt(s / no_components) with probability 1 / (2s) each and 0 otherwise,
+    // with s = sqrt(DIMENSIONS), so that the squared distances are preserved in expectation.
+    void FitSparseRandomProjection(mt19937 &generator)
+    {
+        double s = sqrt((double)DIMENSIONS);
+        double weight = sqrt(s / no_components);
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        sparse_components = vector<vector<pair<int, double>>>(no_components);
+        for (int c = 0; c < no_components; c++)
+        {
+            for (int d = 0; d < DIMENSIONS; d++)
+            {
+                double draw = uniform(generator);
+                if (draw < 0.5 / s)
+                    sparse_components[c].push_back(make_pair(d, weight));
+                else if (draw < 1.0 / s)
+                    sparse_components[c].push_back(make_pair(d, -weight));
+            }
+        }
+    }
+
+public:
+    // Fit the projection of the given method ("pca" or "rp") to {_no_components} components on the dataset.
+    Projection(MNIST &input, const string &_method, int _no_components = PROJECTION_COMPONENTS, unsigned int seed = random_device()())
+    {
+        if (_method != "pca" && _method != "rp")
+        {
+            throw runtime_error("Unknown projection method: " + _method + ", expected pca or rp.\n");
+        }
+        if (_no_components <= 0 || _no_components > DIMENSIONS)
+        {
+            throw runtime_error("The number of components must be in [1, " + to_string(DIMENSIONS) + "].\n");
+        }
+
+        method = _method;
+        no_components = _no_components;
+        explained_variance = 1.0;
+        mean.fill(0.0);
+
+        mt19937 generator(seed);
+        if (method == "pca")
+            FitPCA(input.GetImages(), generator);
+        else
+            FitSparseRandomProjection(generator);
+    }
+
+    // Get the number of components the vectors are reduced to.
+    int GetComponentsCount() const { return no_components; }
+
+    // Reduce a vector, its components are stored first and followed by zeros.
+    IMAGE_DATA Transform(const IMAGE_DATA &data) const
+    {
+        IMAGE_DATA reduced;
+        reduced.fill(0.0);
+
+        if (method == "pca")
+        {
+            for (int c = 0; c < no_components; c++)
+            {
+                double sum = 0.0;
+                for (int d = 0; d < DIMENSIONS; d++)
+                    sum += (data[d] - mean[d]) * components[c][d];
+                reduced[c] = sum;
+            }
+        }
+        else
+        {
+            for (int c = 0; c < no_components; c++)
+            {
+                double sum = 0.0;
+                for (const pair<int, double> &entry : sparse_components[c])
+                    sum += data[entry.first] * entry.second;
+                reduced[c] = sum;
+            }
+        }
+
+        return reduced;
+    }
+
+    // Reduce every vector of a dataset, the images keep their indices.
+    MNIST Transform(MNIST &dataset) const
+    {
+        vector<MNIST_Image> images = dataset.GetImages();
+        for (MNIST_Image &image : images)
+            image = MNIST_Image(image.GetIndex(), Transform(image.GetImageData()));
+
+        return MNIST(images, no_components);
+    }
+};
+
+// Rerank the neighbors that an index found in the reduced space with their exact distances in the original space,
+// keeping the {no_neighbours} nearest. {originals} holds the original images, indexed by the image index.
+set<MNIST_Image, MNIST_ImageComparator> RerankOriginal(const set<MNIST_Image, MNIST_ImageComparator> &candidates, const IMAGE_DATA &query,
+                                                       const vector<MNIST_Image> &originals, int no_neighbours)
+{
+    set<MNIST_Image, MNIST_ImageComparator> nearest_neighbors;
+    for (const MNIST_Image &candidate : candidates)
+    {
+        const MNIST_Image &original = originals[candidate.GetIndex()];
+        InsertNearestNeighbor(nearest_neighbors, no_neighbours, original, EuclideanDistance(2, query, original.GetImageData(), DIMENSIONS));
+    }
+
+    return nearest_neighbors;
+}
+
+#endif // PROJECTION_H
@@ -0,0 +1,421 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "mnist.h"
+#include "timing.h"
+
+#define SERVER_BATCH 32            // Number of queued requests that a worker takes and answers at once.
+#define SERVER_READ_CHUNK 65536    // Bytes read from a connection at once, every complete request in them is queued together.
+#define REQUEST_HEADER_SIZE 12     // type u8, element u8, dimensions u16, id u32, k or radius u32.
+#define RESPONSE_HEADER_SIZE 12    // id u32, status u8, 3 padding bytes, count u32.
+#define RESPONSE_NEIGHBOR_SIZE 8   // index u32, distance f32.
+
+using namespace std;
+
+// The requests of the binary protocol. Every request is a header of REQUEST_HEADER_SIZE bytes, followed by the
+// {dimensions} coordinates of the query as {element}s. Every field is in the native (little-endian) byte order.
+enum RequestType
+{
+    KNN_REQUEST = 0,     // The k nearest neighbors of the query.
+    RANGE_REQUEST = 1,   // The neighbors of the query inside the radius.
+    SHUTDOWN_REQUEST = 2 // Stop the server once the queued requests are answered, it carries no coordinates.
+};
+
+// The element types of the query coordinates.
+enum RequestElement
+{
+    FLOAT32_ELEMENT = 0,
+    UINT8_ELEMENT = 1
+};
+
+// The status of a response. A response is a header of RESPONSE_HEADER_SIZE bytes, followed by {count}
+// neighbors of RESPONSE_NEIGHBOR_SIZE bytes, sorted by increasing distance.
+enum ResponseStatus
+{
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1, // The dimensions or the type of the request are not the ones of the index.
+    STATUS_UNSUPPORTED = 2, // The index cannot answer the type of the request, e.g. range requests on a graph.
+    STATUS_ERROR = 3        // The search failed, e.g. it ran out of memory, and the server goes on with the next request.
+};
+
+// A client connection, or stdin and stdout. It is shared by the requests read from it, so that it is closed
+// once the client has hung up and the last of its requests has been answered.
+class Connection
+{
+private:
+    int in_fd;         // The descriptor that the requests are read from.
+    int out_fd;        // The descriptor that the responses are written to.
+    bool owned;        // Whether the descriptors are closed with the connection.
+    mutex write_mutex; // Serializes the responses written by the workers.
+    bool broken;       // Whether a write failed, e.g. because the client hung up.
+
+public:
+    vector<char> buffer; // The bytes read that do not make up a complete request yet.
+
+    // Create a new instance of Connection.
+    Connection(int _in_fd, int _out_fd, bool _owned) : in_fd(_in_fd), out_fd(_out_fd), owned(_owned), broken(false) {}
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    ~Connection()
+    {
+        if (!owned)
+            return;
+
+        close(in_fd);
+        if (out_fd != in_fd)
+            close(out_fd);
+    }
+
+    // Get the descriptor that the requests are read from.
+    int GetInput() const { return in_fd; }
+
+    // Write the responses of a batch at once, a failed write drops the rest of the connection's responses.
+    void Write(const vector<char> &bytes)
+    {
+        lock_guard<mutex> lock(write_mutex);
+        for (size_t written = 0; !broken && written < bytes.size();)
+        {
+            ssize_t n = write(out_fd, bytes.data() + written, bytes.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                broken = true;
+            else
+                written += n;
+        }
+    }
+};
+
+// A request waiting to be answered.
+struct Request
+{
+    shared_ptr<Connection> connection;
+    uint8_t type;
+    uint8_t status;    // STATUS_BAD_REQUEST when the request was rejected while being read.
+    uint32_t id;
+    uint32_t parameter; // The k of a KNN_REQUEST, at most the size of the dataset, or the radius of a RANGE_REQUEST.
+    IMAGE_DATA query;
+    Stopwatch age;      // Started when the request was read, its latency includes the time spent in the queue.
+};
+
+// The signal that stops a server, it is only read by the thread serving the connections.
+static volatile sig_atomic_t server_signal = 0;
+
+// QueryServer answers the kNN and range requests of its connections against an index built once.
+// A single thread reads the connections and queues every complete request, and a pool of workers takes
+// the requests in batches, answers them with their own QueryContext and writes the responses of a batch
+// to every connection at once. The responses of a connection may come out of order, the ids match them.
+class QueryServer
+{
+public:
+    // Answer a query into the context's nearest neighbors, with the k or the radius of the request.
+    typedef function<void(const IMAGE_DATA &, int, QueryContext &)> SearchFunction;
+
+private:
+    SearchFunction knn;          // The kNN search of the index.
+    SearchFunction range;        // The range search of the index, empty when it has none.
+    uint32_t no_images;          // The number of images of the index, no kNN request gets more neighbors.
+    int no_workers;              // The number of workers answering the requests.
+    int batch_size;              // The number of requests that a worker takes at once.
+    deque<Request> queue;        // The requests waiting for a worker.
+    mutex queue_mutex;           // Guards the queue and finishing.
+    condition_variable queued;   // Signals the workers that requests were queued, or that the server is finishing.
+    bool finishing;              // Whether the workers exit once the queue is empty.
+    atomic<bool> stopping;       // Whether a shutdown request was read.
+    vector<LatencyHistogram> latencies; // The latencies of the requests answered by every worker.
+
+    // Queue the complete requests of the connection's buffer, and return false when the stream is corrupt.
+    bool ReadRequests(const shared_ptr<Connection> &connection, vector<Request> &requests)
+    {
+        vector<char> &buffer = connection->buffer;
+        size_t offset = 0;
+        while (buffer.size() - offset >= REQUEST_HEADER_SIZE)
+        {
+            const char *header = buffer.data() + offset;
+            uint8_t type = (uint8_t)header[0];
+            uint8_t element = (uint8_t)header[1];
+            uint16_t dimensions;
+            memcpy(&dimensions, header + 2, sizeof(dimensions));
+
+            if (element != FLOAT32_ELEMENT && element != UINT8_ELEMENT)
+                return false;
+
+            size_t element_size = element == FLOAT32_ELEMENT ? sizeof(float) : sizeof(uint8_t);
+            size_t size = REQUEST_HEADER_SIZE + dimensions * element_size;
+            if (buffer.size() - offset < size)
+                break;
+
+            Request request;
+            request.connection = connection;
+            request.type = type;
+            request.status = STATUS_OK;
+            memcpy(&request.id, header + 4, sizeof(request.id));
+            memcpy(&request.parameter, header + 8, sizeof(request.parameter));
+
+            // The searches reserve room for k neighbors and take k and the radius as an int, so a huge k
+            // is clamped to the neighbors that exist, and a radius past INT32_MAX to one that includes every image.
+            if (type == KNN_REQUEST)
+                request.parameter = min(request.parameter, no_images);
+            else if (type == RANGE_REQUEST)
+                request.parameter = min(request.parameter, (uint32_t)INT32_MAX);
+
+            if (type == SHUTDOWN_REQUEST)
+                stopping = true;
+            else if (type > SHUTDOWN_REQUEST || dimensions != DIMENSIONS)
+                request.status = STATUS_BAD_REQUEST;
+            else
+            {
+                const char *coordinates = header + REQUEST_HEADER_SIZE;
+                for (size_t d = 0; d < DIMENSIONS; d++)
+                {
+                    if (element == UINT8_ELEMENT)
+                    {
+                        request.query[d] = (uint8_t)coordinates[d];
+                    }
+                    else
+                    {
+                        float value;
+                        memcpy(&value, coordinates + d * sizeof(float), sizeof(float));
+                        request.query[d] = value;
+                    }
+                }
+            }
+
+            requests.push_back(request);
+            offset += size;
+        }
+
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+        return true;
+    }
+
+    // Queue the requests read at once, waking up as many workers as they keep busy.
+    void Enqueue(vector<Request> &requests)
+    {
+        if (requests.empty())
+            return;
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            for (Request &request : requests)
+                queue.push_back(request);
+        }
+        if (requests.size() > 1)
+            queued.notify_all();
+        else
+            queued.notify_one();
+
+        requests.clear();
+    }
+
+    // Take up to {batch_size} requests, and return false once the server is finishing and the queue is empty.
+    bool Dequeue(vector<Request> &batch)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        queued.wait(lock, [this]()
+                    { return !queue.empty() || finishing; });
+        if (queue.empty())
+            return false;
+
+        while (!queue.empty() && (int)batch.size() < batch_size)
+        {
+            batch.push_back(queue.front());
+            queue.pop_front();
+        }
+
+        return true;
+    }
+
+    // Append the response of a request to a buffer.
+    void Answer(const Request &request, QueryContext &context, vector<char> &output)
+    {
+        uint8_t status = request.status;
+        if (status == STATUS_OK && request.type == RANGE_REQUEST && !range)
+            status = STATUS_UNSUPPORTED;
+
+        uint32_t count = 0;
+        if (status == STATUS_OK && request.type == KNN_REQUEST)
+        {
+            knn(request.query, (int)request.parameter, context);
+            count = context.GetNearest().size();
+        }
+        else if (status == STATUS_OK && request.type == RANGE_REQUEST)
+        {
+            range(request.query, (int)request.parameter, context);
+            count = context.GetNearest().size();
+        }
+
+        char header[RESPONSE_HEADER_SIZE] = {};
+        memcpy(header, &request.id, sizeof(request.id));
+        header[4] = (char)status;
+        memcpy(header + 8, &count, sizeof(count));
+        output.insert(output.end(), header, header + RESPONSE_HEADER_SIZE);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const Neighbor &neighbor = context.GetNearest()[i];
+            float distance = (float)neighbor.first;
+            char bytes[RESPONSE_NEIGHBOR_SIZE];
+            memcpy(bytes, &neighbor.second, sizeof(uint32_t));
+            memcpy(bytes + 4, &distance, sizeof(distance));
+            output.insert(output.end(), bytes, bytes + RESPONSE_NEIGHBOR_SIZE);
+        }
+    }
+
+    // Answer batches of requests until the server is finishing, with the query context of the worker's thread.
+    void Work(int worker)
+    {
+        QueryContext &context = ThreadQueryContext();
+        vector<Request> batch;
+        vector<pair<Connection *, vector<char>>> outputs; // The responses of the batch to every connection.
+
+        while (Dequeue(batch))
+        {
+            for (const Request &request : batch)
+            {
+                size_t o = 0;
+                while (o < outputs.size() && outputs[o].first != request.connection.get())
+                    o++;
+                if (o == outputs.size())
+                    outputs.push_back(make_pair(request.connection.get(), vector<char>()));
+
+                // A failed search only fails its own request, the worker and the rest of the batch go on
+                size_t answered = outputs[o].second.size();
+                try
+                {
+                    Answer(request, context, outputs[o].second);
+                }
+                catch (const exception &error)
+                {
+                    cout << "[!] Request " << request.id << " failed: " << error.what() << endl;
+                    outputs[o].second.resize(answered);
+                    Request failed = request;
+                    failed.status = STATUS_ERROR;
+                    Answer(failed, context, outputs[o].second);
+                }
+            }
+
+            for (pair<Connection *, vector<char>> &output : outputs)
+                output.first->Write(output.second);
+            for (const Request &request : batch)
+                latencies[worker].Record(request.age.ElapsedNanoseconds());
+
+            outputs.clear();
+            batch.clear();
+        }
+    }
+
+public:
+    // Create a new instance of QueryServer over an index of {_no_images} images, {_range} may be empty for the indexes without range search.
+    QueryServer(SearchFunction _knn, SearchFunction _range, uint32_t _no_images, int _no_workers, int _batch_size)
+        : knn(_knn), range(_range), no_images(_no_images), no_workers(max(_no_workers, 1)), batch_size(max(_batch_size, 1)),
+          finishing(false), stopping(false), latencies(no_workers) {}
+
+    // Serve the clients of the listening socket {listen_fd} and/or the requests of {in_fd}, answering the latter to {out_fd}.
+    // Either may be -1. Returns once a shutdown request was read or a signal arrived, or once {in_fd} reached its end
+    // when there is no socket, after every queued request has been answered.
+    void Serve(int listen_fd, int in_fd, int out_fd)
+    {
+        vector<thread> workers;
+        for (int w = 0; w < no_workers; w++)
+            workers.push_back(thread(&QueryServer::Work, this, w));
+
+        vector<shared_ptr<Connection>> connections;
+        if (in_fd >= 0)
+            connections.push_back(make_shared<Connection>(in_fd, out_fd, false));
+
+        vector<pollfd> descriptors;
+        vector<Request> requests;
+        vector<char> chunk(SERVER_READ_CHUNK);
+        while (!stopping && server_signal == 0 && (listen_fd >= 0 || !connections.empty()))
+        {
+            descriptors.clear();
+            for (const shared_ptr<Connection> &connection : connections)
+                descriptors.push_back({connection->GetInput(), POLLIN, 0});
+            if (listen_fd >= 0)
+                descriptors.push_back({listen_fd, POLLIN, 0});
+
+            if (poll(descriptors.data(), descriptors.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw runtime_error("Failed to poll the connections: " + string(strerror(errno)) + ".\n");
+            }
+
+            // Read every connection that has data, or hung up
+            for (size_t c = connections.size(); c-- > 0;)
+            {
+                if (descriptors[c].revents == 0)
+                    continue;
+
+                shared_ptr<Connection> connection = connections[c];
+                ssize_t n = read(connection->GetInput(), chunk.data(), chunk.size());
+                if (n < 0 && errno == EINTR)
+                    continue;
+
+                bool open = n > 0;
+                if (open)
+                {
+                    connection->buffer.insert(connection->buffer.end(), chunk.begin(), chunk.begin() + n);
+                    open = ReadRequests(connection, requests);
+                    if (!open)
+                        cout << "[!] Closing a connection that sent a corrupt request." << endl;
+                }
+                if (!open)
+                    connections.erase(connections.begin() + c);
+            }
+            Enqueue(requests);
+
+            if (listen_fd >= 0 && (descriptors.back().revents & POLLIN))
+            {
+                int client_fd = accept(listen_fd, nullptr, nullptr);
+                if (client_fd >= 0)
+                    connections.push_back(make_shared<Connection>(client_fd, client_fd, true));
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            finishing = true;
+        }
+        queued.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    // Get the latencies of every request answered, from the moment it was read until its response was written.
+    LatencyHistogram GetLatencies() const
+    {
+        LatencyHistogram total;
+        for (const LatencyHistogram &worker_latencies : latencies)
+            total.Merge(worker_latencies);
+
+        return total;
+    }
+};
+
+#endif // SERVER_H
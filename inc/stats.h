@@ -0,0 +1,189 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define STATS_BUCKETS 64 // Number of power-of-two buckets of the stats histograms, enough for any 64-bit value.
+
+// The counters that the searches record per query when built with SEARCH_STATS (`make SEARCH_STATS=1`).
+// Without it the STATS_* macros compile to nothing, so the searches pay nothing for them.
+enum SearchCounter
+{
+    BUCKETS_PROBED, // The LSH buckets or Hypercube vertices looked up.
+    CANDIDATES,     // The images scored, with their exact or their PQ distance.
+    DUPLICATES,     // The images reached again after they had already been scored.
+    HOPS,           // The nodes that a graph search moved to.
+    EXPANSIONS,     // The neighbors evaluated while expanding the graph nodes.
+    RESTARTS,       // The starting nodes that a graph search used.
+    HASHING_NS,     // The nanoseconds spent hashing the query.
+    DISTANCE_NS,    // The nanoseconds spent computing distances.
+    NO_SEARCH_COUNTERS
+};
+
+// Get the name of a search counter, as it appears in the JSON dump.
+inline const char *SearchCounterName(int counter)
+{
+    static const char *names[NO_SEARCH_COUNTERS] = {"buckets_probed", "candidates", "duplicates", "hops",
+                                                    "expansions", "restarts", "hashing_ns", "distance_ns"};
+    return names[counter];
+}
+
+// The counters of a single query.
+struct SearchStats
+{
+    uint64_t counters[NO_SEARCH_COUNTERS];
+
+    SearchStats() { Clear(); }
+
+    void Clear()
+    {
+        for (int c = 0; c < NO_SEARCH_COUNTERS; c++)
+            counters[c] = 0;
+    }
+};
+
+// Adds the nanoseconds elapsed during its lifetime to a counter.
+class ScopedStatsTimer
+{
+private:
+    uint64_t &counter;
+    chrono::steady_clock::time_point start;
+
+public:
+    ScopedStatsTimer(uint64_t &_counter) : counter(_counter), start(chrono::steady_clock::now()) {}
+
+    ~ScopedStatsTimer()
+    {
+        counter += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+#ifdef SEARCH_STATS
+#define STATS_ADD(stats, counter, n) ((stats).counters[counter] += (n))
+#define STATS_TIMER(stats, counter) ScopedStatsTimer stats_timer_##counter((stats).counters[counter])
+#else
+#define STATS_ADD(stats, counter, n) ((void)0)
+#define STATS_TIMER(stats, counter) ((void)0)
+#endif
+
+// Whether the searches were built to record their counters.
+inline bool SearchStatsEnabled()
+{
+#ifdef SEARCH_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// StatsCollector aggregates the counters of the queries of an index: their sum, min, max,
+// and a histogram of power-of-two buckets, bucket b counting the values in [2^(b-1), 2^b) and bucket 0 the zeros.
+class StatsCollector
+{
+private:
+    string name;                           // The name of the index.
+    uint64_t no_queries;                   // The number of queries added.
+    uint64_t sums[NO_SEARCH_COUNTERS];     // The sum of every counter.
+    uint64_t minimums[NO_SEARCH_COUNTERS]; // The min of every counter.
+    uint64_t maximums[NO_SEARCH_COUNTERS]; // The max of every counter.
+    vector<vector<uint64_t>> histograms;   // The histogram of every counter.
+
+    // Get the histogram bucket of a value, the number of bits that it needs.
+    static int Bucket(uint64_t value)
+    {
+        int bucket = 0;
+        while (value > 0)
+        {
+            value >>= 1;
+            bucket++;
+        }
+
+        return bucket;
+    }
+
+public:
+    // Create a new instance of StatsCollector for the index with the given name.
+    StatsCollector(const string &_name) : name(_name), no_queries(0), histograms(NO_SEARCH_COUNTERS, vector<uint64_t>(STATS_BUCKETS + 1, 0))
+    {
+        for (int c = 0; c < NO_SEARCH_COUNTERS; c++)
+        {
+            sums[c] = 0;
+            minimums[c] = UINT64_MAX;
+            maximums[c] = 0;
+        }
+    }
+
+    // Add the counters of a query.
+    void Add(const SearchStats &stats)
+    {
+        no_queries++;
+        for (int c = 0; c < NO_SEARCH_COUNTERS; c++)
+        {
+            uint64_t value = stats.counters[c];
+            sums[c] += value;
+            minimums[c] = min(minimums[c], value);
+            maximums[c] = max(maximums[c], value);
+            histograms[c][Bucket(value)]++;
+        }
+    }
+
+    // Write the aggregated counters as a JSON object.
+    void WriteJson(ostream &out) const
+    {
+        out << "\"" << name << "\": {\"queries\": " << no_queries;
+        for (int c = 0; c < NO_SEARCH_COUNTERS; c++)
+        {
+            out << ", \"" << SearchCounterName(c) << "\": {"
+                << "\"sum\": " << sums[c]
+                << ", \"mean\": " << (no_queries > 0 ? (double)sums[c] / no_queries : 0.0)
+                << ", \"min\": " << (no_queries > 0 ? minimums[c] : 0)
+                << ", \"max\": " << maximums[c]
+                << ", \"histogram\": [";
+
+            // Only the non-empty buckets, each one with the exclusive upper bound of its values
+            bool first = true;
+            for (int b = 0; b <= STATS_BUCKETS; b++)
+            {
+                if (histograms[c][b] == 0)
+                    continue;
+
+                out << (first ? "" : ", ") << "{\"lt\": " << (b == 0 ? 1 : b == STATS_BUCKETS ? UINT64_MAX : (uint64_t)1 << b)
+                    << ", \"count\": " << histograms[c][b] << "}";
+                first = false;
+            }
+            out << "]}";
+        }
+        out << "}";
+    }
+};
+
+// Write the counters of the given indexes to a JSON file, usually next to the results file.
+inline void WriteSearchStats(const string &file_path, const vector<const StatsCollector *> &collectors)
+{
+    ofstream out(file_path, ios::out | ios::trunc);
+    if (!out.is_open())
+    {
+        cout << "Failed to write the search stats to " << file_path << endl;
+        return;
+    }
+
+    out << "{";
+    for (size_t i = 0; i < collectors.size(); i++)
+    {
+        out << (i == 0 ? "\n  " : ",\n  ");
+        collectors[i]->WriteJson(out);
+    }
+    out << "\n}" << endl;
+
+    cout << "[i] Search stats written to " << file_path << endl;
+}
+
+#endif // STATS_H
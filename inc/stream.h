@@ -0,0 +1,174 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "formats.h"
+#include "mnist.h"
+
+#define STREAM_BLOCK 16384 // Default number of images read per block, about 12 MB of bytes and 100 MB of decoded images.
+
+using namespace std;
+
+// MNIST_Stream reads a vector file of any format of formats.h block by block instead of loading it whole,
+// so that datasets larger than the memory can be scanned with bounded memory.
+// Blocks are read with pread, and the next block is read by a background thread while the current one is being processed.
+class MNIST_Stream
+{
+private:
+    string file_path;    // The MNIST file path.
+    int fd;              // The file descriptor of the MNIST file.
+    VectorLayout layout; // The layout of the file.
+    uint32_t no_images;  // The total number of MNIST images.
+    size_t block_size;   // The number of images per block.
+
+    // Read exactly {size} bytes at the given offset of the file.
+    void ReadBytes(uint8_t *bytes, size_t size, off_t offset)
+    {
+        while (size > 0)
+        {
+            ssize_t read = pread(fd, bytes, size, offset);
+            if (read <= 0)
+            {
+                throw runtime_error("Failed to read the file: " + file_path + "\n");
+            }
+
+            bytes += read;
+            size -= read;
+            offset += read;
+        }
+    }
+
+    // Read the raw bytes of the given block.
+    void ReadBlock(size_t block, vector<uint8_t> &bytes)
+    {
+        size_t first = block * block_size;
+        size_t count = min(block_size, (size_t)no_images - first);
+
+        bytes.resize(count * layout.Stride());
+        ReadBytes(bytes.data(), bytes.size(), (off_t)layout.Offset(first));
+    }
+
+    // Convert the raw bytes of a block to images, the same way as MNIST.
+    void DecodeBlock(const vector<uint8_t> &bytes, vector<IMAGE_DATA> &images) const
+    {
+        images.resize(bytes.size() / layout.Stride());
+        for (size_t i = 0; i < images.size(); i++)
+            DecodeRecord(&bytes[i * layout.Stride()], layout, images[i].data());
+    }
+
+public:
+    // Open a vector file for streaming, reading only the bytes its format is detected on.
+    MNIST_Stream(const string &_file_path, size_t _block_size = STREAM_BLOCK)
+    {
+        file_path = _file_path;
+        block_size = max(_block_size, (size_t)1);
+
+        fd = open(file_path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw runtime_error("Failed to open the file: " + file_path + "\n");
+        }
+
+        // The file is scanned front to back, let the kernel read ahead aggressively
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        try
+        {
+            struct stat info;
+            if (fstat(fd, &info) != 0)
+            {
+                throw runtime_error("Failed to read the file: " + file_path + "\n");
+            }
+
+            vector<uint8_t> head(min((size_t)info.st_size, (size_t)FORMAT_PROBE));
+            ReadBytes(head.data(), head.size(), 0);
+            layout = DetectLayout(head.data(), head.size(), info.st_size, DIMENSIONS, file_path);
+            no_images = layout.count;
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+    }
+
+    MNIST_Stream(const MNIST_Stream &) = delete;
+    MNIST_Stream &operator=(const MNIST_Stream &) = delete;
+
+    ~MNIST_Stream()
+    {
+        close(fd);
+    }
+
+    // Get the MNIST file path.
+    string GetFilePath() const { return file_path; }
+
+    // Get the total number of MNIST images.
+    uint32_t GetSize() const { return no_images; }
+
+    // Get the number of images per block.
+    size_t GetBlockSize() const { return block_size; }
+
+    // Scan the whole file, calling {work(first, images)} for every block with the index of its first image.
+    // The next block is read in the background while {work} runs, so reading overlaps with the computation.
+    template <typename Work>
+    void ForEachBlock(Work work)
+    {
+        size_t no_blocks = (no_images + block_size - 1) / block_size;
+        vector<uint8_t> current, next;
+        vector<IMAGE_DATA> images;
+
+        if (no_blocks > 0)
+            ReadBlock(0, current);
+
+        for (size_t block = 0; block < no_blocks; block++)
+        {
+            exception_ptr read_error;
+            thread reader;
+            if (block + 1 < no_blocks)
+            {
+                reader = thread([&, block]()
+                                {
+                    try
+                    {
+                        ReadBlock(block + 1, next);
+                    }
+                    catch (...)
+                    {
+                        read_error = current_exception();
+                    } });
+            }
+
+            try
+            {
+                DecodeBlock(current, images);
+                work(block * block_size, (const vector<IMAGE_DATA> &)images);
+            }
+            catch (...)
+            {
+                if (reader.joinable())
+                    reader.join();
+                throw;
+            }
+
+            if (reader.joinable())
+                reader.join();
+            if (read_error)
+                rethrow_exception(read_error);
+
+            current.swap(next);
+        }
+    }
+};
+
+#endif // STREAM_H
@@ -0,0 +1,170 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+#define LATENCY_SUB_BUCKET_BITS 7 // Every power of two is split in 2^6 linear buckets, so latencies are kept within 1/64 (1.6%).
+
+// Stopwatch measures wall-clock time with the monotonic steady_clock. Unlike clock() it counts the time spent waiting too,
+// and it has nanosecond resolution instead of the coarse ticks of the CPU time.
+class Stopwatch
+{
+private:
+    chrono::steady_clock::time_point start; // When the stopwatch was started.
+
+public:
+    // Create a new instance of Stopwatch, started.
+    Stopwatch() : start(chrono::steady_clock::now()) {}
+
+    // Start measuring again from now.
+    void Restart() { start = chrono::steady_clock::now(); }
+
+    // Get the nanoseconds elapsed since the stopwatch was started.
+    uint64_t ElapsedNanoseconds() const
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Get the seconds elapsed since the stopwatch was started.
+    double ElapsedSeconds() const { return ElapsedNanoseconds() / 1e9; }
+};
+
+// LatencyHistogram records latencies in nanoseconds in HDR-style log-linear buckets: the values below 2^7 have a bucket each,
+// and every larger power of two is split in 2^6 equal buckets. Its memory is fixed, recording is O(1),
+// and every percentile is exact up to the 1.6% width of its bucket, however long the tail is.
+class LatencyHistogram
+{
+private:
+    vector<uint64_t> counts; // The number of latencies recorded in every bucket.
+    uint64_t no_values;      // The number of latencies recorded.
+    uint64_t total_ns;       // The sum of the latencies.
+    uint64_t max_ns;         // The largest latency.
+
+    // Get the bucket of a latency.
+    static size_t Bucket(uint64_t value)
+    {
+        int msb = 63 - __builtin_clzll(value | 1);
+        if (msb < LATENCY_SUB_BUCKET_BITS)
+            return (size_t)value;
+
+        int shift = msb - LATENCY_SUB_BUCKET_BITS + 1;
+        return ((size_t)shift << (LATENCY_SUB_BUCKET_BITS - 1)) + (size_t)(value >> shift);
+    }
+
+    // Get the largest latency that falls in the given bucket.
+    static uint64_t HighestInBucket(size_t bucket)
+    {
+        if (bucket < ((size_t)1 << LATENCY_SUB_BUCKET_BITS))
+            return bucket;
+
+        size_t half = (size_t)1 << (LATENCY_SUB_BUCKET_BITS - 1);
+        size_t shift = bucket / half - 1;
+        uint64_t sub_bucket = bucket - shift * half;
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+public:
+    // Create a new instance of LatencyHistogram.
+    LatencyHistogram() : counts(Bucket(UINT64_MAX) + 1, 0), no_values(0), total_ns(0), max_ns(0) {}
+
+    // Record a latency in nanoseconds.
+    void Record(uint64_t latency_ns)
+    {
+        counts[Bucket(latency_ns)]++;
+        no_values++;
+        total_ns += latency_ns;
+        max_ns = max(max_ns, latency_ns);
+    }
+
+    // Add the latencies recorded by another histogram, e.g. of another thread.
+    void Merge(const LatencyHistogram &other)
+    {
+        for (size_t b = 0; b < counts.size(); b++)
+            counts[b] += other.counts[b];
+        no_values += other.no_values;
+        total_ns += other.total_ns;
+        max_ns = max(max_ns, other.max_ns);
+    }
+
+    // Get the number of latencies recorded.
+    uint64_t GetCount() const { return no_values; }
+
+    // Get the mean latency in seconds.
+    double GetMean() const { return no_values > 0 ? total_ns / 1e9 / no_values : 0.0; }
+
+    // Get the largest latency in seconds.
+    double GetMax() const { return max_ns / 1e9; }
+
+    // Get the latency in seconds that {percentile}% of the recorded ones do not exceed.
+    double GetPercentile(double percentile) const
+    {
+        if (no_values == 0)
+            return 0.0;
+
+        uint64_t rank = (uint64_t)ceil(percentile / 100.0 * no_values);
+        rank = min(max(rank, (uint64_t)1), no_values);
+
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts.size(); b++)
+        {
+            seen += counts[b];
+            if (seen >= rank)
+                return min(HighestInBucket(b), max_ns) / 1e9;
+        }
+
+        return GetMax();
+    }
+
+    // Get the queries per second of a single thread answering them back to back.
+    double GetQps() const { return total_ns > 0 ? no_values / (total_ns / 1e9) : 0.0; }
+
+    // Write the percentiles and the QPS as the summary lines of a results file, e.g. "latencyApproximate: p50 ...".
+    void WriteSummary(ostream &output, const string &name) const
+    {
+        output << "latency" << name << ": p50 " << GetPercentile(50) << "s, p90 " << GetPercentile(90)
+               << "s, p99 " << GetPercentile(99) << "s, p99.9 " << GetPercentile(99.9) << "s, max " << GetMax() << "s" << endl;
+        output << "qps" << name << ": " << GetQps() << endl;
+    }
+
+    // Write the latencies as a JSON object.
+    void WriteJson(ostream &out) const
+    {
+        out << "{\"queries\": " << no_values << ", \"mean_s\": " << GetMean()
+            << ", \"p50_s\": " << GetPercentile(50) << ", \"p90_s\": " << GetPercentile(90)
+            << ", \"p99_s\": " << GetPercentile(99) << ", \"p99.9_s\": " << GetPercentile(99.9)
+            << ", \"max_s\": " << GetMax() << ", \"qps\": " << GetQps() << "}";
+    }
+};
+
+// Write the latencies of the given (name, histogram) pairs to a JSON file, usually next to the results file.
+inline void WriteLatencies(const string &file_path, const vector<pair<string, const LatencyHistogram *>> &histograms)
+{
+    ofstream out(file_path, ios::out | ios::trunc);
+    if (!out.is_open())
+    {
+        cout << "Failed to write the latencies to " << file_path << endl;
+        return;
+    }
+
+    out << "{";
+    for (size_t i = 0; i < histograms.size(); i++)
+    {
+        out << (i == 0 ? "\n  \"" : ",\n  \"") << histograms[i].first << "\": ";
+        histograms[i].second->WriteJson(out);
+    }
+    out << "\n}" << endl;
+
+    cout << "[i] Latencies written to " << file_path << endl;
+}
+
+#endif // TIMING_H
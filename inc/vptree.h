@@ -0,0 +1,299 @@
+#ifndef VPTREE_H
+#define VPTREE_H
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "context.h"
+#include "hash.h"
+#include "misc.h"
+#include "mnist.h"
+
+#define VPTREE_LEAF 16      // Max number of images stored in a leaf, below it scanning beats splitting further.
+#define VPTREE_CANDIDATES 4 // Number of random images considered as the vantage image of a node.
+#define VPTREE_SAMPLE 16    // Number of random images of the node the spread of every candidate is measured on.
+
+using namespace std;
+
+// VPTree is an exact metric tree (vantage-point tree): every internal node picks a vantage image and splits the rest
+// of its images at the median distance {radius} to it, the nearer half goes inside and the farther half outside.
+// Queries walk the tree and skip the subtrees that the triangle inequality proves cannot hold anything nearer
+// than the current k-th neighbor, so their answers are exactly the ones of BRUTE with fewer distance evaluations.
+// The search methods do not modify the tree, so queries can run concurrently.
+class VPTree
+{
+private:
+    // A node of the tree, either internal (vantage image and two children) or a leaf (range of {order}).
+    struct Node
+    {
+        uint vantage;  // The index of the vantage image, internal nodes only.
+        double radius; // The median distance of the node's images to the vantage image.
+        int inside;    // The child holding the images within {radius}, -1 for leaves.
+        int outside;   // The child holding the images beyond {radius}, -1 for leaves.
+        size_t first;  // The first position of the leaf's images inside {order}.
+        size_t last;   // One past the last position of the leaf's images inside {order}.
+    };
+
+    vector<MNIST_Image> images; // The MNIST dataset's images converted to d-vectors.
+    size_t no_dimensions;       // The number of leading coordinates of the images that hold data.
+    vector<uint> order;         // The image indices, arranged so that the images of every leaf are contiguous.
+    vector<Node> nodes;         // The nodes of the tree, the root is the first one.
+    mt19937 generator;          // Random generator used to pick the vantage images.
+
+    // Pick the vantage image of the range order[first, last) among {VPTREE_CANDIDATES} random ones: the one whose distances
+    // to a random sample of the range have the largest spread, since it splits the range in the most distinct shells.
+    size_t SelectVantage(size_t first, size_t last)
+    {
+        uniform_int_distribution<size_t> random_position(first, last - 1);
+        size_t best = random_position(generator);
+        double best_spread = -1.0;
+
+        for (int c = 0; c < VPTREE_CANDIDATES; c++)
+        {
+            size_t candidate = c == 0 ? best : random_position(generator);
+            const IMAGE_DATA &candidate_data = images[order[candidate]].GetImageData();
+
+            double sum = 0.0, sum_squares = 0.0;
+            for (int i = 0; i < VPTREE_SAMPLE; i++)
+            {
+                double dist = EuclideanDistance(2, candidate_data, images[order[random_position(generator)]].GetImageData(), no_dimensions);
+                sum += dist;
+                sum_squares += dist * dist;
+            }
+
+            double spread = sum_squares / VPTREE_SAMPLE - (sum / VPTREE_SAMPLE) * (sum / VPTREE_SAMPLE);
+            if (spread > best_spread)
+            {
+                best_spread = spread;
+                best = candidate;
+            }
+        }
+
+        return best;
+    }
+
+    // Get the distance of two images, or infinity as soon as it is known to exceed {bound}.
+    // Leaves use it to abandon the images that cannot beat the current k-th neighbor after a fraction of the pixels.
+    // The sums go to the same 4 accumulators as SquaredDistance, so the distances are exactly the ones of BRUTE.
+    double BoundedDistance(const IMAGE_DATA &a, const IMAGE_DATA &b, double bound) const
+    {
+        double bound_squared = bound * bound;
+        double lanes[4] = {0.0, 0.0, 0.0, 0.0};
+
+        for (size_t i = 0; i < no_dimensions; i += 16)
+        {
+            for (size_t j = i; j < i + 16 && j < no_dimensions; j++)
+            {
+                double diff = a[j] - b[j];
+                lanes[j % 4] += diff * diff;
+            }
+
+            if ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) > bound_squared)
+                return numeric_limits<double>::infinity();
+        }
+
+        return sqrt((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+    }
+
+    // Build the subtree over the images order[first, last) and return the position of its root inside {nodes}.
+    int Build(size_t first, size_t last, vector<pair<double, uint>> &scratch)
+    {
+        int node_id = nodes.size();
+        nodes.push_back(Node{0, 0.0, -1, -1, first, last});
+
+        if (last - first <= VPTREE_LEAF)
+            return node_id;
+
+        // The vantage image is moved to the front of the range and kept out of the children
+        swap(order[first], order[SelectVantage(first, last)]);
+        uint vantage = order[first];
+        const IMAGE_DATA &vantage_data = images[vantage].GetImageData();
+
+        scratch.resize(last - first - 1);
+        for (size_t i = first + 1; i < last; i++)
+            scratch[i - first - 1] = make_pair(EuclideanDistance(2, vantage_data, images[order[i]].GetImageData(), no_dimensions), order[i]);
+
+        // Split at the median: the images before it are within {radius}, the rest are beyond it
+        size_t median = scratch.size() / 2;
+        nth_element(scratch.begin(), scratch.begin() + median, scratch.end());
+        double radius = scratch[median].first;
+
+        for (size_t i = 0; i < scratch.size(); i++)
+            order[first + 1 + i] = scratch[i].second;
+
+        int inside = Build(first + 1, first + 1 + median, scratch);
+        int outside = Build(first + 1 + median, last, scratch);
+
+        nodes[node_id] = Node{vantage, radius, inside, outside, first, last};
+        return node_id;
+    }
+
+    // The {no_neighbours} nearest images found so far, in a bounded max-heap that keeps the images with equal distances.
+    struct NearestHeap
+    {
+        int no_neighbours;
+        priority_queue<pair<double, uint>> heap; // Furthest first
+
+        double Bound() const { return (int)heap.size() < no_neighbours ? numeric_limits<double>::max() : heap.top().first; }
+
+        void Offer(double dist, uint index)
+        {
+            if ((int)heap.size() < no_neighbours)
+                heap.push(make_pair(dist, index));
+            else if (dist < heap.top().first)
+            {
+                heap.pop();
+                heap.push(make_pair(dist, index));
+            }
+        }
+    };
+
+    // The {no_neighbours} nearest images found so far, kept by a query context the same way as BRUTE so that the answers are identical.
+    struct NearestContext
+    {
+        QueryContext &context;
+
+        double Bound() const { return context.Bound(); }
+
+        void Offer(double dist, uint index) { context.Offer(dist, index); }
+    };
+
+    // The images found so far inside a fixed radius, collected by a query context.
+    struct InsideRadius
+    {
+        double radius;
+        QueryContext &context;
+
+        double Bound() const { return radius; }
+
+        void Offer(double dist, uint index)
+        {
+            if (dist < radius)
+                context.Collect(dist, index);
+        }
+    };
+
+    // Search the subtree of the given node, offering the images to {found} and counting the distance evaluations.
+    // The subtrees that cannot hold an image within found.Bound() of the query are pruned with the triangle inequality.
+    template <typename Found>
+    void Search(int node_id, const IMAGE_DATA &query, Found &found, size_t &evaluations) const
+    {
+        const Node &node = nodes[node_id];
+
+        if (node.inside < 0)
+        {
+            for (size_t i = node.first; i < node.last; i++)
+                found.Offer(BoundedDistance(query, images[order[i]].GetImageData(), found.Bound()), order[i]);
+            evaluations += node.last - node.first;
+            return;
+        }
+
+        double dist = EuclideanDistance(2, query, images[node.vantage].GetImageData(), no_dimensions);
+        evaluations++;
+        found.Offer(dist, node.vantage);
+
+        // Visit the side of the query first, it is the most likely to shrink the bound
+        if (dist < node.radius)
+        {
+            if (dist - found.Bound() <= node.radius)
+                Search(node.inside, query, found, evaluations);
+            if (dist + found.Bound() >= node.radius)
+                Search(node.outside, query, found, evaluations);
+        }
+        else
+        {
+            if (dist + found.Bound() >= node.radius)
+                Search(node.outside, query, found, evaluations);
+            if (dist - found.Bound() <= node.radius)
+                Search(node.inside, query, found, evaluations);
+        }
+    }
+
+public:
+    // Create a new instance of VPTree over the dataset.
+    VPTree(MNIST &input, unsigned int seed = random_device()())
+    {
+        images = input.GetImages();
+        no_dimensions = input.GetDimensionsCount();
+        generator = mt19937(seed);
+
+        order = vector<uint>(images.size());
+        for (size_t i = 0; i < images.size(); i++)
+            order[i] = i;
+
+        cout << "[i] VP-tree started building over " << images.size() << " images." << endl;
+        vector<pair<double, uint>> scratch;
+        Build(0, images.size(), scratch);
+        cout << "[i] VP-tree finished building, " << nodes.size() << " nodes." << endl;
+    }
+
+    // Get the exact {no_neighbours} nearest images of the query as (distance, index) pairs, nearest first.
+    // The number of distance evaluations that the search needed is added to {evaluations}.
+    vector<pair<double, uint>> Search(const IMAGE_DATA &query, int no_neighbours, size_t &evaluations) const
+    {
+        NearestHeap nearest = {no_neighbours, priority_queue<pair<double, uint>>()};
+        if (!images.empty() && no_neighbours > 0)
+            Search(0, query, nearest, evaluations);
+
+        vector<pair<double, uint>> result(nearest.heap.size());
+        for (int i = (int)nearest.heap.size() - 1; i >= 0; i--)
+        {
+            result[i] = nearest.heap.top();
+            nearest.heap.pop();
+        }
+
+        return result;
+    }
+
+    // Find the exact {no_neighbours} nearest images of the query, the same ones as BRUTE, into the context's nearest neighbors.
+    void Search(const IMAGE_DATA &query, int no_neighbours, QueryContext &context) const
+    {
+        size_t evaluations = 0;
+        NearestContext nearest = {context};
+        context.Reset(no_neighbours, 0);
+        if (!images.empty() && no_neighbours > 0)
+            Search(0, query, nearest, evaluations);
+    }
+
+    // Find the exact {no_neighbours} "Nearest Neighbors" vectors of the queried one, the same ones as BRUTE.
+    set<MNIST_Image, MNIST_ImageComparator> FindNearestNeighbors(int no_neighbours, MNIST_Image query_image) const
+    {
+        QueryContext &context = ThreadQueryContext();
+        Search(query_image.GetImageData(), no_neighbours, context);
+
+        return context.GetNearestSet(images);
+    }
+
+    // Find every image inside the given radius of the query, into the context's nearest neighbors.
+    void RadiusSearch(const IMAGE_DATA &query, int radius, QueryContext &context) const
+    {
+        size_t evaluations = 0;
+        InsideRadius inside = {(double)radius, context};
+        context.Reset(0, 0);
+        if (!images.empty())
+            Search(0, query, inside, evaluations);
+
+        context.FinishCollecting();
+    }
+
+    // Find every vector inside the given radius of the queried one.
+    set<MNIST_Image, MNIST_ImageComparator> RadiusSearch(MNIST_Image query_image, int radius) const
+    {
+        QueryContext &context = ThreadQueryContext();
+        RadiusSearch(query_image.GetImageData(), radius, context);
+
+        return context.GetNearestSet(images);
+    }
+
+    // Get the bytes that the tree holds besides the images: its nodes and the order of the images.
+    size_t GetMemoryBytes() const { return HeapBytes(order) + HeapBytes(nodes); }
+
+    // Get the number of images of the tree.
+    size_t GetSize() const { return images.size(); }
+};
+
+#endif // VPTREE_H
@@ -1,13 +1,17 @@
 #include <cstdlib>
 #include <string>
 #include <iostream>
+#include <random>
+#include <thread>
 
 #define RYML_SINGLE_HDR_DEFINE_NOW
 
 #include "argh.h"
 #include "cluster.h"
 #include "mnist.h"
+#include "projection.h"
 #include "rapidyaml.h"
+#include "stream.h"
 
 using namespace std;
 
@@ -31,10 +35,43 @@ Options:
         - lloyd: Use Lloyd's assignment algorithm (default).
         - lsh: Use LSH (Locality-Sensitive Hashing) assignment algorithm.
         - hypercube: Use the Hypercube assignment algorithm.
+        - elkan: Use Lloyd's algorithm accelerated with Elkan's triangle inequality bounds.
+        - hamerly: Use Lloyd's algorithm accelerated with Hamerly's triangle inequality bounds.
+        - minibatch: Use mini-batch k-means, updating the centers from random batches of points.
 
     -c, --configuration <configuration_file>
         Path to a configuration file.
 
+    -t, --threads <t>
+        Number of threads used by Lloyd's assignment (default: all cores).
+
+    -b, --batch-size <b>
+        Number of points sampled per mini-batch iteration (default: 1024).
+
+    --holdout <h>
+        Number of points kept aside to track the mini-batch inertia (default: 1000).
+
+    --silhouette-sample <n>
+        Number of random points per cluster whose silhouette is computed, reported
+        with 95% confidence bounds; 0 computes it exactly for every point (default: 100).
+
+    --stream
+        Stream the input file block by block instead of loading it, for inputs larger
+        than the memory. Only the lloyd method is supported, without silhouette.
+
+    --block-size <b>
+        Number of images per streamed block (default: 16384).
+
+    --seed <s>
+        Seed of the k-Means|| initialization and of the mini-batches (default: random).
+
+    --reduce <pca|rp>
+        Cluster the vectors reduced with PCA or sparse random projection, the
+        assignments and the silhouette are computed in the reduced space (default: off).
+
+    --components <d>
+        Number of components the vectors are reduced to (default: 64).
+
 Positional Arguments:
     -i, --input <input_file>
         Path to the MNIST dataset file.
@@ -46,9 +83,12 @@ Example Usage:
     cluster -m lloyd -i <input_file> -o <output_file> -c cluster.conf
     cluster -m lsh -i <input_file> -o <output_file> -c cluster.conf
     cluster -m hypercube -i <input_file> -o <output_file> -c cluster.conf
+    cluster -m elkan -i <input_file> -o <output_file> -c cluster.conf
+    cluster -m minibatch -b 2048 -i <input_file> -o <output_file> -c cluster.conf
 
 Note:
-    - The MNIST dataset file should contain the MNIST images.
+    - The dataset file can be MNIST idx3, fvecs, bvecs, ivecs or raw float32/uint8
+      (.f32/.u8), the format is detected from the file.
     - The tool will perform k-Means clustering on the MNIST dataset based on the
       provided configuration and save the clustered images in the specified output file.
 
@@ -93,6 +133,15 @@ int main(int argc, char *argv[])
     int no_max_hypercubes; // Number of Hypercubes for CUBE.
     int no_dim_hypercubes; // Number of Dimensions for CUBE.
     int no_probes;         // Number of Probes for CUBE.
+    int no_threads;        // Number of threads used by Lloyd's assignment.
+    int batch_size;        // Number of points per mini-batch.
+    int holdout_size;      // Number of points kept aside to track the mini-batch inertia.
+    unsigned int seed;     // Seed of the initialization and of the mini-batches.
+    int silhouette_sample; // Number of points per cluster whose silhouette is computed.
+    bool stream;           // Stream the input file instead of loading it.
+    size_t block_size;     // Number of images per streamed block.
+    string reduce;         // Dimensionality reduction method, empty for none.
+    int no_components;     // Number of components the vectors are reduced to.
 
     // Parse the command line arguments using the argh.h functionality.
     argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
@@ -101,6 +150,15 @@ int main(int argc, char *argv[])
     cmdl({"-c", "--configuration"}) >> conf_file;
     cmdl({"-m", "--method"}) >> method;
     cmdl({"-c", "--complete"}) >> complete;
+    cmdl({"-t", "--threads"}, max(thread::hardware_concurrency(), 1u)) >> no_threads;
+    cmdl({"-b", "--batch-size"}, MINIBATCH_SIZE) >> batch_size;
+    cmdl({"--holdout"}, MINIBATCH_HOLDOUT) >> holdout_size;
+    cmdl({"--seed"}, random_device()()) >> seed;
+    cmdl({"--silhouette-sample"}, SILHOUETTE_SAMPLE) >> silhouette_sample;
+    cmdl({"--block-size"}, STREAM_BLOCK) >> block_size;
+    cmdl({"--reduce"}) >> reduce;
+    cmdl({"--components"}, PROJECTION_COMPONENTS) >> no_components;
+    stream = cmdl[{"--stream"}];
 
     if (cmdl({"-h", "--help"}) || input_file.empty() || output_file.empty())
     {
@@ -118,14 +176,42 @@ int main(int argc, char *argv[])
     tree["number_of_hypercube_dimensions"] >> no_dim_hypercubes;
     tree["number_of_probes"] >> no_probes;
 
-    MNIST input = MNIST(input_file);
-    Cluster cluster = Cluster(no_clusters, no_hash_tables, no_hash_functions, no_max_hypercubes, no_dim_hypercubes, no_probes, input, method);
+    stringstream results;
+    if (stream)
+    {
+        if (!method.empty() && method != "lloyd")
+        {
+            cout << "Only the lloyd method can stream the input file." << endl;
+            return EXIT_FAILURE;
+        }
+        if (!reduce.empty())
+        {
+            cout << "The streamed input file cannot be reduced." << endl;
+            return EXIT_FAILURE;
+        }
+
+        MNIST_Stream input(input_file, block_size);
+        StreamingCluster cluster(no_clusters, input, no_threads, seed);
+        results << cluster.getResults().rdbuf();
+    }
+    else
+    {
+        MNIST input = MNIST(input_file);
+        // Reduce the dataset once, the clustering then runs over the reduced vectors.
+        if (!reduce.empty())
+        {
+            input = Projection(input, reduce, no_components, seed).Transform(input);
+        }
+        Cluster cluster = Cluster(no_clusters, no_hash_tables, no_hash_functions, no_max_hypercubes, no_dim_hypercubes, no_probes, input, method, no_threads, batch_size, holdout_size, seed);
+        cluster.SetSilhouetteSample(silhouette_sample);
+        results << cluster.getResults().rdbuf();
+    }
 
     // Print results in output file.
     ofstream output(output_file, ios::out | ios::trunc);
     if (output.is_open())
     {
-        output << cluster.getResults().rdbuf();
+        output << results.rdbuf();
 
         output.close();
     }
@@ -5,9 +5,14 @@
 
 #include "argh.h"
 #include "brute.h"
+#include "groundtruth.h"
 #include "mnist.h"
 #include "cube.h"
 #include "misc.h"
+#include "pq.h"
+#include "projection.h"
+#include "stats.h"
+#include "timing.h"
 
 #define N_DEFAULT 1
 #define R_DEFAULT 10000
@@ -34,6 +39,14 @@ Options:
 -M, --max-candidates <M>     Max allowed number of edges of the hypercube.
 -p  --probes                 
 -k, --dimensions
+--groundtruth <gt_file>      Ground truth file created by the groundtruth tool, replaces Brute Force.
+--pq <m>                     Score the candidates with a PQ codec of m subspaces, m must divide the dimension (default: 0, off).
+--rerank <r>                 Number of best PQ scoring candidates reranked exactly (default: 100).
+--reduce <pca|rp>            Reduce the vectors with PCA or sparse random projection before indexing them (default: off).
+--components <d>             Number of components the vectors are reduced to (default: 64).
+--rerank-original <r>        Search r neighbors in the reduced space and rerank them in the original one (default: N),
+                             the distances reported are always the ones in the original space.
+--seed <seed>                Seed of the projections and of the reduction (default: random).
 
 Description:
 This command line tool implements the Hypercube algorithm for vectors in d-space.
@@ -43,7 +56,8 @@ Example Usage:
 cube -i data/train-images.idx3-ubyte -q data/t10k-images.idx3-ubyte -o results.txt -M 10 -p 10 -k 14
 
 Note:
-The input and query files should be in the MNIST format with vector data.
+The input and query files can be MNIST idx3, fvecs, bvecs, ivecs or raw float32/uint8 (.f32/.u8) files,
+the format is detected from the file.
 )""";
 #pragma endregion
 
@@ -57,6 +71,13 @@ int main(int argc, char *argv[])
     int candidates;     // Max number of candinates.
     int probes;
     int dimensions;
+    string groundtruth_file; // Ground truth file that replaces Brute Force.
+    int no_subspaces;        // Number of PQ subspaces, 0 disables PQ.
+    int rerank;              // Number of best PQ scoring candidates reranked exactly.
+    string reduce;           // Dimensionality reduction method, empty for none.
+    int no_components;       // Number of components the vectors are reduced to.
+    int rerank_original;     // Number of reduced space neighbors reranked in the original space, at least N.
+    unsigned int seed;       // Seed of the projections and of the reduction.
 
     // Parse the command line arguments using the argh.h functionality.
     argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
@@ -68,6 +89,13 @@ int main(int argc, char *argv[])
     cmdl({"-M", "--candidates"}, M_DEFAULT) >> candidates;
     cmdl({"-probes", "--probes"}, PROBES_DEFAULT) >> probes;
     cmdl({"-k, --dimensions"}, DIMENSIONS_DEFAULT) >> dimensions;
+    cmdl({"--groundtruth"}) >> groundtruth_file;
+    cmdl({"--pq"}, 0) >> no_subspaces;
+    cmdl({"--rerank"}, PQ_RERANK) >> rerank;
+    cmdl({"--reduce"}) >> reduce;
+    cmdl({"--components"}, PROJECTION_COMPONENTS) >> no_components;
+    cmdl({"--rerank-original"}, 0) >> rerank_original;
+    cmdl({"--seed"}, random_device()()) >> seed;
 
     // In the following cases, print the help message.
     if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty())
@@ -79,14 +107,50 @@ int main(int argc, char *argv[])
     // Create the required class instances.
     MNIST input = MNIST(input_file);
     MNIST query = MNIST(query_file);
-    Hypercube hypercube = Hypercube(input, dimensions, candidates, probes);
-    BRUTE bf = BRUTE(input);
+    bool use_groundtruth = !groundtruth_file.empty();
+    BRUTE bf = BRUTE(use_groundtruth ? MNIST() : input);
+    GroundTruth ground_truth;
+    vector<MNIST_Image> input_images;
+    if (use_groundtruth)
+    {
+        ground_truth.Load(groundtruth_file, input, query);
+        input_images = input.GetImages();
+    }
+    if (use_groundtruth && ground_truth.GetK() < no_nearest)
+    {
+        cout << "[!] The ground truth holds " << ground_truth.GetK() << " neighbors per query, fewer than the " << no_nearest << " searched." << endl;
+        return EXIT_FAILURE;
+    }
+    // Reduce the dataset and the queries once, the Hypercube then hashes and compares the reduced vectors.
+    MNIST reduced_input, reduced_query;
+    vector<MNIST_Image> original_images;
+    if (!reduce.empty())
+    {
+        Projection projection = Projection(input, reduce, no_components, seed);
+        reduced_input = projection.Transform(input);
+        reduced_query = projection.Transform(query);
+        original_images = input.GetImages();
+    }
+    MNIST &search_input = reduce.empty() ? input : reduced_input;
+    vector<MNIST_Image> search_queries = (reduce.empty() ? query : reduced_query).GetImages();
+    Hypercube hypercube = Hypercube(search_input, dimensions, candidates, probes, seed);
+    // Train the PQ codec on the dataset, its codes replace the exact distances of the candidates.
+    PQ pq;
+    if (no_subspaces > 0)
+    {
+        pq = PQ(search_input, no_subspaces, rerank, max(thread::hardware_concurrency(), 1u));
+        hypercube.SetPQ(&pq);
+    }
     ofstream output(output_file, ios::out | ios::trunc);
-    clock_t start, end;
+    Stopwatch stopwatch;
+    uint64_t elapsed_ns;
     double time;
     double time_aprox_sum = 0;
     double time_brute_sum = 0;
+    LatencyHistogram approximate_latencies, brute_latencies; // The per-query wall-clock latencies.
     double max_maf = 0;
+    // The per-query search counters, only recorded when built with SEARCH_STATS.
+    StatsCollector hypercube_stats("Hypercube"), brute_stats("BRUTE");
 
     // Print results in output file.
     if (output.is_open())
@@ -99,22 +163,44 @@ int main(int argc, char *argv[])
         {
             output << "====================================================================================" << endl;
             output << "Query: " << query_image.GetIndex() << endl;
+            MNIST_Image search_image = search_queries[query_image.GetIndex()];
 
             // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Locality-Sensitive Hashing.
-            start = clock();
-            set<MNIST_Image, MNIST_ImageComparator> hypercube_nn = hypercube.FindNearestNeighbors(no_nearest, query_image);
-            end = clock();
-            time = double(end - start) / CLOCKS_PER_SEC;
+            stopwatch.Restart();
+            set<MNIST_Image, MNIST_ImageComparator> hypercube_nn;
+            if (!reduce.empty())
+            {
+                hypercube_nn = hypercube.FindNearestNeighbors(max(rerank_original, no_nearest), search_image);
+                hypercube_nn = RerankOriginal(hypercube_nn, query_image.GetImageData(), original_images, no_nearest);
+            }
+            else
+            {
+                hypercube_nn = hypercube.FindNearestNeighbors(no_nearest, search_image);
+            }
+            elapsed_ns = stopwatch.ElapsedNanoseconds();
+            hypercube_stats.Add(ThreadQueryContext().stats);
+            time = elapsed_ns / 1e9;
             time_aprox_sum += time;
+            approximate_latencies.Record(elapsed_ns);
             output << "timeCUBE: " << time << "s" << endl;
 
-            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Brute Force.
-            start = clock();
-            set<MNIST_Image, MNIST_ImageComparator> lsh_nn_brute = bf.FindNearestNeighbors(no_nearest, query_image);
-            end = clock();
-            time = double(end - start) / CLOCKS_PER_SEC;
-            time_brute_sum += time;
-            output << "timeBRUTE:  " << time << "s" << endl;
+            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using the ground truth or Brute Force.
+            set<MNIST_Image, MNIST_ImageComparator> lsh_nn_brute;
+            if (use_groundtruth)
+            {
+                lsh_nn_brute = ground_truth.FindNearestNeighbors(no_nearest, query_image.GetIndex(), input_images);
+            }
+            else
+            {
+                stopwatch.Restart();
+                lsh_nn_brute = bf.FindNearestNeighbors(no_nearest, query_image);
+                elapsed_ns = stopwatch.ElapsedNanoseconds();
+                brute_stats.Add(ThreadQueryContext().stats);
+                time = elapsed_ns / 1e9;
+                time_brute_sum += time;
+                brute_latencies.Record(elapsed_ns);
+                output << "timeBRUTE:  " << time << "s" << endl;
+            }
 
             // Print Comparison Stats between LSH and Brute Force.
             int i = 1;
@@ -139,7 +225,7 @@ int main(int argc, char *argv[])
             }
 
             // Find the Neighbors inside the radius.
-            set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = hypercube.RadiusSearch(query_image, radius);
+            set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = hypercube.RadiusSearch(search_image, radius);
             output << "Radius: " << radius << endl;
             for (set<MNIST_Image, MNIST_ImageComparator>::iterator it = neighbors_in_radius.begin(); it != neighbors_in_radius.end(); ++it)
             {
@@ -153,9 +239,28 @@ int main(int argc, char *argv[])
              << "[i] Finished Calculating Results" << endl;
         output << "===" << endl;
         output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
-        output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+        if (!use_groundtruth)
+            output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+        approximate_latencies.WriteSummary(output, "Approximate");
+        if (!use_groundtruth)
+            brute_latencies.WriteSummary(output, "Brute");
         output << "MAF: " << max_maf << endl;
         output.close();
+
+        // Dump the latency percentiles next to the results file
+        vector<pair<string, const LatencyHistogram *>> latencies = {{"Hypercube", &approximate_latencies}};
+        if (!use_groundtruth)
+            latencies.push_back({"BRUTE", &brute_latencies});
+        WriteLatencies(output_file + ".latency.json", latencies);
+
+        // Dump the search counters next to the results file
+        if (SearchStatsEnabled())
+        {
+            vector<const StatsCollector *> collectors = {&hypercube_stats};
+            if (!use_groundtruth)
+                collectors.push_back(&brute_stats);
+            WriteSearchStats(output_file + ".stats.json", collectors);
+        }
     }
     else
     {
@@ -5,24 +5,195 @@
 
 #include "argh.h"
 #include "gnns.h"
+#include "hnsw.h"
 #include "mrng.h"
 #include "mnist.h"
 #include "brute.h"
+#include "groundtruth.h"
 #include "misc.h"
+#include "pq.h"
+#include "projection.h"
+#include "stats.h"
+#include "timing.h"
 
 #define K_DEFAULT 50
 #define E_DEFAULT 30
 #define N_DEFAULT 1
 #define R_DEFAULT 1
 #define l_DEFAULT 20
+#define D_DEFAULT (2 * K_DEFAULT)
+#define S_DEFAULT 0
+#define M_DEFAULT 16
+#define EF_CONSTRUCTION_DEFAULT 200
+#define EF_SEARCH_DEFAULT 50
 
 using namespace std;
 
 #pragma region HELP_MESSAGE
 const char *help_msg = R"""(
+Graph Search Algorithms for Vectors in d-Space
+
+Usage:
+graph_search [options]
+
+Options:
+-h, --help                      Print the help message.
+-i, --input <input_file>        Input MNIST format file containing data vectors.
+-q, --query <query_file>        Query MNIST format file for nearest neighbor search.
+-o, --output <output_file>      Output file to store the results.
+-m, --mode <mode>               Mode (1 for GNNS, 2 for MRNG, 3 for HNSW).
+-k, --num-neighbors <k>         Number of LSH nearest neighbors to use (default: 50).
+-E, --num-expansions <E>        Number of expansions to use (default: 30).
+-R, --num-restarts <R>          Number of random restarts (default: 1).
+-N, --num-nearest <N>           Number of nearest points to search for (default: 1).
+-l, --num-candidates <l>        Number of candidates, only for MRNG (default: 20).
+--reverse-edges                 Add the reverse LSH edges to the GNNS graph.
+-D, --max-degree <D>            Max degree of a GNNS node when adding reverse and connecting edges (default: 100).
+-S, --long-range <S>            Number of random long-range edges per GNNS node (default: 0).
+                                The search expands up to E LSH edges of a GNNS node and all of its added edges.
+--seed <seed>                   Seed of the GNNS graph, of the HNSW levels and of the reduction (default: random).
+-M, --max-connections <M>       Max neighbors of an HNSW node per layer, 2M on the base layer (default: 16).
+--ef-construction <ef>          Size of the HNSW candidate list while building (default: 200).
+--ef-search <ef>                Size of the HNSW candidate list while searching (default: 50).
+-t, --threads <t>               Number of threads used to build the HNSW graph (default: all cores).
+--save-index <index_file>       Save the built HNSW graph to a file.
+--load-index <index_file>       Load the HNSW graph from a file instead of building it.
+--groundtruth <gt_file>         Ground truth file created by the groundtruth tool, replaces Brute Force.
+--pq <m>                        Navigate GNNS/MRNG with a PQ codec of m subspaces, m must divide the dimension (default: 0, off).
+--rerank <r>                    Number of best PQ scoring visited nodes reranked exactly (default: 100).
+--reduce <pca|rp>               Reduce the vectors with PCA or sparse random projection before indexing them (default: off).
+--components <d>                Number of components the vectors are reduced to (default: 64).
+--rerank-original <r>           Search r neighbors in the reduced space and rerank them in the original one (default: N),
+                                the distances reported are always the ones in the original space.
+
+Example Usage:
+graph_search -i data/input.1K.dat -q data/query.1K.dat -o output/output_gnns.txt -m 1 -R 5 -N 2 --reverse-edges -D 60 -S 2
+graph_search -i data/input.1K.dat -q data/query.1K.dat -o output/output_hnsw.txt -m 3 -M 16 --ef-search 50 -N 2
 )""";
 #pragma endregion
 
+// Answer every query with the given graph search and print the comparison against the exact neighbors in the output file.
+// The exact neighbors come from the ground truth when one is given, else from Brute Force.
+// The graph is searched with {search_queries}, the reduced queries when the vectors are reduced, and then {rerank_original}
+// neighbors are reranked with their distances in the original space, so that they compare to the exact ones. It is 0 otherwise.
+// The latency percentiles are dumped to {output_file}.latency.json, and when built with SEARCH_STATS
+// the search counters to {output_file}.stats.json.
+template <typename GraphSearch>
+void WriteResults(ofstream &output, const string &name, GraphSearch &graph_search, MNIST &input, MNIST &query, const vector<MNIST_Image> &search_queries,
+                  int rerank_original, BRUTE &bf, GroundTruth *ground_truth, int no_nearest, const string &output_file)
+{
+    vector<MNIST_Image> input_images;
+    if (ground_truth != nullptr || rerank_original > 0)
+        input_images = input.GetImages();
+
+    Stopwatch stopwatch;
+    uint64_t elapsed_ns;
+    double time;
+    double time_aprox_sum = 0;
+    double time_brute_sum = 0;
+    LatencyHistogram approximate_latencies, brute_latencies; // The per-query wall-clock latencies.
+    double max_maf = 0;
+    StatsCollector graph_stats(name), brute_stats("BRUTE");
+
+    output << name << " Results" << endl;
+    cout << "[i] Calculating Results" << endl;
+    printProgress(0.0);
+
+    for (auto query_image : query.GetImages())
+    {
+        const MNIST_Image &search_image = search_queries[query_image.GetIndex()];
+
+        stopwatch.Restart();
+        set<MNIST_Image, MNIST_ImageComparator> nn;
+        if (rerank_original > 0)
+        {
+            nn = graph_search.FindNearestNeighbors(max(rerank_original, no_nearest), search_image);
+            nn = RerankOriginal(nn, query_image.GetImageData(), input_images, no_nearest);
+        }
+        else
+        {
+            nn = graph_search.FindNearestNeighbors(no_nearest, search_image);
+        }
+        elapsed_ns = stopwatch.ElapsedNanoseconds();
+        graph_stats.Add(ThreadQueryContext().stats);
+        time = elapsed_ns / 1e9;
+        time_aprox_sum += time;
+        approximate_latencies.Record(elapsed_ns);
+
+        output << "===" << endl;
+        output << "Query: " << query_image.GetIndex() << endl;
+        output << "time" << name << ": " << time << "s" << endl;
+
+        // Print Brute
+        set<MNIST_Image, MNIST_ImageComparator> brute_nn;
+        if (ground_truth != nullptr)
+        {
+            brute_nn = ground_truth->FindNearestNeighbors(no_nearest, query_image.GetIndex(), input_images);
+        }
+        else
+        {
+            stopwatch.Restart();
+            brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
+            elapsed_ns = stopwatch.ElapsedNanoseconds();
+            brute_stats.Add(ThreadQueryContext().stats);
+            time = elapsed_ns / 1e9;
+            time_brute_sum += time;
+            brute_latencies.Record(elapsed_ns);
+            output << "timeBRUTE: " << time << "s" << endl;
+        }
+
+        // Print Comparison Stats between the graph search and Brute Force.
+        int i = 1;
+        for (auto it1 = nn.begin(), it2 = brute_nn.begin();
+             (it1 != nn.end()) && (it2 != brute_nn.end());
+             it1++, it2++)
+        {
+            MNIST_Image neighbor_approx = *it1;
+            MNIST_Image neighbor_brute = *it2;
+
+            // calc maf
+            if (i == 1)
+            {
+                double maf = static_cast<double>(neighbor_approx.GetDist()) / static_cast<double>(neighbor_brute.GetDist());
+                if (maf > max_maf)
+                    max_maf = maf;
+            }
+
+            output << "NN-" << i << " Index: " << neighbor_approx.GetIndex() << endl;
+            output << "distance" << name << ": " << neighbor_approx.GetDist() << endl;
+            output << "distanceBRUTE: " << neighbor_brute.GetDist() << endl;
+            i++;
+        }
+
+        printProgress(static_cast<double>(query_image.GetIndex()) / query.GetImages().size());
+    }
+
+    printProgress(1.0);
+    cout << endl
+         << "[i] Finished Calculating Results" << endl;
+    output << "===" << endl;
+    output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
+    if (ground_truth == nullptr)
+        output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+    approximate_latencies.WriteSummary(output, "Approximate");
+    if (ground_truth == nullptr)
+        brute_latencies.WriteSummary(output, "Brute");
+    output << "MAF: " << max_maf << endl;
+
+    vector<pair<string, const LatencyHistogram *>> latencies = {{name, &approximate_latencies}};
+    if (ground_truth == nullptr)
+        latencies.push_back({"BRUTE", &brute_latencies});
+    WriteLatencies(output_file + ".latency.json", latencies);
+
+    if (SearchStatsEnabled())
+    {
+        vector<const StatsCollector *> collectors = {&graph_stats};
+        if (ground_truth == nullptr)
+            collectors.push_back(&brute_stats);
+        WriteSearchStats(output_file + ".stats.json", collectors);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     string input_file;  // Input MNIST format file containing data vectors.
@@ -34,6 +205,22 @@ int main(int argc, char *argv[])
     int no_restarts;    // Number of random restarts (default: 1).
     int no_candidates;  // Number of candidates, only for MRNG (default: 20).
     int mode;           // Mode (1 for GNNS, 2 for MRNG).
+    bool reverse_edges; // Add the reverse LSH edges to the GNNS graph.
+    int max_degree;     // Max degree of a GNNS node when adding reverse edges (default: 100).
+    int no_long_range;  // Number of long-range edges per GNNS node (default: 0).
+    unsigned int seed;  // Seed of the GNNS graph, of the HNSW levels and of the reduction.
+    int max_connections; // Max neighbors of an HNSW node per layer (default: 16).
+    int ef_construction; // Size of the HNSW candidate list while building (default: 200).
+    int ef_search;       // Size of the HNSW candidate list while searching (default: 50).
+    int no_threads;      // Number of threads used to build the HNSW graph.
+    string save_index;   // File to save the HNSW graph to.
+    string load_index;   // File to load the HNSW graph from.
+    string groundtruth_file; // Ground truth file that replaces Brute Force.
+    int no_subspaces;        // Number of PQ subspaces, 0 disables PQ.
+    int rerank;              // Number of best PQ scoring visited nodes reranked exactly.
+    string reduce;           // Dimensionality reduction method, empty for none.
+    int no_components;       // Number of components the vectors are reduced to.
+    int rerank_original;     // Number of reduced space neighbors reranked in the original space, at least N.
 
     // Parse the command line arguments using the argh.h functionality.
     argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
@@ -46,6 +233,22 @@ int main(int argc, char *argv[])
     cmdl({"-R", "--num-restarts"}, R_DEFAULT) >> no_restarts;
     cmdl({"-l", "--num-candidates"}, l_DEFAULT) >> no_candidates;
     cmdl({"-m", "--mode"}, 1) >> mode;
+    cmdl({"-D", "--max-degree"}, D_DEFAULT) >> max_degree;
+    cmdl({"-S", "--long-range"}, S_DEFAULT) >> no_long_range;
+    reverse_edges = cmdl[{"--reverse-edges"}];
+    cmdl({"--seed"}, random_device()()) >> seed;
+    cmdl({"-M", "--max-connections"}, M_DEFAULT) >> max_connections;
+    cmdl({"--ef-construction"}, EF_CONSTRUCTION_DEFAULT) >> ef_construction;
+    cmdl({"--ef-search"}, EF_SEARCH_DEFAULT) >> ef_search;
+    cmdl({"-t", "--threads"}, max(thread::hardware_concurrency(), 1u)) >> no_threads;
+    cmdl({"--save-index"}) >> save_index;
+    cmdl({"--load-index"}) >> load_index;
+    cmdl({"--groundtruth"}) >> groundtruth_file;
+    cmdl({"--pq"}, 0) >> no_subspaces;
+    cmdl({"--rerank"}, PQ_RERANK) >> rerank;
+    cmdl({"--reduce"}) >> reduce;
+    cmdl({"--components"}, PROJECTION_COMPONENTS) >> no_components;
+    cmdl({"--rerank-original"}, 0) >> rerank_original;
 
     // Debug CMD arguments.
     // cout << "DEBUG: input             = " << input_file << endl;
@@ -59,150 +262,86 @@ int main(int argc, char *argv[])
     // cout << "DEBUG: mode              = " << mode << endl;
 
     // In the following cases, print the help message.
-    if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty())
+    if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty() || mode < 1 || mode > 3)
     {
         cout << help_msg << endl;
         return EXIT_FAILURE;
     }
+    if (no_subspaces > 0 && mode == 3)
+    {
+        cout << "[!] HNSW does not support --pq, only GNNS and MRNG do." << endl;
+        return EXIT_FAILURE;
+    }
 
     // Create the required class instances.
     MNIST input = MNIST(input_file);
     MNIST query = MNIST(query_file);
-    BRUTE bf = BRUTE(input);
-    set<MNIST_Image, MNIST_ImageComparator> nn;
+    bool use_groundtruth = !groundtruth_file.empty();
+    BRUTE bf = BRUTE(use_groundtruth ? MNIST() : input);
+    GroundTruth ground_truth;
+    if (use_groundtruth)
+        ground_truth.Load(groundtruth_file, input, query);
+    if (use_groundtruth && ground_truth.GetK() < no_nearest)
+    {
+        cout << "[!] The ground truth holds " << ground_truth.GetK() << " neighbors per query, fewer than the " << no_nearest << " searched." << endl;
+        return EXIT_FAILURE;
+    }
+    // Reduce the dataset and the queries once, the graphs are then built and searched over the reduced vectors.
+    MNIST reduced_input, reduced_query;
+    if (!reduce.empty())
+    {
+        Projection projection = Projection(input, reduce, no_components, seed);
+        reduced_input = projection.Transform(input);
+        reduced_query = projection.Transform(query);
+        // The neighbors are always measured in the original space, like the exact ones they are compared with
+        rerank_original = max(rerank_original, no_nearest);
+    }
+    else
+    {
+        rerank_original = 0;
+    }
+    MNIST &search_input = reduce.empty() ? input : reduced_input;
+    vector<MNIST_Image> search_queries = (reduce.empty() ? query : reduced_query).GetImages();
+    PQ pq;
+    if (no_subspaces > 0)
+        pq = PQ(search_input, no_subspaces, rerank, no_threads);
     ofstream output(output_file, ios::out | ios::trunc);
-    clock_t start, end;
-    double time;
-    double time_aprox_sum = 0;
-    double time_brute_sum = 0;
-    double max_maf = 0;
 
     // Print results in output file.
     if (output.is_open())
     {
         if (mode == 1)
         {
-            output << "GNNS Results" << endl;
-            auto gnns = GNNS(input, no_neighbors, no_expansions, no_restarts);
+            auto gnns = GNNS(search_input, no_neighbors, no_expansions, no_restarts, seed);
+            gnns.SetAugmentation(reverse_edges, max_degree, no_long_range);
             gnns.Initialization();
-            cout << "[i] Calculating Results" << endl;
-            printProgress(0.0);
-            for (auto query_image : query.GetImages())
-            {
-                start = clock();
-                nn = gnns.FindNearestNeighbors(no_nearest, query_image);
-                end = clock();
-                time = double(end - start) / CLOCKS_PER_SEC;
-                time_aprox_sum += time;
-
-                output << "===" << endl;
-                output << "Query: " << query_image.GetIndex() << endl;
-                output << "timeGNNS: " << time << "s" << endl;
-
-                // Print Brute
-                start = clock();
-                set<MNIST_Image, MNIST_ImageComparator> brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
-                end = clock();
-                time = double(end - start) / CLOCKS_PER_SEC;
-                time_brute_sum += time;
-                output << "timeBRUTE: " << time << "s" << endl;
-
-                // Print Comparison Stats between LSH and Brute Force.
-                int i = 1;
-                for (auto it1 = nn.begin(), it2 = brute_nn.begin();
-                     (it1 != nn.end()) && (it2 != brute_nn.end());
-                     it1++, it2++)
-                {
-                    MNIST_Image neighbor_approx = *it1;
-                    MNIST_Image neighbor_brute = *it2;
-
-                    // calc maf
-                    if (i == 1)
-                    {
-                        double maf = static_cast<double>(neighbor_approx.GetDist()) / static_cast<double>(neighbor_brute.GetDist());
-                        if (maf > max_maf)
-                            max_maf = maf;
-                    }
-
-                    output << "NN-" << i << " Index: " << neighbor_approx.GetIndex() << endl;
-                    output << "distanceGNNS: " << neighbor_approx.GetDist() << endl;
-                    output << "distanceMRNG: " << neighbor_brute.GetDist() << endl;
-                    i++;
-                }
-
-                printProgress(static_cast<double>(query_image.GetIndex()) / query.GetImages().size());
-            }
-            printProgress(1.0);
-            cout << endl
-                 << "[i] Finished Calculating Results" << endl;
-            output << "===" << endl;
-            output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
-            output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
-            output << "MAF: " << max_maf << endl;
-            output.close();
+            if (no_subspaces > 0)
+                gnns.SetPQ(&pq);
+            WriteResults(output, "GNNS", gnns, input, query, search_queries, rerank_original, bf, use_groundtruth ? &ground_truth : nullptr, no_nearest, output_file);
         }
-        else
+        else if (mode == 2)
         {
-            output << "MRNG Results" << endl;
-            auto mrng = MRNG(input, no_candidates);
+            auto mrng = MRNG(search_input, no_candidates);
             mrng.Initialization();
-            cout << "[i] Calculating Results" << endl;
-            printProgress(0.0);
+            if (no_subspaces > 0)
+                mrng.SetPQ(&pq);
+            WriteResults(output, "MRNG", mrng, input, query, search_queries, rerank_original, bf, use_groundtruth ? &ground_truth : nullptr, no_nearest, output_file);
+        }
+        else if (mode == 3)
+        {
+            auto hnsw = HNSW(search_input, max_connections, ef_construction, ef_search, no_threads, seed);
+            if (!load_index.empty())
+                hnsw.Load(load_index);
+            else
+                hnsw.Initialization();
 
-            for (auto query_image : query.GetImages())
-            {
-                start = clock();
-                nn = mrng.FindNearestNeighbors(no_nearest, query_image);
-                end = clock();
-                time = double(end - start) / CLOCKS_PER_SEC;
-                time_aprox_sum += time;
-
-                output << "===" << endl;
-                output << "Query: " << query_image.GetIndex() << endl;
-                output << "timeMRNG: " << time << "s" << endl;
-
-                // Print Brute
-                start = clock();
-                set<MNIST_Image, MNIST_ImageComparator> brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
-                end = clock();
-                time = double(end - start) / CLOCKS_PER_SEC;
-                time_brute_sum += time;
-                output << "timeBRUTE: " << time << "s" << endl;
-
-                // Print Comparison Stats between LSH and Brute Force.
-                int i = 1;
-                for (auto it1 = nn.begin(), it2 = brute_nn.begin();
-                     (it1 != nn.end()) && (it2 != brute_nn.end());
-                     it1++, it2++)
-                {
-                    MNIST_Image neighbor_approx = *it1;
-                    MNIST_Image neighbor_brute = *it2;
-
-                    // calc maf
-                    if (i == 1)
-                    {
-                        double maf = static_cast<double>(neighbor_approx.GetDist()) / static_cast<double>(neighbor_brute.GetDist());
-                        if (maf > max_maf)
-                            max_maf = maf;
-                    }
-
-                    output << "NN-" << i << " Index: " << neighbor_approx.GetIndex() << endl;
-                    output << "distanceMRNG: " << neighbor_approx.GetDist() << endl;
-                    output << "distanceBRUTE: " << neighbor_brute.GetDist() << endl;
-                    i++;
-                }
-
-                printProgress(static_cast<double>(query_image.GetIndex()) / query.GetImages().size());
-            }
-            printProgress(1.0);
-            cout << endl
-                 << "[i] Finished Calculating Results" << endl;
-            output << "===" << endl;
-            output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
-            output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
-            output << "MAF: " << max_maf << endl;
-            output.close();
+            if (!save_index.empty())
+                hnsw.Save(save_index);
+
+            WriteResults(output, "HNSW", hnsw, input, query, search_queries, rerank_original, bf, use_groundtruth ? &ground_truth : nullptr, no_nearest, output_file);
         }
+
+        output.close();
     }
     else
     {
@@ -211,4 +350,4 @@ int main(int argc, char *argv[])
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
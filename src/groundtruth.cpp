@@ -0,0 +1,95 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "argh.h"
+#include "groundtruth.h"
+#include "mnist.h"
+#include "stream.h"
+
+#define K_DEFAULT 100
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Exact Ground Truth for Query Files
+
+Usage:
+groundtruth [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors.
+-q, --query <query_file>     Query MNIST format file for nearest neighbor search.
+-o, --output <output_file>   Output file to store the ground truth.
+-k, --num-nearest <k>        Number of exact nearest neighbors to store per query (default: 100).
+-t, --threads <t>            Number of threads to use (default: all cores).
+--stream                     Stream the input file block by block instead of loading it, for inputs larger than the memory.
+--block-size <b>             Number of input images per streamed block (default: 16384).
+--vptree                     Answer the queries with an exact VP-tree instead of scanning the whole input per query.
+
+Description:
+This command line tool computes the exact k nearest neighbors of every query once, in parallel
+and in cache-sized batches, and stores them in a binary file together with fingerprints of the
+input and query files. The lsh, cube and graph_search tools accept the file with --groundtruth
+and skip Brute Force entirely.
+
+Example Usage:
+groundtruth -i data/input.1K.dat -q data/query.1K.dat -o output/query.1K.gt -k 100
+groundtruth -i data/input.1K.dat -q data/query.1K.dat -o output/query.1K.gt -k 100 --stream
+groundtruth -i data/input.1K.dat -q data/query.1K.dat -o output/query.1K.gt -k 100 --vptree
+)""";
+#pragma endregion
+
+int main(int argc, char *argv[])
+{
+    string input_file;  // Input MNIST format file containing data vectors.
+    string query_file;  // Query MNIST format file for nearest neighbor search.
+    string output_file; // Output file to store the ground truth.
+    int no_nearest;     // Number of exact nearest neighbors per query (default: 100).
+    int no_threads;     // Number of threads to use.
+    bool stream;        // Stream the input file instead of loading it.
+    bool vptree;        // Answer the queries with a VP-tree.
+    size_t block_size;  // Number of input images per streamed block.
+
+    // Parse the command line arguments using the argh.h functionality.
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}) >> input_file;
+    cmdl({"-q", "--query"}) >> query_file;
+    cmdl({"-o", "--output"}) >> output_file;
+    cmdl({"-k", "--num-nearest"}, K_DEFAULT) >> no_nearest;
+    cmdl({"-t", "--threads"}, max(thread::hardware_concurrency(), 1u)) >> no_threads;
+    cmdl({"--block-size"}, STREAM_BLOCK) >> block_size;
+    stream = cmdl[{"--stream"}];
+    vptree = cmdl[{"--vptree"}];
+
+    // In the following cases, print the help message.
+    if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty() || (stream && vptree))
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    MNIST query = MNIST(query_file);
+
+    cout << "[i] Computing the ground truth" << endl;
+    GroundTruth ground_truth;
+    if (stream)
+    {
+        MNIST_Stream input(input_file, block_size);
+        ground_truth.ComputeStreaming(input, query, no_nearest, no_threads);
+    }
+    else
+    {
+        MNIST input = MNIST(input_file);
+        if (vptree)
+            ground_truth.ComputeVPTree(input, query, no_nearest, no_threads);
+        else
+            ground_truth.Compute(input, query, no_nearest, no_threads);
+    }
+    ground_truth.Save(output_file);
+    cout << "[i] Saved the ground truth to " << output_file << endl;
+
+    return EXIT_SUCCESS;
+}
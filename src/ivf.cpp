@@ -0,0 +1,218 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "argh.h"
+#include "brute.h"
+#include "groundtruth.h"
+#include "ivf.h"
+#include "mnist.h"
+#include "misc.h"
+#include "pq.h"
+#include "timing.h"
+
+#define N_DEFAULT 1
+#define R_DEFAULT 10000
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+IVF Index for Vectors in d-Space
+
+Usage:
+ivf [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors.
+-q, --query <query_file>     Query MNIST format file for nearest neighbor search.
+-o, --output <output_file>   Output file to store the results.
+-l, --nlist <nlist>          Number of inverted lists, trained with k-Means (default: 128).
+-p, --nprobe <nprobe>        Number of nearest lists scanned per query (default: 8).
+-N, --num-nearest <N>        Number of nearest points to search for (default: 1).
+-R, --radius <R>             Search radius for range query (default: 10000).
+--groundtruth <gt_file>      Ground truth file created by the groundtruth tool, replaces Brute Force.
+--pq <m>                     Store PQ codes of the residuals with m subspaces, m must divide the dimension (default: 0, off).
+--rerank <r>                 Number of best PQ scoring candidates reranked exactly (default: 100).
+-t, --threads <t>            Number of threads used to build the index (default: all cores).
+--seed <seed>                Seed of the k-Means and PQ training (default: random).
+
+Description:
+This command line tool implements an inverted file (IVF) index for vectors in d-space.
+The dataset is partitioned with k-Means, and every query only scans the lists of its nearest centroids.
+It can be used to find the nearest neighbors of a query vector or to perform range queries within a specified radius.
+
+Example Usage:
+ivf -i data/train-images.idx3-ubyte -q data/t10k-images.idx3-ubyte -o results.txt -l 256 -p 16 -N 5 -R 5000
+
+Note:
+The input and query files can be MNIST idx3, fvecs, bvecs, ivecs or raw float32/uint8 (.f32/.u8) files,
+the format is detected from the file.
+)""";
+#pragma endregion
+
+int main(int argc, char *argv[])
+{
+    string input_file;     // Input MNIST format file containing data vectors.
+    string query_file;     // Query MNIST format file for nearest neighbor search.
+    string output_file;    // Output file to store the results.
+    int no_lists;          // Number of inverted lists (default: 128).
+    int no_probes;         // Number of nearest lists scanned per query (default: 8).
+    int no_nearest;        // Number of nearest points to search for (default: 1).
+    int radius;            // Search radius for range query (default: 10000).
+    string groundtruth_file; // Ground truth file that replaces Brute Force.
+    int no_subspaces;        // Number of PQ subspaces, 0 disables PQ.
+    int rerank;              // Number of best PQ scoring candidates reranked exactly.
+    int no_threads;          // Number of threads used to build the index.
+    unsigned int seed;       // Seed of the k-Means and PQ training.
+
+    // Parse the command line arguments using the argh.h functionality.
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}) >> input_file;
+    cmdl({"-q", "--query"}) >> query_file;
+    cmdl({"-o", "--output"}) >> output_file;
+    cmdl({"-l", "--nlist"}, IVF_LISTS) >> no_lists;
+    cmdl({"-p", "--nprobe"}, IVF_PROBES) >> no_probes;
+    cmdl({"-N", "--num-nearest"}, N_DEFAULT) >> no_nearest;
+    cmdl({"-R", "--radius"}, R_DEFAULT) >> radius;
+    cmdl({"--groundtruth"}) >> groundtruth_file;
+    cmdl({"--pq"}, 0) >> no_subspaces;
+    cmdl({"--rerank"}, PQ_RERANK) >> rerank;
+    cmdl({"-t", "--threads"}, max(thread::hardware_concurrency(), 1u)) >> no_threads;
+    cmdl({"--seed"}, random_device()()) >> seed;
+
+    // In the following cases, print the help message.
+    if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty())
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Create the required class instances.
+    MNIST input = MNIST(input_file);
+    MNIST query = MNIST(query_file);
+    bool use_groundtruth = !groundtruth_file.empty();
+    BRUTE bf = BRUTE(use_groundtruth ? MNIST() : input);
+    GroundTruth ground_truth;
+    vector<MNIST_Image> input_images;
+    if (use_groundtruth)
+    {
+        ground_truth.Load(groundtruth_file, input, query);
+        input_images = input.GetImages();
+    }
+    if (use_groundtruth && ground_truth.GetK() < no_nearest)
+    {
+        cout << "[!] The ground truth holds " << ground_truth.GetK() << " neighbors per query, fewer than the " << no_nearest << " searched." << endl;
+        return EXIT_FAILURE;
+    }
+    IVF ivf = IVF(input, no_lists, no_probes, no_threads, seed);
+    if (no_subspaces > 0)
+        ivf.EnablePQ(no_subspaces, rerank, no_threads, seed);
+    ofstream output(output_file, ios::out | ios::trunc);
+    Stopwatch stopwatch;
+    uint64_t elapsed_ns;
+    double time;
+    double time_aprox_sum = 0;
+    double time_brute_sum = 0;
+    LatencyHistogram approximate_latencies, brute_latencies; // The per-query wall-clock latencies.
+    double max_maf = 0;
+
+    // Print results in output file.
+    if (output.is_open())
+    {
+        output << "IVF Results" << endl;
+        cout << "[i] Calculating Results" << endl;
+        printProgress(0.0);
+        for (MNIST_Image query_image : query.GetImages())
+        {
+            output << "===" << endl;
+            output << "Query: " << query_image.GetIndex() << endl;
+
+            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using the IVF index.
+            stopwatch.Restart();
+            set<MNIST_Image, MNIST_ImageComparator> ivf_nn = ivf.FindNearestNeighbors(no_nearest, query_image);
+            elapsed_ns = stopwatch.ElapsedNanoseconds();
+            time = elapsed_ns / 1e9;
+            time_aprox_sum += time;
+            approximate_latencies.Record(elapsed_ns);
+            output << "timeIVF: " << time << "s" << endl;
+
+            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using the ground truth or Brute Force.
+            set<MNIST_Image, MNIST_ImageComparator> brute_nn;
+            if (use_groundtruth)
+            {
+                brute_nn = ground_truth.FindNearestNeighbors(no_nearest, query_image.GetIndex(), input_images);
+            }
+            else
+            {
+                stopwatch.Restart();
+                brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
+                elapsed_ns = stopwatch.ElapsedNanoseconds();
+                time = elapsed_ns / 1e9;
+                time_brute_sum += time;
+                brute_latencies.Record(elapsed_ns);
+                output << "timeBRUTE: " << time << "s" << endl;
+            }
+
+            // Print Comparison Stats between IVF and Brute Force.
+            int i = 1;
+            for (auto it1 = ivf_nn.begin(), it2 = brute_nn.begin();
+                 (it1 != ivf_nn.end()) && (it2 != brute_nn.end());
+                 it1++, it2++)
+            {
+                MNIST_Image neighbor_ivf = *it1;
+                MNIST_Image neighbor_brute = *it2;
+
+                if (i == 1)
+                {
+                    double maf = static_cast<double>(neighbor_ivf.GetDist()) / static_cast<double>(neighbor_brute.GetDist());
+                    if (maf > max_maf)
+                        max_maf = maf;
+                }
+
+                output << "NN-" << i << " Index: " << neighbor_ivf.GetIndex() << endl;
+                output << "distanceIVF: " << neighbor_ivf.GetDist() << endl;
+                output << "distanceBRUTE: " << neighbor_brute.GetDist() << endl;
+                i++;
+            }
+
+            // Find the Neighbors inside the radius.
+            set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = ivf.RadiusSearch(query_image, radius);
+            output << "Radius: " << radius << endl;
+            for (auto it = neighbors_in_radius.begin(); it != neighbors_in_radius.end(); ++it)
+            {
+                MNIST_Image neighbor = *it;
+
+                output << neighbor.GetIndex() << endl;
+            }
+            printProgress(static_cast<double>(query_image.GetIndex()) / query.GetImages().size());
+        }
+        printProgress(1.0);
+        cout << endl
+             << "[i] Finished Calculating Results" << endl;
+        output << "===" << endl;
+        output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
+        if (!use_groundtruth)
+            output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+        approximate_latencies.WriteSummary(output, "Approximate");
+        if (!use_groundtruth)
+            brute_latencies.WriteSummary(output, "Brute");
+        output << "MAF: " << max_maf << endl;
+        output.close();
+
+        // Dump the latency percentiles next to the results file
+        vector<pair<string, const LatencyHistogram *>> latencies = {{"IVF", &approximate_latencies}};
+        if (!use_groundtruth)
+            latencies.push_back({"BRUTE", &brute_latencies});
+        WriteLatencies(output_file + ".latency.json", latencies);
+    }
+    else
+    {
+        cout << "Failed to write to output file." << endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
\ No newline at end of file
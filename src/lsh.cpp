@@ -5,9 +5,14 @@
 
 #include "argh.h"
 #include "brute.h"
+#include "groundtruth.h"
 #include "lsh.h"
 #include "mnist.h"
 #include "misc.h"
+#include "pq.h"
+#include "projection.h"
+#include "stats.h"
+#include "timing.h"
 
 #define K_DEFAULT 4
 #define L_DEFAULT 5
@@ -32,6 +37,14 @@ Options:
 -L, --hash-tables <L>        Number of hash tables to use (default: 5).
 -N, --num-nearest <N>        Number of nearest points to search for (default: 1).
 -R, --radius <R>             Search radius for range query (default: 10000).
+--groundtruth <gt_file>      Ground truth file created by the groundtruth tool, replaces Brute Force.
+--pq <m>                     Score the candidates with a PQ codec of m subspaces, m must divide the dimension (default: 0, off).
+--rerank <r>                 Number of best PQ scoring candidates reranked exactly (default: 100).
+--reduce <pca|rp>            Reduce the vectors with PCA or sparse random projection before indexing them (default: off).
+--components <d>             Number of components the vectors are reduced to (default: 64).
+--rerank-original <r>        Search r neighbors in the reduced space and rerank them in the original one (default: N),
+                             the distances reported are always the ones in the original space.
+--seed <seed>                Seed of the hash functions and of the reduction (default: random).
 
 Description:
 This command line tool implements the Locality-Sensitive Hashing (LSH) algorithm for vectors in d-space.
@@ -41,7 +54,8 @@ Example Usage:
 lsh -i data/train-images.idx3-ubyte -q data/t10k-images.idx3-ubyte -k 15 -L 10 -N 5 -R 5000
 
 Note:
-The input and query files should be in the MNIST format.
+The input and query files can be MNIST idx3, fvecs, bvecs, ivecs or raw float32/uint8 (.f32/.u8) files,
+the format is detected from the file.
 )""";
 #pragma endregion
 
@@ -54,6 +68,13 @@ int main(int argc, char *argv[])
     int no_hash_tables;    // Number of hash tables to use (default: 5).
     int no_nearest;        // Number of nearest points to search for (default: 1).
     int radius;            // Search radius for range query (default: 10000).
+    string groundtruth_file; // Ground truth file that replaces Brute Force.
+    int no_subspaces;        // Number of PQ subspaces, 0 disables PQ.
+    int rerank;              // Number of best PQ scoring candidates reranked exactly.
+    string reduce;           // Dimensionality reduction method, empty for none.
+    int no_components;       // Number of components the vectors are reduced to.
+    int rerank_original;     // Number of reduced space neighbors reranked in the original space, at least N.
+    unsigned int seed;       // Seed of the hash functions and of the reduction.
 
     // Parse the command line arguments using the argh.h functionality.
     argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
@@ -64,6 +85,13 @@ int main(int argc, char *argv[])
     cmdl({"-L", "--hash-tables"}, L_DEFAULT) >> no_hash_tables;
     cmdl({"-N", "--num-nearest"}, N_DEFAULT) >> no_nearest;
     cmdl({"-R", "--radius"}, R_DEFAULT) >> radius;
+    cmdl({"--groundtruth"}) >> groundtruth_file;
+    cmdl({"--pq"}, 0) >> no_subspaces;
+    cmdl({"--rerank"}, PQ_RERANK) >> rerank;
+    cmdl({"--reduce"}) >> reduce;
+    cmdl({"--components"}, PROJECTION_COMPONENTS) >> no_components;
+    cmdl({"--rerank-original"}, 0) >> rerank_original;
+    cmdl({"--seed"}, random_device()()) >> seed;
 
     // In the following cases, print the help message.
     if (cmdl({"-h", "--help"}) || input_file.empty() || query_file.empty() || output_file.empty())
@@ -75,14 +103,50 @@ int main(int argc, char *argv[])
     // Create the required class instances.
     MNIST input = MNIST(input_file);
     MNIST query = MNIST(query_file);
-    LSH lsh = LSH(input, no_hash_functions, no_hash_tables);
-    BRUTE bf = BRUTE(input);
+    bool use_groundtruth = !groundtruth_file.empty();
+    BRUTE bf = BRUTE(use_groundtruth ? MNIST() : input);
+    GroundTruth ground_truth;
+    vector<MNIST_Image> input_images;
+    if (use_groundtruth)
+    {
+        ground_truth.Load(groundtruth_file, input, query);
+        input_images = input.GetImages();
+    }
+    if (use_groundtruth && ground_truth.GetK() < no_nearest)
+    {
+        cout << "[!] The ground truth holds " << ground_truth.GetK() << " neighbors per query, fewer than the " << no_nearest << " searched." << endl;
+        return EXIT_FAILURE;
+    }
+    // Reduce the dataset and the queries once, LSH then hashes and compares the reduced vectors.
+    MNIST reduced_input, reduced_query;
+    vector<MNIST_Image> original_images;
+    if (!reduce.empty())
+    {
+        Projection projection = Projection(input, reduce, no_components, seed);
+        reduced_input = projection.Transform(input);
+        reduced_query = projection.Transform(query);
+        original_images = input.GetImages();
+    }
+    MNIST &search_input = reduce.empty() ? input : reduced_input;
+    vector<MNIST_Image> search_queries = (reduce.empty() ? query : reduced_query).GetImages();
+    LSH lsh = LSH(search_input, no_hash_functions, no_hash_tables, seed);
+    // Train the PQ codec on the dataset, its codes replace the exact distances of the candidates.
+    PQ pq;
+    if (no_subspaces > 0)
+    {
+        pq = PQ(search_input, no_subspaces, rerank, max(thread::hardware_concurrency(), 1u));
+        lsh.SetPQ(&pq);
+    }
     ofstream output(output_file, ios::out | ios::trunc);
-    clock_t start, end;
+    Stopwatch stopwatch;
+    uint64_t elapsed_ns;
     double time;
     double time_aprox_sum = 0;
     double time_brute_sum = 0;
+    LatencyHistogram approximate_latencies, brute_latencies; // The per-query wall-clock latencies.
     double max_maf = 0;
+    // The per-query search counters, only recorded when built with SEARCH_STATS.
+    StatsCollector lsh_stats("LSH"), brute_stats("BRUTE");
 
     // Print results in output file.
     if (output.is_open())
@@ -94,22 +158,44 @@ int main(int argc, char *argv[])
         {
             output << "===" << endl;
             output << "Query: " << query_image.GetIndex() << endl;
+            MNIST_Image search_image = search_queries[query_image.GetIndex()];
 
             // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Locality-Sensitive Hashing.
-            start = clock();
-            set<MNIST_Image, MNIST_ImageComparator> lsh_nn = lsh.FindNearestNeighbors(no_nearest, query_image);
-            end = clock();
-            time = double(end - start) / CLOCKS_PER_SEC;
+            stopwatch.Restart();
+            set<MNIST_Image, MNIST_ImageComparator> lsh_nn;
+            if (!reduce.empty())
+            {
+                lsh_nn = lsh.FindNearestNeighbors(max(rerank_original, no_nearest), search_image);
+                lsh_nn = RerankOriginal(lsh_nn, query_image.GetImageData(), original_images, no_nearest);
+            }
+            else
+            {
+                lsh_nn = lsh.FindNearestNeighbors(no_nearest, search_image);
+            }
+            elapsed_ns = stopwatch.ElapsedNanoseconds();
+            lsh_stats.Add(ThreadQueryContext().stats);
+            time = elapsed_ns / 1e9;
             time_aprox_sum += time;
+            approximate_latencies.Record(elapsed_ns);
             output << "timeLSH: " << time << "s" << endl;
 
-            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using Brute Force.
-            start = clock();
-            set<MNIST_Image, MNIST_ImageComparator> brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
-            end = clock();
-            time = double(end - start) / CLOCKS_PER_SEC;
-            time_brute_sum += time;
-            output << "timeBRUTE: " << time << "s" << endl;
+            // Find the {no_neighbors} "Nearest Neighbors" vectors of the queried one using the ground truth or Brute Force.
+            set<MNIST_Image, MNIST_ImageComparator> brute_nn;
+            if (use_groundtruth)
+            {
+                brute_nn = ground_truth.FindNearestNeighbors(no_nearest, query_image.GetIndex(), input_images);
+            }
+            else
+            {
+                stopwatch.Restart();
+                brute_nn = bf.FindNearestNeighbors(no_nearest, query_image);
+                elapsed_ns = stopwatch.ElapsedNanoseconds();
+                brute_stats.Add(ThreadQueryContext().stats);
+                time = elapsed_ns / 1e9;
+                time_brute_sum += time;
+                brute_latencies.Record(elapsed_ns);
+                output << "timeBRUTE: " << time << "s" << endl;
+            }
 
             // Print Comparison Stats between LSH and Brute Force.
             int i = 1;
@@ -134,7 +220,7 @@ int main(int argc, char *argv[])
             }
 
             // Find the Neighbors inside the radius.
-            set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = lsh.RadiusSearch(query_image, radius);
+            set<MNIST_Image, MNIST_ImageComparator> neighbors_in_radius = lsh.RadiusSearch(search_image, radius);
             output << "Radius: " << radius << endl;
             for (auto it = neighbors_in_radius.begin(); it != neighbors_in_radius.end(); ++it)
             {
@@ -149,9 +235,28 @@ int main(int argc, char *argv[])
              << "[i] Finished Calculating Results" << endl;
         output << "===" << endl;
         output << "tAverageApproximate: " << time_aprox_sum / query.GetImages().size() << endl;
-        output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+        if (!use_groundtruth)
+            output << "tAverageBrute: " << time_brute_sum / query.GetImages().size() << endl;
+        approximate_latencies.WriteSummary(output, "Approximate");
+        if (!use_groundtruth)
+            brute_latencies.WriteSummary(output, "Brute");
         output << "MAF: " << max_maf << endl;
         output.close();
+
+        // Dump the latency percentiles next to the results file
+        vector<pair<string, const LatencyHistogram *>> latencies = {{"LSH", &approximate_latencies}};
+        if (!use_groundtruth)
+            latencies.push_back({"BRUTE", &brute_latencies});
+        WriteLatencies(output_file + ".latency.json", latencies);
+
+        // Dump the search counters next to the results file
+        if (SearchStatsEnabled())
+        {
+            vector<const StatsCollector *> collectors = {&lsh_stats};
+            if (!use_groundtruth)
+                collectors.push_back(&brute_stats);
+            WriteSearchStats(output_file + ".stats.json", collectors);
+        }
     }
     else
     {
@@ -0,0 +1,264 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "argh.h"
+#include "brute.h"
+#include "context.h"
+#include "cube.h"
+#include "gnns.h"
+#include "hnsw.h"
+#include "ivf.h"
+#include "lsh.h"
+#include "mnist.h"
+#include "mrng.h"
+#include "server.h"
+#include "timing.h"
+#include "vptree.h"
+
+using namespace std;
+
+#pragma region HELP_MESSAGE
+const char *help_msg = R"""(
+Nearest Neighbor Query Server
+
+Usage:
+server [options]
+
+Options:
+-h, --help                   Print the help message.
+-i, --input <input_file>     Input MNIST format file containing data vectors.
+-m, --method <method>        Index answering the requests: lsh, cube, ivf, gnns, mrng, hnsw, vptree or brute (default: lsh).
+-s, --socket <path>          Listen on a Unix domain socket, else answer the requests of stdin to stdout.
+-w, --workers <w>            Number of workers answering the requests (default: the number of cores).
+-b, --batch <b>              Number of queued requests that a worker answers at once (default: 32).
+-k, --hash-functions <k>     LSH: number of hash functions (default: 4).
+-L, --hash-tables <L>        LSH: number of hash tables (default: 5).
+--cube-dimensions <d>        Hypercube: dimension of the cube (default: 14).
+-M, --candidates <M>         Hypercube: max number of candidates (default: 10).
+--probes <p>                 Hypercube: number of probes (default: 2).
+--seed <seed>                LSH, Hypercube, IVF, GNNS, HNSW: seed of the hash functions, projections, k-Means or graph (default: random).
+--nlist <l>                  IVF: number of inverted lists (default: 128).
+--nprobe <p>                 IVF: number of lists scanned (default: 8).
+--num-neighbors <k>          GNNS: number of LSH neighbors of every node (default: 50).
+-E, --num-expansions <E>     GNNS: number of expansions (default: 30).
+-R, --num-restarts <R>       GNNS: number of random restarts (default: 1).
+-l, --num-candidates <l>     MRNG: number of candidates (default: 20).
+--max-connections <M>        HNSW: max neighbors of a node per layer (default: 16).
+--ef-construction <ef>       HNSW: size of the candidate list while building (default: 200).
+--ef-search <ef>             HNSW: size of the candidate list while searching (default: 50).
+--load-index <index_file>    HNSW: load the graph saved by graph_search --save-index instead of building it.
+
+Description:
+Builds the index once, then answers kNN and range requests until a shutdown request, SIGINT or SIGTERM,
+or until stdin ends. The requests are binary, in the native (little-endian) byte order:
+
+  request:  type u8 (0 kNN, 1 range, 2 shutdown), element u8 (0 float32, 1 uint8), dimensions u16,
+            id u32, k or radius u32, then {dimensions} coordinates of the element type (none for shutdown).
+  response: id u32, status u8 (0 ok, 1 bad request, 2 unsupported, 3 error), 3 padding bytes, count u32,
+            then {count} times index u32, distance f32, by increasing distance.
+
+A k larger than the dataset is answered with every image that the index finds. A search that fails is
+answered with status 3 and no neighbors, and the server goes on.
+
+The dimensions must be the ones that the tools were built for. Only lsh, cube, ivf and vptree answer
+range requests. The workers answer the requests in batches, so the responses of a connection may come
+out of order, their ids match them to the requests. In stdin mode every message goes to stderr.
+The coordinates are compared as the tools load them, so the pixels of idx3 images are in reverse order.
+
+Example Usage:
+server -i data/input.1K.dat -m hnsw -s /tmp/nn.sock -w 4
+)""";
+#pragma endregion
+
+// Stop serving once the queued requests are answered.
+void StopServer(int)
+{
+    server_signal = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    string input_file;     // Input MNIST format file containing data vectors.
+    string method;         // Index answering the requests.
+    string socket_path;    // Unix domain socket to listen on, empty for stdin.
+    int no_workers;        // Number of workers answering the requests.
+    int batch_size;        // Number of queued requests that a worker answers at once.
+    int no_hash_functions; // LSH: number of hash functions.
+    int no_hash_tables;    // LSH: number of hash tables.
+    int cube_dimensions;   // Hypercube: dimension of the cube.
+    int candidates;        // Hypercube: max number of candidates.
+    int probes;            // Hypercube: number of probes.
+    unsigned int seed;     // LSH, Hypercube, IVF, GNNS, HNSW: seed of the hash functions, projections, k-Means or graph.
+    int no_lists;          // IVF: number of inverted lists.
+    int no_probes;         // IVF: number of lists scanned.
+    int no_neighbors;      // GNNS: number of LSH neighbors of every node.
+    int no_expansions;     // GNNS: number of expansions.
+    int no_restarts;       // GNNS: number of random restarts.
+    int no_candidates;     // MRNG: number of candidates.
+    int max_connections;   // HNSW: max neighbors of a node per layer.
+    int ef_construction;   // HNSW: size of the candidate list while building.
+    int ef_search;         // HNSW: size of the candidate list while searching.
+    string load_index;     // HNSW: file to load the graph from.
+
+    // Parse the command line arguments using the argh.h functionality.
+    argh::parser cmdl(argc, argv, argh::parser::PREFER_PARAM_FOR_UNREG_OPTION);
+    cmdl({"-i", "--input"}) >> input_file;
+    cmdl({"-m", "--method"}, "lsh") >> method;
+    cmdl({"-s", "--socket"}) >> socket_path;
+    cmdl({"-w", "--workers"}, max(thread::hardware_concurrency(), 1u)) >> no_workers;
+    cmdl({"-b", "--batch"}, SERVER_BATCH) >> batch_size;
+    cmdl({"-k", "--hash-functions"}, 4) >> no_hash_functions;
+    cmdl({"-L", "--hash-tables"}, 5) >> no_hash_tables;
+    cmdl({"--cube-dimensions"}, 14) >> cube_dimensions;
+    cmdl({"-M", "--candidates"}, 10) >> candidates;
+    cmdl({"--probes"}, 2) >> probes;
+    cmdl({"--seed"}, random_device()()) >> seed;
+    cmdl({"--nlist"}, IVF_LISTS) >> no_lists;
+    cmdl({"--nprobe"}, IVF_PROBES) >> no_probes;
+    cmdl({"--num-neighbors"}, 50) >> no_neighbors;
+    cmdl({"-E", "--num-expansions"}, 30) >> no_expansions;
+    cmdl({"-R", "--num-restarts"}, 1) >> no_restarts;
+    cmdl({"-l", "--num-candidates"}, 20) >> no_candidates;
+    cmdl({"--max-connections"}, 16) >> max_connections;
+    cmdl({"--ef-construction"}, 200) >> ef_construction;
+    cmdl({"--ef-search"}, 50) >> ef_search;
+    cmdl({"--load-index"}) >> load_index;
+
+    // In the following cases, print the help message.
+    if (cmdl({"-h", "--help"}) || input_file.empty())
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    // In stdin mode the responses keep the real stdout, every message of the tool goes to stderr instead.
+    int in_fd = -1, out_fd = -1;
+    if (socket_path.empty())
+    {
+        in_fd = STDIN_FILENO;
+        out_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    // Build the index once, the searches only read it.
+    MNIST input = MNIST(input_file);
+    QueryServer::SearchFunction knn, range;
+    unique_ptr<LSH> lsh;
+    unique_ptr<Hypercube> hypercube;
+    unique_ptr<IVF> ivf;
+    unique_ptr<GNNS> gnns;
+    unique_ptr<MRNG> mrng;
+    unique_ptr<HNSW> hnsw;
+    unique_ptr<VPTree> tree;
+    unique_ptr<BRUTE> bf;
+    if (method == "lsh")
+    {
+        lsh.reset(new LSH(input, no_hash_functions, no_hash_tables, seed));
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { lsh->Search(q, k, c); };
+        range = [&](const IMAGE_DATA &q, int r, QueryContext &c) { lsh->RadiusSearch(q, r, c); };
+    }
+    else if (method == "cube")
+    {
+        hypercube.reset(new Hypercube(input, cube_dimensions, candidates, probes, seed));
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { hypercube->Search(q, k, c); };
+        range = [&](const IMAGE_DATA &q, int r, QueryContext &c) { hypercube->RadiusSearch(q, r, c); };
+    }
+    else if (method == "ivf")
+    {
+        ivf.reset(new IVF(input, no_lists, no_probes, no_workers, seed));
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { ivf->Search(q, k, c); };
+        range = [&](const IMAGE_DATA &q, int r, QueryContext &c) { ivf->RadiusSearch(q, r, c); };
+    }
+    else if (method == "gnns")
+    {
+        gnns.reset(new GNNS(input, no_neighbors, no_expansions, no_restarts, seed));
+        gnns->Initialization();
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { gnns->Search(q, k, c); };
+    }
+    else if (method == "mrng")
+    {
+        mrng.reset(new MRNG(input, no_candidates));
+        mrng->Initialization();
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { mrng->Search(q, k, c); };
+    }
+    else if (method == "hnsw")
+    {
+        hnsw.reset(new HNSW(input, max_connections, ef_construction, ef_search, no_workers, seed));
+        if (!load_index.empty())
+            hnsw->Load(load_index);
+        else
+            hnsw->Initialization();
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { hnsw->Search(q, k, c); };
+    }
+    else if (method == "vptree")
+    {
+        tree.reset(new VPTree(input));
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { tree->Search(q, k, c); };
+        range = [&](const IMAGE_DATA &q, int r, QueryContext &c) { tree->RadiusSearch(q, r, c); };
+    }
+    else if (method == "brute")
+    {
+        bf.reset(new BRUTE(input));
+        knn = [&](const IMAGE_DATA &q, int k, QueryContext &c) { bf->Search(q, k, c); };
+    }
+    else
+    {
+        cout << help_msg << endl;
+        return EXIT_FAILURE;
+    }
+
+    // A client that hangs up must not kill the server, and the signals stop it gracefully.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action = {};
+    action.sa_handler = StopServer;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    int listen_fd = -1;
+    if (!socket_path.empty())
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path))
+            throw runtime_error("The socket path " + socket_path + " is too long.\n");
+        socket_path.copy(address.sun_path, socket_path.size());
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socket_path.c_str());
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0)
+            throw runtime_error("Failed to listen on " + socket_path + ".\n");
+    }
+
+    cout << "[i] Serving " << method << " requests " << (socket_path.empty() ? "from stdin" : "on " + socket_path)
+         << " with " << no_workers << " workers" << endl;
+
+    QueryServer server(knn, range, input.GetImagesCount(), no_workers, batch_size);
+    Stopwatch stopwatch;
+    server.Serve(listen_fd, in_fd, out_fd);
+    double serving_sec = stopwatch.ElapsedSeconds();
+
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+    if (out_fd >= 0)
+        close(out_fd);
+
+    // The latencies include the time that the requests waited in the queue, the throughput is over the whole serving time.
+    LatencyHistogram latencies = server.GetLatencies();
+    cout << "[i] Answered " << latencies.GetCount() << " requests in " << serving_sec << "s ("
+         << latencies.GetCount() / serving_sec << " requests/s)" << endl;
+    cout << "[i] Latency: p50 " << latencies.GetPercentile(50) << "s, p90 " << latencies.GetPercentile(90) << "s, p99 "
+         << latencies.GetPercentile(99) << "s, p99.9 " << latencies.GetPercentile(99.9) << "s, max " << latencies.GetMax() << "s" << endl;
+
+    return EXIT_SUCCESS;
+}